@@ -19,31 +19,71 @@
 #include "lwip/pbuf.h"
 #include "lwip/netif.h"
 #include "dtn_module.h"
+#include "dtn_storage.h"
+#include "dtn_pacer.h"
+#include "dtn_local_addr.h"
+#include "dtn_forward_tracker.h"
+#include "dtn_rtt.h"
 #include <stdbool.h> 
 
-#define MAX_DESTINATIONS 10
-#define FORWARDING_RETRY_DELAY_MS 30000  // 30 seconds delay between retransmissions
-#define MAX_FORWARDING_RETRIES 10 // Max retries
+#define DTN_SCHEDULE_PENDING_READS 64   // scheduled packets whose read from disk is in flight
+#define DTN_BATCH_ROUTE_CACHE 16        // CGR results shared by the packets of one ingress batch
 
+// A stored packet picked for transmission, with the contact it was given time on
 typedef struct {
-    ip6_addr_t destination;
-    u32_t last_attempt_time;
-    int retry_count; 
+    Stored_Packet_Entry* entry;
+    struct Contact_Info* contact;
+    ip6_addr_t next_hop;
+    u32_t time_left_ms;     // lifetime left when it was scheduled
+} DTN_Schedule_Candidate;
+
+// Next hop chosen when a packet was scheduled, reused once it has been read back from disk
+typedef struct {
+    u32_t file_id;
+    ip6_addr_t next_hop;
     bool is_valid;
-} ForwardingAttempt;
+} DTN_Scheduled_Read;
+
+// CGR result for the packets of an ingress batch going the same way
+typedef struct {
+    ip6_addr_t dest;
+    ip6_addr_t sender;
+    u32_t v_tc_fl;
+    u8_t hoplim;
+    int contact_available;
+    ip6_addr_t next_hop;
+} DTN_Route_Cache_Entry;
 
 typedef struct DTN_Controller {
     DTN_Module* parent_module;
-    ForwardingAttempt forwarding_attempts[MAX_DESTINATIONS];
+    DTN_Forward_Tracker forward_tracker;    // attempts and backoff per destination
+    DTN_Rtt_Table rtt;              // custody acknowledgement round trips per next hop, set the backoff
+    struct netif* forward_netif;    // netif stored packets are forwarded from, kept for asynchronous reads
+    DTN_Pacer pacer;                // DTN traffic leaves at the rate of the contact it uses
+    DTN_Local_Addr_Set local_addrs; // addresses of the lwIP netifs, packets for them are delivered locally
+
+    // Earliest-deadline-first schedule of the stored packets that are due
+    DTN_Schedule_Candidate* schedule;
+    size_t schedule_capacity;
+    DTN_Scheduled_Read scheduled_reads[DTN_SCHEDULE_PENDING_READS];
+    u32_t scheduled_reads_next;
+
+    // Only filled while an ingress batch is processed
+    DTN_Route_Cache_Entry route_cache[DTN_BATCH_ROUTE_CACHE];
+    int route_cache_count;
+    bool in_batch;
 } DTN_Controller;
 
 DTN_Controller* dtn_controller_create(DTN_Module* parent);
 void dtn_controller_destroy(DTN_Controller* controller);
 void dtn_controller_process_incoming(DTN_Controller* controller, struct pbuf *p, struct netif *inp_netif);
+void dtn_controller_process_incoming_batch(DTN_Controller* controller, struct pbuf **packets, int count, struct netif *inp_netif);
 void dtn_controller_attempt_forward_stored(DTN_Controller* controller, struct netif *netif_out);
+void dtn_controller_forward_due(DTN_Controller* controller);
+void dtn_controller_forward_stored_entry(DTN_Controller* controller, Stored_Packet_Entry* entry);
 void dtn_controller_remove_tracking(DTN_Controller* controller, const ip6_addr_t* dest_addr);
+void dtn_controller_custody_acked(DTN_Controller* controller, const ip6_addr_t* dest_addr, const ip6_addr_t* acked_by);
 
-static bool is_next_hop_active_contact(Routing_Function *routing, ip6_addr_t *next_hop_ip);
-int dtn_controller_process_icmpv6(DTN_Controller* controller, struct pbuf *p, struct netif *inp_netif);
+int dtn_controller_process_icmpv6(DTN_Controller* controller, struct pbuf *p, const DTN_Packet_Info *info, struct netif *inp_netif);
 
 #endif
\ No newline at end of file
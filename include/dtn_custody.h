@@ -24,6 +24,8 @@
 #define CUSTODY_OPTION_TYPE 0x1E
 // Hop-by-Hop header length in bytes (must be multiple of 8)
 #define HBH_OPT_HDR_LEN 24
+// Room reserved in front of ingress packets (pbuf_alloc layer), so the option is inserted in place
+#define DTN_CUSTODY_HEADROOM ((pbuf_layer)HBH_OPT_HDR_LEN)
 
 bool dtn_add_custodian_option(struct pbuf **p, const ip6_addr_t *custodian);
 
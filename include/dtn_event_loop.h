@@ -0,0 +1,49 @@
+// dtn_event_loop.h: Header file for the epoll-based event loop driving the TUN device, sockets and timers
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_EVENT_LOOP_H
+#define DTN_EVENT_LOOP_H
+
+#include <stdbool.h>
+#include "lwip/arch.h"
+
+#define DTN_EVENT_LOOP_MAX_EVENTS 32        // events taken from the kernel per wakeup
+#define DTN_EVENT_LOOP_NO_TIMEOUT 0xFFFFFFFF
+
+typedef void (*DTN_Event_Callback)(int fd, u32_t events, void* arg);
+
+// One registered descriptor, epoll hands it back with every event
+typedef struct DTN_Event_Handler {
+    int fd;
+    DTN_Event_Callback callback;
+    void *arg;
+    struct DTN_Event_Handler *next;
+} DTN_Event_Handler;
+
+typedef struct DTN_Event_Loop {
+    int epoll_fd;
+    int timer_fd;                   // fires when the wait's timeout runs out
+    DTN_Event_Handler *handlers;
+    bool running;
+} DTN_Event_Loop;
+
+int dtn_event_loop_init(DTN_Event_Loop* loop);
+void dtn_event_loop_destroy(DTN_Event_Loop* loop);
+int dtn_event_loop_add(DTN_Event_Loop* loop, int fd, u32_t events, DTN_Event_Callback callback, void* arg);
+void dtn_event_loop_remove(DTN_Event_Loop* loop, int fd);
+int dtn_event_loop_wait(DTN_Event_Loop* loop, u32_t timeout_ms);
+void dtn_event_loop_stop(DTN_Event_Loop* loop);
+
+#endif
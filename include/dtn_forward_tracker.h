@@ -0,0 +1,76 @@
+// dtn_forward_tracker.h: Header file for the per-destination forwarding attempt tracker with backoff timers
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_FORWARD_TRACKER_H
+#define DTN_FORWARD_TRACKER_H
+
+#include <stdbool.h>
+#include "lwip/arch.h"
+#include "lwip/ip6_addr.h"
+#include "dtn_timer_wheel.h"
+
+#define FORWARDING_RETRY_MAX_DELAY_MS 600000    // the backoff stops growing at 10 minutes, or at the timeout if longer
+#define MAX_FORWARDING_RETRIES 10               // attempts before the oldest packet is given up
+
+// Transmission attempts towards one destination. While its timer is pending the destination
+// backs off, when it fires the destination joins the due list.
+typedef struct DTN_Forward_Attempt {
+    ip6_addr_t destination;
+    u32_t retry_count;
+    DTN_Timer retry_timer;
+    ip6_addr_t timed_next_hop;      // where the timed packet went
+    u32_t timed_sent_ms;
+    bool timing;                    // a first attempt is out, its acknowledgement gives an RTT sample
+    struct DTN_Forward_Attempt *next_due;
+    struct DTN_Forward_Attempt *prev_due;
+    bool due;
+} DTN_Forward_Attempt;
+
+typedef struct DTN_Forward_Tracker {
+    DTN_Forward_Attempt **table;    // open addressing, NULL for a free slot
+    u32_t table_size;               // power of two, kept at most half full
+    u32_t count;
+    DTN_Timer_Wheel wheel;
+    DTN_Forward_Attempt *due_head;
+} DTN_Forward_Tracker;
+
+void dtn_forward_tracker_init(DTN_Forward_Tracker *tracker);
+void dtn_forward_tracker_destroy(DTN_Forward_Tracker *tracker);
+
+DTN_Forward_Attempt *dtn_forward_tracker_find(const DTN_Forward_Tracker *tracker, const ip6_addr_t *dest);
+
+// Returns the attempt record of dest, creating it with no attempts. NULL if out of memory.
+DTN_Forward_Attempt *dtn_forward_tracker_get(DTN_Forward_Tracker *tracker, const ip6_addr_t *dest);
+
+void dtn_forward_tracker_remove(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt);
+
+// Counts an attempt and backs the destination off for timeout_ms, doubled for each earlier attempt
+void dtn_forward_tracker_count(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt, u32_t timeout_ms);
+
+// Takes back the last counted attempt, which never went out, and ends the backoff it started
+void dtn_forward_tracker_refund(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt);
+
+// Next destination whose backoff ran out, taken off the due list. NULL if there is none.
+DTN_Forward_Attempt *dtn_forward_tracker_pop_due(DTN_Forward_Tracker *tracker);
+
+static inline bool dtn_forward_tracker_has_due(const DTN_Forward_Tracker *tracker) {
+    return tracker->due_head != NULL;
+}
+
+static inline bool dtn_forward_tracker_backing_off(const DTN_Forward_Attempt *attempt) {
+    return dtn_timer_pending(&attempt->retry_timer);
+}
+
+#endif
@@ -21,12 +21,14 @@
 #include "lwip/icmp6.h"
 #include "lwip/netif.h"
 #include "dtn_module.h"
+#include "dtn_packet.h"
 
 // DTN ICMPv6 message types
 #define ICMP6_TYPE_DTN_PCK_RECEIVED    200
 #define ICMP6_TYPE_DTN_PCK_FORWARDED   201
 #define ICMP6_TYPE_DTN_PCK_DELIVERED   202
 #define ICMP6_TYPE_DTN_PCK_DELETED     203
+#define ICMP6_TYPE_DTN_PCK_RECEIVED_AGGREGATE 204  // custody of many packets, named by fingerprint
 
 // DTN ICMPv6 message codes (taken from BPv7)
 #define ICMP6_CODE_DTN_NO_INFO         0
@@ -40,11 +42,23 @@
 #define ICMP6_CODE_DTN_HOP_LIMIT       9
 #define ICMP6_CODE_DTN_TRAFFIC_PARED   10
 
-void dtn_icmpv6_send_pck_received(struct netif *netif, struct pbuf *p, u8_t code);
-void dtn_icmpv6_send_pck_forwarded(struct netif *netif, struct pbuf *p, u8_t code);
-void dtn_icmpv6_send_pck_delivered(struct netif *netif, struct pbuf *p, u8_t code);
-void dtn_icmpv6_send_pck_deleted(struct netif *netif, struct pbuf *p, u8_t code, u8_t reason);
+// Custody acknowledgements are batched per upstream custodian into aggregate messages
+#define DTN_ACK_BATCH_MS 50                 // the longest an acknowledgement waits for others to join it
+#define DTN_ACK_BATCH_CUSTODIANS 8          // custodians batched at once, a new one flushes the oldest batch
+#define DTN_ACK_MTU 1280                    // aggregate messages fit the IPv6 minimum MTU
+#define DTN_ACK_MAX_FINGERPRINTS ((DTN_ACK_MTU - 40 - 8 - 8) / 8)   // after the IPv6, ICMPv6 and aggregate headers
 
-u8_t dtn_icmpv6_process(struct pbuf *p, struct netif *inp_netif);
+// Reports on p without taking it, the caller still owns and frees the packet
+void dtn_icmpv6_send_pck_received(struct netif *netif, const struct pbuf *p, u8_t code);
+void dtn_icmpv6_send_pck_forwarded(struct netif *netif, const struct pbuf *p, u8_t code);
+void dtn_icmpv6_send_pck_delivered(struct netif *netif, const struct pbuf *p, u8_t code);
+void dtn_icmpv6_send_pck_deleted(struct netif *netif, const struct pbuf *p, u8_t code, u8_t reason);
+
+// Acknowledges custody of the packet with the given fingerprint to its custodian, in the next
+// aggregate message to it. Batches are sent when full or DTN_ACK_BATCH_MS after they were opened.
+void dtn_icmpv6_ack_custody(struct netif *netif, const ip6_addr_t *custodian, uint64_t fingerprint);
+void dtn_icmpv6_flush_custody_acks(void);
+
+u8_t dtn_icmpv6_process(struct pbuf *p, const DTN_Packet_Info *info, struct netif *inp_netif);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+// dtn_local_addr.h: Header file for the set of IPv6 addresses the local lwIP stack answers to
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_LOCAL_ADDR_H
+#define DTN_LOCAL_ADDR_H
+
+#include <stdbool.h>
+#include "lwip/arch.h"
+#include "lwip/ip6_addr.h"
+#include "lwip/netif.h"
+
+#define DTN_LOCAL_ADDR_SLOTS 32             // power of two, twice the addresses of all netifs keeps probes short
+
+// Open-addressing hash set of the addresses assigned to the lwIP netifs. The unspecified
+// address :: is never assigned, so it marks a free slot.
+typedef struct DTN_Local_Addr_Set {
+    u32_t slots[DTN_LOCAL_ADDR_SLOTS][4];
+    u8_t count;
+} DTN_Local_Addr_Set;
+
+void dtn_local_addr_init(DTN_Local_Addr_Set* set);
+
+// Refills the set from every netif, leaving out except (may be NULL)
+void dtn_local_addr_rebuild(DTN_Local_Addr_Set* set, const struct netif* except);
+
+// Keeps the set up to date as netifs and their addresses come and go
+void dtn_local_addr_watch(DTN_Local_Addr_Set* set);
+void dtn_local_addr_unwatch(void);
+
+static inline u32_t dtn_local_addr_slot(const u32_t* addr) {
+    u32_t h = addr[0] ^ addr[1] ^ addr[2] ^ addr[3];
+    return (u32_t)(h * 0x9E3779B1u) >> 27;     // top 5 bits, DTN_LOCAL_ADDR_SLOTS == 32
+}
+
+// Whether addr is one of the local addresses, the zone is ignored
+static inline bool dtn_local_addr_contains(const DTN_Local_Addr_Set* set, const ip6_addr_t* addr) {
+    const u32_t* a = addr->addr;
+    u32_t slot = dtn_local_addr_slot(a);
+    for (int i = 0; i < DTN_LOCAL_ADDR_SLOTS; i++) {
+        const u32_t* s = set->slots[(slot + i) & (DTN_LOCAL_ADDR_SLOTS - 1)];
+        if (((s[0] ^ a[0]) | (s[1] ^ a[1]) | (s[2] ^ a[2]) | (s[3] ^ a[3])) == 0) return true;
+        if ((s[0] | s[1] | s[2] | s[3]) == 0) return false;
+    }
+    return false;
+}
+
+#endif
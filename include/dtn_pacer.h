@@ -0,0 +1,72 @@
+// dtn_pacer.h: Header file for the per-neighbor token-bucket pacer in front of the raw socket
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_PACER_H
+#define DTN_PACER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "lwip/arch.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip6_addr.h"
+
+#define DTN_PACER_MAX_NEIGHBORS 16
+#define DTN_PACER_QUEUE_LIMIT 128           // packets held back per neighbor, more are dropped
+#define DTN_PACER_BURST_MS 100              // bucket depth, in time at the contact's rate
+#define DTN_PACER_MIN_BURST_BYTES 2048      // the bucket always holds at least one full packet
+#define DTN_PACER_REPORT_INTERVAL_MS 10000
+
+// A packet waiting for tokens, copied out of its pbuf
+typedef struct Paced_Packet {
+    struct Paced_Packet *next;
+    ip6_addr_t dest;
+    u32_t queued_ms;
+    u16_t len;
+    u8_t data[];
+} Paced_Packet;
+
+typedef struct DTN_Pacer_Neighbor {
+    ip6_addr_t next_hop;
+    bool is_valid;
+    u32_t rate_bytes_per_s;         // of the contact in use, 0 sends unpaced
+    u64_t tokens;                   // in thousandths of a byte, so slow contacts still fill up
+    u32_t last_refill_ms;
+    Paced_Packet *head;
+    Paced_Packet *tail;
+    u32_t queue_packets;
+    u32_t queue_bytes;
+
+    // Reported every DTN_PACER_REPORT_INTERVAL_MS, then reset
+    u32_t sent_packets;
+    u32_t paced_packets;            // sent after waiting in the queue
+    u32_t dropped_packets;
+    u64_t delay_total_ms;
+    u32_t delay_max_ms;
+    u32_t queue_max_packets;
+} DTN_Pacer_Neighbor;
+
+typedef struct DTN_Pacer {
+    DTN_Pacer_Neighbor neighbors[DTN_PACER_MAX_NEIGHBORS];
+    bool timer_armed;
+    u32_t timer_due_ms;
+    u32_t last_report_ms;
+} DTN_Pacer;
+
+void dtn_pacer_init(DTN_Pacer* pacer);
+void dtn_pacer_flush(DTN_Pacer* pacer);
+int dtn_pacer_send(DTN_Pacer* pacer, struct pbuf* p, const ip6_addr_t* next_hop, u32_t rate_bytes_per_s);
+void dtn_pacer_report(DTN_Pacer* pacer);
+
+#endif
@@ -0,0 +1,59 @@
+// dtn_packet.h: Header file for the single-pass IPv6 packet parser shared by the DTN modules
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_PACKET_H
+#define DTN_PACKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "lwip/arch.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip6_addr.h"
+
+#define DTN_PACKET_FNV_OFFSET 0xcbf29ce484222325ULL
+#define DTN_PACKET_FNV_PRIME 0x100000001b3ULL
+
+// What the DTN modules need to know about a packet, filled in once at ingress
+typedef struct DTN_Packet_Info {
+    ip6_addr_t src;
+    ip6_addr_t dest;
+    ip6_addr_t custodian;           // from the custody option, the source if there is none
+    u32_t v_tc_fl;                  // version, traffic class and flow label as in the header
+    u16_t plen;                     // payload length as in the header (network order)
+    u8_t hoplim;
+    u8_t nexth;                     // upper-layer protocol, behind the hop-by-hop header
+    u16_t hbh_len;                  // 0 without a hop-by-hop header
+    u16_t custody_offset;           // offset of the custodian address, 0 without a custody option
+    u16_t l4_offset;                // offset of the upper-layer header
+    u16_t tot_len;                  // bytes of the packet that were available to the parser
+    uint64_t fingerprint;           // see dtn_packet_fingerprint, 0 until computed
+} DTN_Packet_Info;
+
+bool dtn_packet_parse_buffer(const u8_t* data, size_t len, DTN_Packet_Info* info);
+bool dtn_packet_parse_headers(const struct pbuf* p, DTN_Packet_Info* info);
+uint64_t dtn_packet_fingerprint(const struct pbuf* p, DTN_Packet_Info* info);
+bool dtn_packet_parse(const struct pbuf* p, DTN_Packet_Info* info);
+
+// Hash of the four words of an IPv6 address, for the tables keyed by destination address
+static inline u32_t dtn_addr_hash(const u32_t* words) {
+    u32_t h = words[0] * 0x9E3779B1u;
+    h ^= words[1] + 0x7F4A7C15u + (h << 6) + (h >> 2);
+    h ^= words[2] + 0x7F4A7C15u + (h << 6) + (h >> 2);
+    h ^= words[3] + 0x7F4A7C15u + (h << 6) + (h >> 2);
+    return h;
+}
+
+#endif
@@ -21,12 +21,17 @@
 #include <stdbool.h>
 #include <time.h>
 
+#define DTN_LIFETIME_PER_HOP_S 10000    // lifetime each remaining hop grants a packet, the CGR deadline
+
 // Contact opportunity
 typedef struct Contact_Info {
     ip6_addr_t node_addr;        // contact address (destination)
     ip6_addr_t next_hop;         // address of the node to reach the destination
     u32_t start_time_ms;         // start of the contact window
     u32_t end_time_ms;           // end of the contact window
+    u32_t rate_bytes_per_s;      // transmission rate from the contact plan, 0 if unknown
+    u32_t owlt_ms;               // one-way light time
+    u32_t busy_until_ms;         // end of what has already been sent over the contact
     bool is_dtn_node;            // whether the node is DTN-capable
     struct Contact_Info *next;   // pointer to the next contact in the list
 } Contact_Info;
@@ -52,6 +57,8 @@ int dtn_routing_add_contact(Routing_Function* routing,
                           const ip6_addr_t* next_hop,
                           u32_t start_time_ms, 
                           u32_t end_time_ms,
+                          u32_t rate_bytes_per_s,
+                          u32_t owlt_ms,
                           bool is_dtn_node);
 
 int dtn_routing_remove_contact(Routing_Function* routing, const ip6_addr_t* node_addr);
@@ -60,6 +67,11 @@ bool dtn_routing_update_contacts(Routing_Function* routing);
 
 bool dtn_routing_has_active_contact(Routing_Function* routing, const ip6_addr_t* dest_ip);
 
+Contact_Info* dtn_routing_active_contact_to(Routing_Function* routing, const ip6_addr_t* next_hop_ip);
+
+#define DTN_ROUTING_NO_CONTACT_CHANGE 0xFFFFFFFF
+u32_t dtn_routing_next_contact_change_ms(Routing_Function* routing);
+
 int ip6_addr_to_str(const ip6_addr_t *a, char *buf, size_t buflen);
 
 long ipv6_to_nodeid(const char *ip6);
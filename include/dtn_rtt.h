@@ -0,0 +1,53 @@
+// dtn_rtt.h: Header file for the per-next-hop round-trip time estimator that sets retransmission timeouts
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_RTT_H
+#define DTN_RTT_H
+
+#include <stdbool.h>
+#include "lwip/arch.h"
+#include "lwip/ip6_addr.h"
+#include "dtn_timer_wheel.h"
+
+#define DTN_RTT_MAX_NEIGHBORS 16
+#define DTN_RTT_INITIAL_RTO_MS 30000            // until a next hop has acknowledged a packet
+#define DTN_RTT_MIN_RTO_MS 1000                 // on top of the round-trip light time, covers the custody write
+#define DTN_RTT_GRANULARITY_MS DTN_TIMER_WHEEL_TICK_MS
+
+// Smoothed round-trip time of custody acknowledgements from one next hop, as in RFC 6298.
+// The values are kept scaled so the 1/8 and 1/4 gains stay in integers.
+typedef struct DTN_Rtt_Estimator {
+    ip6_addr_t next_hop;
+    bool is_valid;
+    u32_t srtt_x8;                  // smoothed RTT in ms, times 8
+    u32_t rttvar_x4;                // RTT variation in ms, times 4
+    u32_t samples;
+    u32_t last_sample_ms;           // the least recently sampled next hop makes room for a new one
+} DTN_Rtt_Estimator;
+
+typedef struct DTN_Rtt_Table {
+    DTN_Rtt_Estimator neighbors[DTN_RTT_MAX_NEIGHBORS];
+} DTN_Rtt_Table;
+
+void dtn_rtt_init(DTN_Rtt_Table* table);
+
+// Folds in the time from sending a packet to next_hop until its custody was acknowledged
+void dtn_rtt_sample(DTN_Rtt_Table* table, const ip6_addr_t* next_hop, u32_t rtt_ms);
+
+// How long to wait for the acknowledgement of a packet sent to next_hop over a contact with the
+// given one-way light time. Never less than the round trip the contact plan allows.
+u32_t dtn_rtt_timeout(const DTN_Rtt_Table* table, const ip6_addr_t* next_hop, u32_t owlt_ms);
+
+#endif
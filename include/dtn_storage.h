@@ -21,40 +21,255 @@
 #include "lwip/pbuf.h"
 #include "lwip/ip6_addr.h"
 #include "lwip/ip6.h" 
+#include "lwip/netif.h"
 #include <stdbool.h> 
+#include <stdint.h>
+#include "dtn_storage_io.h"
+#include "dtn_timer_wheel.h"
+#include "dtn_packet.h"
 
-#define MAX_STORED_PACKETS 5 
+// Stored packets are bounded by their bytes on disk and by count, which bounds the entry slabs
+#define STORAGE_MAX_BYTES (256UL * 1024 * 1024)
+#define STORAGE_MAX_PACKETS (64 * STORAGE_SLAB_ENTRIES)
 #define STORAGE_DIR "./dtn_storage"
 #define MAX_PATH_LENGTH 512
+#define STORAGE_INDEX_FILE "index.idx"
+#define STORAGE_SCAN_THREADS 4
+// IPv6 header plus the first 8 bytes after it, enough to match ICMP reports
+#define STORAGE_SNAPSHOT_LEN (IP6_HLEN + 8)
 
+// How stored packets are made durable before custody is acknowledged upstream
+typedef enum {
+    STORAGE_SYNC_NONE,      // rely on kernel write-back, acknowledge once the write completes
+    STORAGE_SYNC_GROUP,     // one sync per group of packets, bounded in size and latency
+    STORAGE_SYNC_PACKET     // sync every packet before acknowledging it
+} Storage_Sync_Mode;
+
+#define STORAGE_SYNC_MODE STORAGE_SYNC_GROUP
+#define STORAGE_GROUP_COMMIT_PACKETS 16
+#define STORAGE_GROUP_COMMIT_LATENCY_MS 20
+
+// Custody acknowledgement held back until the packet it acknowledges is durable
+typedef struct Pending_Custody_Ack {
+    ip6_addr_t custodian;
+    uint64_t fingerprint;
+    struct netif *netif;
+    struct Pending_Custody_Ack *next;
+} Pending_Custody_Ack;
+
+struct Storage_Function;
+struct Stored_Packet_Entry;
+
+// Packet file written in a storage group. The file id tells whether the entry still holds that packet.
+typedef struct Storage_Group_File {
+    int fd;
+    struct Stored_Packet_Entry *entry;
+    u32_t file_id;
+} Storage_Group_File;
+
+// Packets written since the last sync, made durable together before their acknowledgements go out
+typedef struct Storage_Group {
+    struct Storage_Function *storage;
+    u32_t packets;
+    u32_t ops_pending;          // writes, then syncs, still in flight
+    bool sealed;                // no more packets join the group
+    bool syncing;
+    bool failed;                // a write or sync failed, the packets are dropped unacknowledged
+    Storage_Group_File *files;  // packet files to sync and close
+    size_t files_count;
+    size_t files_capacity;
+    Pending_Custody_Ack *acks_head;
+    Pending_Custody_Ack *acks_tail;
+} Storage_Group;
+
+// Stored_Packet_Entry flags
+#define STORED_ENTRY_WRITING  0x01  // the packet file write is still in flight
+#define STORED_ENTRY_READING  0x02  // the packet is being read back from disk
+#define STORED_ENTRY_ORPHANED 0x04  // deleted while I/O was in flight, freed on completion
+#define STORED_ENTRY_LISTED   0x08  // linked into the storage packet list
+#define STORED_ENTRY_SLOT_PENDING 0x10  // index slot given up, cleared once the entry's I/O is done
+#define STORED_ENTRY_INTERNED 0x20  // holds a reference on its destination and source addresses
+#define STORED_ENTRY_FORWARD  0x40  // hand the entry to the controller once its read completes
+
+// Duplicate suppression, packets seen within the window are acknowledged but not stored again
+#define STORAGE_DEDUP_WINDOW_MS (10 * 60 * 1000)
+#define STORAGE_DEDUP_ENTRIES 4096          // power of two, the oldest fingerprints go first
+
+// A remembered packet, kept in a ring ordered by age and chained per hash bucket
+typedef struct Storage_Dedup_Record {
+    uint64_t fingerprint;
+    u32_t seen_ms;
+    u32_t next;                     // next (older) record in the bucket, index + 1
+} Storage_Dedup_Record;
+
+#define STORAGE_SLAB_ENTRIES 1024
+#define STORAGE_MAX_ADDRESSES 0xFFFF
+
+// Priority classes, numbered like the CGR ipv6_packet priorities
+typedef enum {
+    STORAGE_CLASS_BULK,
+    STORAGE_CLASS_NORMAL,
+    STORAGE_CLASS_EXPEDITED,
+    STORAGE_CLASS_COUNT
+} Storage_Class;
+
+#define DTN_DSCP_EXPEDITED 46           // EF
+#define DTN_DSCP_BULK 8                 // CS1
+
+// How a destination's classes share its contacts
+typedef enum {
+    STORAGE_DRAIN_STRICT,               // a class is only served once every higher class is empty
+    STORAGE_DRAIN_WEIGHTED              // classes take turns in proportion to their weights
+} Storage_Drain_Policy;
+
+#define STORAGE_DRAIN_POLICY STORAGE_DRAIN_STRICT
+#define STORAGE_WEIGHT_EXPEDITED 4
+#define STORAGE_WEIGHT_NORMAL 2
+#define STORAGE_WEIGHT_BULK 1
+
+// Per-packet metadata kept in memory, 96 bytes on LP64. Addresses are interned in the storage
+// address table and the packet file is named after file_id.
 typedef struct Stored_Packet_Entry {
-    struct pbuf *p;
-    ip6_addr_t original_dest;
+    struct pbuf *p;                 // NULL while the packet only lives on disk
+    struct Stored_Packet_Entry *next;   // within its destination and class queue
+    struct Stored_Packet_Entry *prev;
+    struct Stored_Packet_Entry *fp_next;    // within its fingerprint bucket
+    DTN_Timer expiry;               // lifetime derived from the hop limit, on the storage expiry wheel
+    uint64_t fingerprint;           // names the packet in aggregate acknowledgements, 0 if unknown
+    u32_t file_id;
+    u32_t index_slot;
     u32_t stored_time_ms;
-    struct Stored_Packet_Entry *next;
-    char filename[MAX_PATH_LENGTH]; 
+    u16_t packet_len;
+    u16_t dest_index;               // original destination
+    u16_t src_index;
+    u8_t nexth;                     // next header after any stripped hop-by-hop header
+    u8_t hoplim;
+    u8_t payload_head[8];           // first 8 bytes after the IPv6 header, to match ICMP reports
+    u8_t io_pending;                // asynchronous writes/reads referencing this entry
+    u8_t flags;
+    u8_t priority;                  // Storage_Class, from the DSCP
 } Stored_Packet_Entry;
 
+// Stored packets for one destination, a FIFO per class
+typedef struct Storage_Destination {
+    Stored_Packet_Entry *head[STORAGE_CLASS_COUNT];
+    Stored_Packet_Entry *tail[STORAGE_CLASS_COUNT];
+    u32_t count;
+    u8_t credits[STORAGE_CLASS_COUNT];  // turns left in the current weighted round
+    u16_t dest_index;
+    struct Storage_Destination *next_active;   // destinations with packets, in the order they got them
+    struct Storage_Destination *prev_active;
+} Storage_Destination;
+
+typedef struct Storage_Slab {
+    struct Storage_Slab *next;
+    Stored_Packet_Entry entries[STORAGE_SLAB_ENTRIES];
+} Storage_Slab;
+
 typedef struct Storage_Function {
     DTN_Module* parent_module;
     size_t stored_packets_count;
+    size_t stored_bytes;            // packet bytes of the stored entries
     size_t max_storage_bytes;
-    Stored_Packet_Entry* packet_list_head;
+    size_t max_stored_packets;
     char storage_directory[MAX_PATH_LENGTH]; 
+
+    // Stored packets queued per destination, indexed like the address table
+    Storage_Destination** destinations;
+    u32_t destinations_capacity;
+    Storage_Destination* active_head;
+    Storage_Destination* active_tail;
+    Storage_Drain_Policy drain_policy;
+
+    // Stored packets are deleted once their lifetime runs out
+    DTN_Timer_Wheel expiry_wheel;
+
+    // Entry records are carved out of slabs and recycled through a free list
+    Storage_Slab* slabs;
+    Stored_Packet_Entry* free_entries;
+    u32_t next_file_id;
+
+    // Interned addresses, entries refer to them by index. An address, and its destination queue,
+    // is released once no entry refers to it and its index is handed out again.
+    ip6_addr_t* addrs;
+    u32_t* addr_refs;               // entries holding each address, 0 for a free index
+    u32_t* free_addrs;              // released indices, sized like addrs
+    u32_t free_addrs_count;
+    u32_t addr_count;               // indices handed out so far, free ones included
+    u32_t addr_capacity;
+    u16_t* addr_table;              // open addressing, holds index + 1
+    u32_t addr_table_size;
+
+    // Stored entries by fingerprint, chained through fp_next, to find acknowledged packets
+    Stored_Packet_Entry** fp_buckets;
+    u32_t fp_bucket_count;          // power of two
+    u32_t fp_count;
+
+    // Fingerprints of recently stored or forwarded packets
+    Storage_Dedup_Record* dedup_records;
+    u32_t* dedup_buckets;           // newest record in each bucket, index + 1
+    u32_t dedup_oldest;
+    u32_t dedup_count;
+    u32_t dedup_window_ms;          // 0 disables duplicate suppression
+
+    // On-disk index of stored packets, one fixed-size slot per packet
+    int index_fd;
+    u32_t index_slot_count;
+    u32_t* free_slots;
+    size_t free_slots_count;
+    size_t free_slots_capacity;
+
+    // Durability
+    Storage_Sync_Mode sync_mode;
+    u32_t group_commit_packets;
+    u32_t group_commit_latency_ms;
+    int dir_fd;
+    Storage_Group* open_group;      // group new packets join
+    Storage_Group* last_group;      // group of the most recently stored packet, until it is durable
+
+    // Asynchronous disk I/O, completed from the main loop
+    Storage_IO* io;
+    bool closing;
 } Storage_Function;
 
 Storage_Function* dtn_storage_create(DTN_Module* parent);
 void dtn_storage_destroy(Storage_Function* storage);
-int dtn_storage_store_packet(Storage_Function* storage, struct pbuf* p, const ip6_addr_t* original_dest);
+int dtn_storage_store_packet(Storage_Function* storage, struct pbuf* p, const ip6_addr_t* original_dest, uint64_t fingerprint);
 int dtn_storage_is_full(Storage_Function* storage);
+void dtn_storage_set_limits(Storage_Function* storage, size_t max_bytes, size_t max_packets);
+Stored_Packet_Entry* dtn_storage_first_entry(const Storage_Function* storage);
+Stored_Packet_Entry* dtn_storage_next_entry(const Storage_Function* storage, const Stored_Packet_Entry* entry);
+Storage_Destination* dtn_storage_destination_for(const Storage_Function* storage, const ip6_addr_t* dest);
+const ip6_addr_t* dtn_storage_destination_addr(const Storage_Function* storage, const Storage_Destination* destination);
+Stored_Packet_Entry* dtn_storage_drain_next(Storage_Function* storage, Storage_Destination* destination);
+void dtn_storage_set_drain_policy(Storage_Function* storage, Storage_Drain_Policy policy);
+Storage_Class dtn_storage_class_from_tc(u8_t traffic_class);
 Stored_Packet_Entry* dtn_storage_retrieve_packet_for_dest(Storage_Function* storage, const ip6_addr_t* target_dest);
-void dtn_storage_free_retrieved_entry_struct(Stored_Packet_Entry* entry);
+void dtn_storage_free_retrieved_entry_struct(Storage_Function* storage, Stored_Packet_Entry* entry);
 Stored_Packet_Entry* dtn_storage_get_packet_copy_for_dest(Storage_Function* storage, const ip6_addr_t* target_dest);
 void dtn_storage_delete_packet_by_ip_header(Storage_Function* storage, struct ip6_hdr* orig_ip6hdr);
-void dtn_storage_delete_packet_by_icmp_data(Storage_Function* storage, struct pbuf* icmp_packet);
+void dtn_storage_delete_packet_by_quote(Storage_Function* storage, const u8_t* quote, size_t quote_len,
+                                        const DTN_Packet_Info* info);
+size_t dtn_storage_delete_packets_by_fingerprint(Storage_Function* storage, const uint64_t* fingerprints, size_t count,
+                                                 const ip6_addr_t* acked_by);
 int dtn_storage_init_directory(Storage_Function* storage);
-int dtn_storage_save_packet_to_disk(Storage_Function* storage, Stored_Packet_Entry* entry);
 int dtn_storage_remove_packet_from_disk(Storage_Function* storage, const char* filename);
 int dtn_storage_load_packets_from_disk(Storage_Function* storage);
+struct pbuf* dtn_storage_entry_pbuf(Storage_Function* storage, Stored_Packet_Entry* entry);
+void dtn_storage_entry_release_pbuf(Stored_Packet_Entry* entry);
+void dtn_storage_set_sync_mode(Storage_Function* storage, Storage_Sync_Mode mode, u32_t group_packets, u32_t group_latency_ms);
+void dtn_storage_ack_when_durable(Storage_Function* storage, const DTN_Packet_Info* info, struct netif* netif);
+int dtn_storage_sync(Storage_Function* storage);
+void dtn_storage_set_dedup_window(Storage_Function* storage, u32_t window_ms);
+bool dtn_storage_dedup_seen(Storage_Function* storage, uint64_t fingerprint);
+void dtn_storage_dedup_remember(Storage_Function* storage, uint64_t fingerprint);
+void dtn_storage_prefetch_entry(Storage_Function* storage, Stored_Packet_Entry* entry);
+const ip6_addr_t* dtn_storage_entry_dest(const Storage_Function* storage, const Stored_Packet_Entry* entry);
+const ip6_addr_t* dtn_storage_entry_src(const Storage_Function* storage, const Stored_Packet_Entry* entry);
+u32_t dtn_storage_entry_time_left(const Stored_Packet_Entry* entry, u32_t now);
+void dtn_storage_entry_header(const Storage_Function* storage, const Stored_Packet_Entry* entry, struct ip6_hdr* ip6hdr);
+int dtn_storage_entry_path(const Storage_Function* storage, const Stored_Packet_Entry* entry, char* path, size_t len);
+int dtn_storage_completion_fd(Storage_Function* storage);
+void dtn_storage_process_completions(Storage_Function* storage);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,57 @@
+// dtn_storage_io.h: Header file for the asynchronous disk I/O backend used by DTN packet storage
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_STORAGE_IO_H
+#define DTN_STORAGE_IO_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define STORAGE_IO_QUEUE_DEPTH 64
+#define STORAGE_IO_THREADS 2
+#define STORAGE_IO_MAX_IOV 8
+#ifndef STORAGE_IO_USE_URING
+#define STORAGE_IO_USE_URING 1     // 0 always uses the thread-pool backend
+#endif
+
+// Called on the event loop thread; result is the byte count or a negative errno
+typedef void (*Storage_IO_Callback)(void* arg, int result);
+
+typedef struct Storage_IO Storage_IO;
+
+Storage_IO* dtn_storage_io_create(unsigned queue_depth);
+void dtn_storage_io_destroy(Storage_IO* io);
+const char* dtn_storage_io_backend_name(const Storage_IO* io);
+
+// Readable whenever completions are waiting for dtn_storage_io_poll()
+int dtn_storage_io_fd(const Storage_IO* io);
+
+// Buffers referenced by iov must stay valid until the callback runs.
+// owned_buffer, if set, is freed once the operation has completed.
+int dtn_storage_io_writev(Storage_IO* io, int fd, const struct iovec* iov, int iovcnt, off_t offset,
+                          void* owned_buffer, Storage_IO_Callback cb, void* arg);
+int dtn_storage_io_readv(Storage_IO* io, int fd, const struct iovec* iov, int iovcnt, off_t offset,
+                         Storage_IO_Callback cb, void* arg);
+int dtn_storage_io_fsync(Storage_IO* io, int fd, bool datasync, Storage_IO_Callback cb, void* arg);
+int dtn_storage_io_unlink(Storage_IO* io, const char* path, Storage_IO_Callback cb, void* arg);
+
+// Runs the callbacks of finished operations, returns how many completed
+int dtn_storage_io_poll(Storage_IO* io);
+
+// Blocks until every submitted operation has completed and its callback has run
+void dtn_storage_io_wait_idle(Storage_IO* io);
+
+#endif
@@ -0,0 +1,67 @@
+// dtn_timer_wheel.h: Header file for the hierarchical timing wheel used for DTN packet timers
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DTN_TIMER_WHEEL_H
+#define DTN_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "lwip/arch.h"
+
+#define DTN_TIMER_WHEEL_TICK_MS 100
+#define DTN_TIMER_WHEEL_LEVELS 4
+#define DTN_TIMER_WHEEL_SLOT_BITS 8
+#define DTN_TIMER_WHEEL_SLOTS (1 << DTN_TIMER_WHEEL_SLOT_BITS)
+#define DTN_TIMER_WHEEL_MAX_TICKS (1UL << 30)   // longer delays are clamped, about 3 years
+
+// Embedded in whatever it times, the wheel's callback gets the timer back
+typedef struct DTN_Timer {
+    struct DTN_Timer *next;
+    struct DTN_Timer **pprev;   // link that points at this timer, NULL when not scheduled
+    u32_t expires;              // wheel tick
+} DTN_Timer;
+
+struct DTN_Timer_Wheel;
+typedef void (*DTN_Timer_Callback)(struct DTN_Timer_Wheel* wheel, DTN_Timer* timer, void* arg);
+
+// Level 0 holds timers due within DTN_TIMER_WHEEL_SLOTS ticks, each further level covers
+// DTN_TIMER_WHEEL_SLOTS times more and is cascaded down as the wheel turns
+typedef struct DTN_Timer_Wheel {
+    DTN_Timer *slots[DTN_TIMER_WHEEL_LEVELS][DTN_TIMER_WHEEL_SLOTS];
+    u32_t current_tick;
+    u32_t last_tick_ms;
+    size_t count;
+    bool running;               // the lwIP tick timeout is armed
+    DTN_Timer_Callback expire;
+    void *arg;
+} DTN_Timer_Wheel;
+
+void dtn_timer_wheel_init(DTN_Timer_Wheel* wheel, DTN_Timer_Callback expire, void* arg);
+void dtn_timer_wheel_stop(DTN_Timer_Wheel* wheel);
+void dtn_timer_wheel_schedule(DTN_Timer_Wheel* wheel, DTN_Timer* timer, u32_t delay_ms);
+void dtn_timer_wheel_cancel(DTN_Timer_Wheel* wheel, DTN_Timer* timer);
+void dtn_timer_wheel_advance(DTN_Timer_Wheel* wheel, u32_t now_ms);
+
+static inline void dtn_timer_init(DTN_Timer* timer) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+}
+
+static inline bool dtn_timer_pending(const DTN_Timer* timer) {
+    return timer->pprev != NULL;
+}
+
+#endif
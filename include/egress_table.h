@@ -0,0 +1,57 @@
+// egress_table.h: Header file for the longest-prefix-match table mapping IPv6 destinations to egress interfaces
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef EGRESS_TABLE_H
+#define EGRESS_TABLE_H
+
+#include "lwip/arch.h"
+#include "lwip/ip6_addr.h"
+
+#define EGRESS_TABLE_MAX_NODES 64           // trie nodes, a /64 prefix takes at most 8
+#define EGRESS_TABLE_NO_MATCH -1
+
+// One level of the trie, indexed by one byte of the address. Prefixes that don't end on a byte
+// boundary are expanded over every slot they cover, so a lookup reads one slot per byte.
+typedef struct Egress_Table_Node {
+    u16_t child[256];               // node index, 0 for none (node 0 is the root)
+    u8_t value[256];                // interface + 1 of the longest prefix ending at this slot, 0 for none
+    u8_t prefix_len[256];           // length of that prefix, so a shorter one never replaces it
+} Egress_Table_Node;
+
+typedef struct Egress_Table {
+    Egress_Table_Node nodes[EGRESS_TABLE_MAX_NODES];
+    u16_t node_count;
+    s16_t default_value;            // ::/0, EGRESS_TABLE_NO_MATCH if none
+} Egress_Table;
+
+void egress_table_init(Egress_Table* table);
+int egress_table_insert(Egress_Table* table, const ip6_addr_t* prefix, u8_t prefix_len, u8_t value);
+
+// Value of the longest prefix covering addr, EGRESS_TABLE_NO_MATCH if there is none
+static inline int egress_table_lookup(const Egress_Table* table, const ip6_addr_t* addr) {
+    const u8_t* bytes = (const u8_t*)addr->addr;
+    int best = table->default_value;
+    u16_t node = 0;
+    for (int i = 0; i < 16; i++) {
+        const Egress_Table_Node* n = &table->nodes[node];
+        u8_t slot = bytes[i];
+        if (n->value[slot]) best = n->value[slot] - 1;
+        node = n->child[slot];
+        if (node == 0) break;
+    }
+    return best;
+}
+
+#endif
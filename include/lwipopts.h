@@ -46,12 +46,14 @@
 #define MEMP_NUM_PBUF 10                 
 #define PBUF_POOL_SIZE 100                 
 #define PBUF_POOL_BUFSIZE 1536
+#define MEMP_NUM_SYS_TIMEOUT (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 8)  // room for the DTN module's own timers
 #define MEM_LIBC_MALLOC                  0
 #define MEM_ALIGNMENT                    4
 
 // Network Interface Callbacks
 #define LWIP_NETIF_LINK_CALLBACK 1
 #define LWIP_NETIF_STATUS_CALLBACK 1
+#define LWIP_NETIF_EXT_STATUS_CALLBACK 1     // dtn_local_addr.c follows address changes
 #define LWIP_TCPIP_CORE_LOCKING 0
 
 // API Support
@@ -0,0 +1,74 @@
+// packet_ring.h: Header file for the AF_PACKET TPACKET_V3 ring link backend
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "lwip/arch.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip6_addr.h"
+
+#define PACKET_RING_BLOCK_SIZE (1 << 16)
+#define PACKET_RING_RX_BLOCKS 16            // 1 MB of receive ring per interface
+#define PACKET_RING_RX_BLOCK_TIMEOUT_MS 10  // a partly filled block is handed over after this long
+#define PACKET_RING_FRAME_SIZE 2048         // transmit slot, header included
+#define PACKET_RING_TX_BLOCKS 4             // 128 transmit slots per interface
+#define PACKET_RING_NEIGH_CACHE 32
+#define PACKET_RING_ETH_HLEN 14
+#define PACKET_RING_IF_NAME_LEN 16         // IFNAMSIZ, without pulling in net/if.h next to linux/if.h
+
+// Resolved neighbor of the interface, as last reported by the kernel
+typedef struct Packet_Ring_Neighbor {
+    ip6_addr_t addr;
+    u8_t mac[6];
+    bool is_valid;
+} Packet_Ring_Neighbor;
+
+// Receive and transmit rings of one interface
+typedef struct Packet_Ring {
+    char if_name[PACKET_RING_IF_NAME_LEN];
+    int if_index;
+    u8_t mac[6];
+
+    int rx_fd;
+    u8_t *rx_map;
+    size_t rx_map_len;
+    unsigned int rx_block;          // next block to look at
+
+    int tx_fd;
+    u8_t *tx_map;
+    size_t tx_map_len;
+    unsigned int tx_frames;
+    unsigned int tx_next;           // next slot to fill
+    unsigned int tx_queued;         // filled since the last flush
+
+    int neigh_fd;                   // netlink, neighbor table dump and change notifications
+    Packet_Ring_Neighbor neighbors[PACKET_RING_NEIGH_CACHE];
+    unsigned int neighbors_next;
+} Packet_Ring;
+
+// Called for each IPv6 packet received, data points into the ring
+typedef void (*Packet_Ring_Input)(const u8_t* data, size_t len, void* arg);
+
+int packet_ring_open(Packet_Ring* ring, const char* if_name);
+void packet_ring_close(Packet_Ring* ring);
+int packet_ring_send(Packet_Ring* ring, struct pbuf* p, const ip6_addr_t* next_hop);
+void packet_ring_flush(Packet_Ring* ring);
+void packet_ring_receive(Packet_Ring* ring, Packet_Ring_Input input, void* arg);
+void packet_ring_receive_neighbors(Packet_Ring* ring);
+
+#endif
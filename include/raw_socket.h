@@ -20,15 +20,44 @@
 #include "lwip/ip6_addr.h"
 #include "lwip/pbuf.h"
 
-extern int raw_socket_enp0s8;
-extern int raw_socket_enp0s9;
+#define RAW_SOCKET_BATCH_PACKETS 32      // per interface, sent with one sendmmsg
+#define RAW_SOCKET_BATCH_BYTES 16384     // bounds the pbufs held back, about half the lwIP heap
+#define RAW_SOCKET_MAX_IOV 8             // pbuf segments sent in place, longer chains are copied
+#define RAW_SOCKET_MAX_INTERFACES 8
 
-int raw_socket_init(const char* if_name_1, const char* if_name_2);
+// Send and receive through AF_PACKET TPACKET_V3 rings (packet_ring.c), the raw sockets
+// still carry packets to neighbors without a resolved MAC address
+#ifndef RAW_SOCKET_PACKET_RING
+#define RAW_SOCKET_PACKET_RING 0
+#endif
 
-// Send an IPv6 packet through a raw socket on the appropriate interface
+typedef struct Packet_Ring Packet_Ring;
+
+// Interfaces and the prefixes they reach, one "<prefix>/<length> <interface>" or
+// "node <node id> <interface>" per line, the longest matching prefix wins
+#define RAW_SOCKET_EGRESS_FILE "egress_table.txt"
+
+int raw_socket_init(const char* egress_file);
+
+// Queue an IPv6 packet for the raw socket of the appropriate interface, it goes out with the
+// next raw_socket_flush. The pbuf is referenced until then, the caller still frees its own reference.
 // Returns 0 on success, -1 on failure
 int raw_socket_send_ipv6(struct pbuf *p, const ip6_addr_t *dest_addr);
 
+// Same, for a packet already laid out in memory. owner (may be NULL) is passed to free() once it is sent.
+// On failure nothing was queued and owner still belongs to the caller.
+int raw_socket_send_ipv6_buffer(void *data, size_t len, const ip6_addr_t *dest_addr, void *owner);
+
+// Send the queued packets, called once per event-loop iteration
+void raw_socket_flush(void);
+
+// Egress interfaces in the order the table first names them
+int raw_socket_count(void);
+int raw_socket_fd(int index);
+
+// Ring of an egress interface, NULL unless RAW_SOCKET_PACKET_RING is set and it opened
+Packet_Ring *raw_socket_ring(int index);
+
 void raw_socket_cleanup(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+// tun_queue.h: Header file for the worker threads reading the extra queues of a multi-queue TUN device
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef TUN_QUEUE_H
+#define TUN_QUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "lwip/arch.h"
+#include "lwip/pbuf.h"
+#include "dtn_custody.h"
+
+#define TUN_QUEUE_MAX_WORKERS 15
+#define TUN_QUEUE_READ_BUDGET 64            // packets a worker reads before handing them over
+#define TUN_QUEUE_BUFFERS 256               // handoff buffers per worker, packets beyond them are dropped
+#define TUN_QUEUE_PACKET_MAX 2048
+#define TUN_QUEUE_HEADROOM LWIP_MEM_ALIGN_SIZE(DTN_CUSTODY_HEADROOM)
+
+struct Tun_Queue_Worker;
+
+// Handoff buffer a worker reads one packet into. The main loop wraps it in a pbuf where it is,
+// headroom included, and freeing that pbuf gives the buffer back to the worker.
+typedef struct Tun_Packet {
+    struct pbuf_custom pbuf;        // ahead of the data, like the header of a pool pbuf
+    struct Tun_Packet *next;
+    struct Tun_Queue_Worker *worker;
+    u32_t len;
+    u8_t data[TUN_QUEUE_HEADROOM + TUN_QUEUE_PACKET_MAX];
+} Tun_Packet;
+
+struct Tun_Queues;
+
+typedef struct Tun_Queue_Worker {
+    struct Tun_Queues *queues;
+    int fd;
+    pthread_t thread;
+    bool started;
+    Tun_Packet *buffers;            // TUN_QUEUE_BUFFERS of them
+    Tun_Packet *free_buffers;       // guarded by the queues lock
+} Tun_Queue_Worker;
+
+// Queues of the device other than the main loop's own, each read by its own thread. The kernel
+// steers every flow to a single queue, and each worker hands its packets over in arrival order.
+typedef struct Tun_Queues {
+    Tun_Queue_Worker workers[TUN_QUEUE_MAX_WORKERS];
+    int count;
+    int notify_fd;                  // eventfd, readable while packets are waiting
+    int stop_fd;                    // eventfd, readable once the workers must exit
+    pthread_mutex_t lock;           // guards everything below and the free buffers
+    Tun_Packet *head;
+    Tun_Packet *tail;
+    u32_t dropped;
+    bool closed;                    // a queue saw the device go away
+} Tun_Queues;
+
+int tun_queue_start(Tun_Queues* queues, const int* fds, int count);
+void tun_queue_stop(Tun_Queues* queues);
+Tun_Packet* tun_queue_take(Tun_Queues* queues, bool* closed);
+struct pbuf* tun_queue_packet_pbuf(Tun_Packet* packet);
+void tun_queue_release(Tun_Packet* packet);
+
+#endif
@@ -37,15 +37,18 @@ DTN_Controller *dtn_controller_create(DTN_Module *parent)
     if (controller)
     {
         controller->parent_module = parent;
-
-        // Initialize forwarding attempts tracking
-        for (int i = 0; i < MAX_DESTINATIONS; i++)
-        {
-            controller->forwarding_attempts[i].is_valid = false;
-            memset(&controller->forwarding_attempts[i].destination, 0, sizeof(ip6_addr_t));
-            controller->forwarding_attempts[i].last_attempt_time = 0;
-            controller->forwarding_attempts[i].retry_count = 0;
-        }
+        controller->forward_netif = NULL;
+        dtn_pacer_init(&controller->pacer);
+        dtn_local_addr_watch(&controller->local_addrs);
+        controller->schedule = NULL;
+        controller->schedule_capacity = 0;
+        memset(controller->scheduled_reads, 0, sizeof(controller->scheduled_reads));
+        controller->scheduled_reads_next = 0;
+        controller->route_cache_count = 0;
+        controller->in_batch = false;
+
+        dtn_forward_tracker_init(&controller->forward_tracker);
+        dtn_rtt_init(&controller->rtt);
 
         printf("DTN Controller created.\n");
     }
@@ -61,83 +64,92 @@ void dtn_controller_destroy(DTN_Controller *controller)
     if (!controller)
         return;
     printf("Destroying DTN Controller...\n");
+    dtn_pacer_report(&controller->pacer);
+    dtn_pacer_flush(&controller->pacer);
+    dtn_local_addr_unwatch();
+    dtn_forward_tracker_destroy(&controller->forward_tracker);
+    free(controller->schedule);
     free(controller);
 }
 
+// A destination may be tried unless it is backing off. One that used up its retries loses its
+// oldest packet instead and starts over.
 static bool should_attempt_forward(DTN_Controller *controller, const ip6_addr_t *dest_addr)
 {
-    u32_t current_time = sys_now();
-
-    // Check if this destination is in tracking list
-    for (int i = 0; i < MAX_DESTINATIONS; i++)
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_find(&controller->forward_tracker, dest_addr);
+    if (!attempt)
     {
-        if (controller->forwarding_attempts[i].is_valid)
-        {
-            ip6_addr_t tracking_addr = controller->forwarding_attempts[i].destination;
-
-#if LWIP_IPV6_SCOPES
-            ip6_addr_t dest_nozone = *dest_addr;
-            ip6_addr_set_zone(&dest_nozone, IP6_NO_ZONE);
-            ip6_addr_set_zone(&tracking_addr, IP6_NO_ZONE);
-
-            if (ip6_addr_cmp(&dest_nozone, &tracking_addr))
-            {
-#else
-            if (ip6_addr_cmp(dest_addr, &tracking_addr))
-            {
-#endif
-                u32_t time_since_last_attempt = current_time - controller->forwarding_attempts[i].last_attempt_time;
-
-                if (time_since_last_attempt >= FORWARDING_RETRY_DELAY_MS)
-                {
-                    if (controller->forwarding_attempts[i].retry_count >= MAX_FORWARDING_RETRIES)
-                    {
-                        // Max retries reached, delete packet from storage
-                        Storage_Function *storage = controller->parent_module->storage;
-                        if (storage) {
-                            Stored_Packet_Entry *expired_packet = dtn_storage_retrieve_packet_for_dest(storage, dest_addr);
-                            if (expired_packet) {
-                                char addr_str[IP6ADDR_STRLEN_MAX];
-                                ip6addr_ntoa_r(dest_addr, addr_str, sizeof(addr_str));
-                                printf("DTN Controller: Deleting packet for %s after %d failed transmission attempts\n", 
-                                       addr_str, MAX_FORWARDING_RETRIES);
-                                
-                                // Free the packet and entry
-                                pbuf_free(expired_packet->p);
-                                dtn_storage_free_retrieved_entry_struct(expired_packet);
-                            }
-                        }
-                        
-                        // Remove from tracking list
-                        controller->forwarding_attempts[i].is_valid = false;
-                        return false; 
-                    }
-                    
-                    controller->forwarding_attempts[i].last_attempt_time = current_time;
-                    controller->forwarding_attempts[i].retry_count++;
-                    return true;
-                }
-                else
-                {
-                    return false;
-                }
+        return true;
+    }
+    if (dtn_forward_tracker_backing_off(attempt))
+    {
+        return false;
+    }
+    if (attempt->retry_count >= MAX_FORWARDING_RETRIES)
+    {
+        // Max retries reached, delete packet from storage
+        Storage_Function *storage = controller->parent_module->storage;
+        if (storage) {
+            Stored_Packet_Entry *expired_packet = dtn_storage_retrieve_packet_for_dest(storage, dest_addr);
+            if (expired_packet) {
+                char addr_str[IP6ADDR_STRLEN_MAX];
+                ip6addr_ntoa_r(dest_addr, addr_str, sizeof(addr_str));
+                printf("DTN Controller: Deleting packet for %s after %d failed transmission attempts\n", 
+                       addr_str, MAX_FORWARDING_RETRIES);
+                
+                // Free the packet and entry
+                dtn_storage_entry_release_pbuf(expired_packet);
+                dtn_storage_free_retrieved_entry_struct(storage, expired_packet);
             }
         }
+        
+        // Remove from tracking list
+        dtn_forward_tracker_remove(&controller->forward_tracker, attempt);
+        return false;
     }
+    return true;
+}
 
-    for (int i = 0; i < MAX_DESTINATIONS; i++)
+// A packet for dest got time on a contact, the destination backs off until it is acknowledged
+// or the backoff runs out. The backoff starts at the retransmission timeout of the next hop.
+// Without memory for the record the destination stays untracked.
+static void count_forward_attempt(DTN_Controller *controller, const ip6_addr_t *dest_addr,
+                                  const ip6_addr_t *next_hop, const Contact_Info *contact)
+{
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_get(&controller->forward_tracker, dest_addr);
+    if (attempt)
     {
-        if (!controller->forwarding_attempts[i].is_valid)
-        {
-            controller->forwarding_attempts[i].is_valid = true;
-            memcpy(&controller->forwarding_attempts[i].destination, dest_addr, sizeof(ip6_addr_t));
-            controller->forwarding_attempts[i].last_attempt_time = current_time;
-            controller->forwarding_attempts[i].retry_count = 1;
-            return true;
-        }
+        u32_t timeout_ms = dtn_rtt_timeout(&controller->rtt, next_hop, contact->owlt_ms);
+        dtn_forward_tracker_count(&controller->forward_tracker, attempt, timeout_ms);
     }
+}
 
-    return true;
+// A stored packet for dest went out to next_hop. Only a first attempt is timed, the
+// acknowledgement of a retransmitted packet could belong to any of its copies.
+static void start_rtt_sample(DTN_Controller *controller, const ip6_addr_t *dest_addr, const ip6_addr_t *next_hop)
+{
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_find(&controller->forward_tracker, dest_addr);
+    if (!attempt)
+    {
+        return;
+    }
+    attempt->timing = attempt->retry_count == 1;
+    if (attempt->timing)
+    {
+        attempt->timed_next_hop = *next_hop;
+        attempt->timed_sent_ms = sys_now();
+    }
+}
+
+// A packet counted by count_forward_attempt was held back by the scheduler, the attempt is not
+// counted against MAX_FORWARDING_RETRIES and the destination may go with the next contact
+static void refund_forward_attempt(DTN_Controller *controller, const ip6_addr_t *dest_addr)
+{
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_find(&controller->forward_tracker, dest_addr);
+    if (attempt)
+    {
+        dtn_forward_tracker_refund(&controller->forward_tracker, attempt);
+    }
 }
 
 void dtn_controller_remove_tracking(DTN_Controller *controller, const ip6_addr_t *dest_addr)
@@ -147,62 +159,109 @@ void dtn_controller_remove_tracking(DTN_Controller *controller, const ip6_addr_t
         return;
     }
 
-    for (int i = 0; i < MAX_DESTINATIONS; i++)
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_find(&controller->forward_tracker, dest_addr);
+    if (attempt)
     {
-        if (controller->forwarding_attempts[i].is_valid)
-        {
-            ip6_addr_t tracking_addr = controller->forwarding_attempts[i].destination;
+        dtn_forward_tracker_remove(&controller->forward_tracker, attempt);
+    }
+}
 
-#if LWIP_IPV6_SCOPES
-            ip6_addr_t dest_nozone = *dest_addr;
-            ip6_addr_set_zone(&dest_nozone, IP6_NO_ZONE);
-            ip6_addr_set_zone(&tracking_addr, IP6_NO_ZONE);
+// acked_by took custody of a packet for dest. The round trip is sampled when the packet was
+// timed and went to that node, then the destination is no longer tracked.
+void dtn_controller_custody_acked(DTN_Controller *controller, const ip6_addr_t *dest_addr, const ip6_addr_t *acked_by)
+{
+    if (!controller || !dest_addr || !acked_by)
+    {
+        return;
+    }
 
-            if (ip6_addr_cmp(&dest_nozone, &tracking_addr))
-            {
-#else
-            if (ip6_addr_cmp(dest_addr, &tracking_addr))
-            {
-#endif
-                controller->forwarding_attempts[i].is_valid = false;
-                return;
-            }
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_find(&controller->forward_tracker, dest_addr);
+    if (attempt)
+    {
+        if (attempt->timing && ip6_addr_cmp_zoneless(&attempt->timed_next_hop, acked_by))
+        {
+            dtn_rtt_sample(&controller->rtt, acked_by, sys_now() - attempt->timed_sent_ms);
         }
+        dtn_forward_tracker_remove(&controller->forward_tracker, attempt);
     }
 }
 
-int dtn_controller_process_icmpv6(DTN_Controller *controller, struct pbuf *p, struct netif *inp_netif)
+int dtn_controller_process_icmpv6(DTN_Controller *controller, struct pbuf *p, const DTN_Packet_Info *info, struct netif *inp_netif)
 {
     if (!p || !controller || !controller->parent_module)
     {
         return 0;
     }
 
-    return dtn_icmpv6_process(p, inp_netif);
+    return dtn_icmpv6_process(p, info, inp_netif);
 }
 
 static bool is_next_hop_active_contact(Routing_Function *routing, ip6_addr_t *next_hop_ip)
 {
-    if (!routing || !next_hop_ip) return false;
+    return dtn_routing_active_contact_to(routing, next_hop_ip) != NULL;
+}
 
-    u32_t current_time = sys_now();
-    Contact_Info *contact = routing->contact_list_head;
+// Hands a packet to the pacer, which sends it at the rate of the contact towards the next hop
+static int send_to_next_hop(DTN_Controller *controller, struct pbuf *p, const ip6_addr_t *next_hop_ip)
+{
+    Contact_Info *contact = dtn_routing_active_contact_to(controller->parent_module->routing, next_hop_ip);
+    return dtn_pacer_send(&controller->pacer, p, next_hop_ip, contact ? contact->rate_bytes_per_s : 0);
+}
 
-    while (contact != NULL)
+// CGR for an incoming packet. Packets of one ingress batch arrive together, so those that only
+// differ in length share the result of the first one.
+static int incoming_next_hop(DTN_Controller *controller, u32_t *v_tc_fl, u16_t *plen, u8_t *hoplim,
+                             ip6_addr_t *dest, ip6_addr_t *sender, ip6_addr_t *next_hop_ip)
+{
+    Routing_Function *routing = controller->parent_module->routing;
+    if (!controller->in_batch)
     {
-        bool ip_match = (next_hop_ip->addr[0] == contact->node_addr.addr[0] &&
-                         next_hop_ip->addr[1] == contact->node_addr.addr[1] &&
-                         next_hop_ip->addr[2] == contact->node_addr.addr[2] &&
-                         next_hop_ip->addr[3] == contact->node_addr.addr[3]);
+        return dtn_routing_get_dtn_next_hop(routing, v_tc_fl, plen, hoplim, dest, sender, next_hop_ip);
+    }
 
-        if (ip_match)
+    for (int i = 0; i < controller->route_cache_count; i++)
+    {
+        DTN_Route_Cache_Entry *cached = &controller->route_cache[i];
+        if (cached->v_tc_fl == *v_tc_fl && cached->hoplim == *hoplim &&
+            memcmp(cached->dest.addr, dest->addr, sizeof(dest->addr)) == 0 &&
+            memcmp(cached->sender.addr, sender->addr, sizeof(sender->addr)) == 0)
         {
-            bool time_ok = (current_time >= contact->start_time_ms && current_time <= contact->end_time_ms);
-            if (time_ok) return true;
+            *next_hop_ip = cached->next_hop;
+            return cached->contact_available;
         }
-        contact = contact->next;
     }
-    return false;
+
+    int contact_available = dtn_routing_get_dtn_next_hop(routing, v_tc_fl, plen, hoplim, dest, sender, next_hop_ip);
+    if (controller->route_cache_count < DTN_BATCH_ROUTE_CACHE)
+    {
+        DTN_Route_Cache_Entry *cached = &controller->route_cache[controller->route_cache_count++];
+        cached->dest = *dest;
+        cached->sender = *sender;
+        cached->v_tc_fl = *v_tc_fl;
+        cached->hoplim = *hoplim;
+        cached->contact_available = contact_available;
+        cached->next_hop = *next_hop_ip;
+    }
+    return contact_available;
+}
+
+// Processes the packets read from the TUN device in one wakeup
+void dtn_controller_process_incoming_batch(DTN_Controller *controller, struct pbuf **packets, int count, struct netif *inp_netif)
+{
+    if (!controller)
+    {
+        for (int i = 0; i < count; i++) pbuf_free(packets[i]);
+        return;
+    }
+
+    controller->in_batch = true;
+    controller->route_cache_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        dtn_controller_process_incoming(controller, packets[i], inp_netif);
+    }
+    controller->in_batch = false;
+    controller->route_cache_count = 0;
 }
 
 void dtn_controller_process_incoming(DTN_Controller *controller, struct pbuf *p, struct netif *inp_netif)
@@ -216,116 +275,38 @@ void dtn_controller_process_incoming(DTN_Controller *controller, struct pbuf *p,
         return;
     }
 
-    if (p->len < IP6_HLEN)
-    {
-        fprintf(stderr, "DTN Controller: Packet too small for IPv6 header.\n");
-        pbuf_free(p);
-        return;
-    }
-
-    const struct ip6_hdr *ip6hdr = (const struct ip6_hdr *)p->payload;
-    if (IP6H_V(ip6hdr) != 6)
+    // One parse gives every later step its header fields and the custodian
+    DTN_Packet_Info info;
+    if (!dtn_packet_parse_headers(p, &info))
     {
-        fprintf(stderr, "DTN Controller: Packet is not IPv6 (version %d).\n", IP6H_V(ip6hdr));
+        fprintf(stderr, "DTN Controller: Packet is not a complete IPv6 header.\n");
         pbuf_free(p);
         return;
     }
 
-    ip6_addr_t temp_src_addr, temp_dest_addr, temp_dest_sender;
-    u32_t temp_v_tc_fl;
-    u16_t temp_plen;
-    u8_t  temp_hoplim;
-    memcpy(&temp_src_addr, &ip6hdr->src, sizeof(ip6_addr_t));
-    memcpy(&temp_dest_addr, &ip6hdr->dest, sizeof(ip6_addr_t));
-    memcpy(&temp_v_tc_fl, &ip6hdr->_v_tc_fl, sizeof(u32_t));
-    memcpy(&temp_plen, &ip6hdr->_plen, sizeof(u16_t));
-    memcpy(&temp_hoplim, &ip6hdr->_hoplim, sizeof(u8_t));
-
-    if (!dtn_extract_custodian_option(p, &temp_dest_sender)) {
-        memcpy(&temp_dest_sender, &temp_src_addr, sizeof(ip6_addr_t));
-    }
+    ip6_addr_t temp_dest_addr = info.dest, temp_dest_sender = info.custodian;
+    u32_t temp_v_tc_fl = info.v_tc_fl;
+    u16_t temp_plen = info.plen;
+    u8_t  temp_hoplim = info.hoplim;
 
     Routing_Function *routing = controller->parent_module->routing;
     Storage_Function *storage = controller->parent_module->storage;
 
     // Check if this is ICMPv6 and process it
-    if (IP6H_NEXTH(ip6hdr) == IP6_NEXTH_ICMP6)
+    if (info.nexth == IP6_NEXTH_ICMP6 && dtn_controller_process_icmpv6(controller, p, &info, inp_netif))
     {
-        struct pbuf *q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-        if (!q)
-        {
-            fprintf(stderr, "DTN Controller: Failed to allocate pbuf for ICMPv6 processing.\n");
-            pbuf_free(p);
-            return;
-        }
-
-        if (pbuf_copy(q, p) != ERR_OK)
-        {
-            fprintf(stderr, "DTN Controller: Failed to copy pbuf for ICMPv6 processing.\n");
-            pbuf_free(q);
-            pbuf_free(p);
-            return;
-        }
-
-        // Skip IPv6 header to get to ICMPv6 header
-        if (pbuf_header(q, -IP6_HLEN) != 0)
-        {
-            fprintf(stderr, "DTN Controller: Failed to adjust pbuf header for ICMPv6 processing.\n");
-            pbuf_free(q);
-            pbuf_free(p);
-            return;
-        }
-
-        // Process the ICMPv6 message
-        if (dtn_controller_process_icmpv6(controller, q, inp_netif))
-        {
-            pbuf_free(q);
-            pbuf_free(p);
-            return;
-        }
-
-        // Not a DTN ICMPv6 message, continue normal processing
-        pbuf_free(q);
+        pbuf_free(p);
+        return;
     }
 
-    bool is_for_this_lwip_stack = false;
-        ip6_addr_t local_lwip_addr_1, local_lwip_addr_2;
-        if (ip6addr_aton("fd00:01::2", &local_lwip_addr_1)) {
-            ip6_addr_t dest_nozone = temp_dest_addr;
-#if LWIP_IPV6_SCOPES
-            ip6_addr_set_zone(&dest_nozone, IP6_NO_ZONE);
-            ip6_addr_set_zone(&local_lwip_addr_1, IP6_NO_ZONE);
-#endif
-            if (ip6_addr_cmp(&dest_nozone, &local_lwip_addr_1)) {
-                is_for_this_lwip_stack = true;
-            }
-        }
-        if (ip6addr_aton("fd00:12::1", &local_lwip_addr_2)) {
-            ip6_addr_t dest_nozone = temp_dest_addr;
-#if LWIP_IPV6_SCOPES
-            ip6_addr_set_zone(&dest_nozone, IP6_NO_ZONE);
-            ip6_addr_set_zone(&local_lwip_addr_2, IP6_NO_ZONE);
-#endif
-            if (ip6_addr_cmp(&dest_nozone, &local_lwip_addr_2)) {
-                is_for_this_lwip_stack = true;
-            }
-        }
+    bool is_for_this_lwip_stack = dtn_local_addr_contains(&controller->local_addrs, &temp_dest_addr);
     if (is_for_this_lwip_stack)
     {
-        // Create a copy of the packet for DTN-PCK-RECEIVED
-        struct pbuf *p_copy = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-        if (p_copy != NULL)
-        {
-            if (pbuf_copy(p_copy, p) == ERR_OK)
-            {
-                // Send DTN-PCK-RECEIVED message to acknowledge receipt
-                dtn_icmpv6_send_pck_received(inp_netif, p_copy, ICMP6_CODE_DTN_NO_INFO);
+        // Acknowledge receipt to the custodian, batched with the other acknowledgements to it
+        dtn_icmpv6_ack_custody(inp_netif, &info.custodian, dtn_packet_fingerprint(p, &info));
 
-                // Also send DTN-PCK-DELIVERED
-                //dtn_icmpv6_send_pck_delivered(inp_netif, p_copy, ICMP6_CODE_DTN_NO_INFO);
-            }
-            pbuf_free(p_copy);
-        }
+        // Also send DTN-PCK-DELIVERED
+        //dtn_icmpv6_send_pck_delivered(inp_netif, p, ICMP6_CODE_DTN_NO_INFO);
 
         // Process the packet locally
         err_t err = ip6_input(p, inp_netif);
@@ -342,65 +323,56 @@ void dtn_controller_process_incoming(DTN_Controller *controller, struct pbuf *p,
 
     if (is_dtn_dest)
     {
+        // A packet we already hold or passed on is only acknowledged, so the sender stops retrying
+        uint64_t fingerprint = dtn_packet_fingerprint(p, &info);
+        if (dtn_storage_dedup_seen(storage, fingerprint))
+        {
+            char addr_str[IP6ADDR_STRLEN_MAX];
+            ip6addr_ntoa_r(&temp_dest_addr, addr_str, sizeof(addr_str));
+            printf("DTN Controller: Duplicate packet for %s, acknowledging without storing it.\n", addr_str);
+            dtn_storage_ack_when_durable(storage, &info, inp_netif);
+            pbuf_free(p);
+            return;
+        }
+
         ip6_addr_t next_hop_ip;
-        int contact_available = dtn_routing_get_dtn_next_hop(routing, &temp_v_tc_fl, &temp_plen, &temp_hoplim, &temp_dest_addr, &temp_dest_sender, &next_hop_ip);
+        int contact_available = incoming_next_hop(controller, &temp_v_tc_fl, &temp_plen, &temp_hoplim, &temp_dest_addr, &temp_dest_sender, &next_hop_ip);
         bool active = is_next_hop_active_contact(routing, &next_hop_ip);
         if (contact_available && active)
         {
-            // Create a copy of the packet for DTN-PCK-FORWARDED message
-            struct pbuf *p_copy = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-            if (p_copy != NULL)
-            {
-                if (pbuf_copy(p_copy, p) == ERR_OK)
-                {
-                    // Send DTN-PCK-FORWARDED message
-                    //dtn_icmpv6_send_pck_forwarded(inp_netif, p_copy, ICMP6_CODE_DTN_NO_INFO);
-                }
-                pbuf_free(p_copy);
-            }
+            // Send DTN-PCK-FORWARDED message, before the custody option changes the packet
+            //dtn_icmpv6_send_pck_forwarded(inp_netif, p, ICMP6_CODE_DTN_NO_INFO);
 
             ip6_addr_t my_addr = inp_netif->ip6_addr[1];
             dtn_update_or_add_custodian_option(&p, &my_addr);
-            err_t err = raw_socket_send_ipv6(p, &next_hop_ip) == 0 ? ERR_OK : ERR_IF;
+            err_t err = send_to_next_hop(controller, p, &next_hop_ip) == 0 ? ERR_OK : ERR_IF;
             if (err != ERR_OK)
             {
                 fprintf(stderr, "DTN Controller: Error sending packet via raw socket: %d.\n", err);
             }
+            else
+            {
+                dtn_storage_dedup_remember(storage, fingerprint);
+            }
             pbuf_free(p);
             return;
         }
         else
         {
-            if (dtn_storage_store_packet(storage, p, &temp_dest_addr))
+            if (dtn_storage_store_packet(storage, p, &temp_dest_addr, fingerprint))
             {
-                // Create a copy for DTN-PCK-RECEIVED
-                struct pbuf *p_copy = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-                if (p_copy != NULL)
-                {
-                    if (pbuf_copy(p_copy, p) == ERR_OK)
-                    {
-                        // Send DTN-PCK-RECEIVED message
-                        dtn_icmpv6_send_pck_received(inp_netif, p_copy, ICMP6_CODE_DTN_NO_CONTACT);
-                    }
-                    pbuf_free(p_copy);
-                }
+                dtn_storage_dedup_remember(storage, fingerprint);
+                // The acknowledgement takes custody, so it waits until the packet is durable
+                dtn_storage_ack_when_durable(storage, &info, inp_netif);
+                pbuf_free(p);
                 return;
             }
             else
             {
                 fprintf(stderr, "DTN Controller: Failed to store packet (e.g., storage full). Freeing.\n");
 
-                // Create a copy of the packet for DTN-PCK-DELETED message
-                struct pbuf *p_copy = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-                if (p_copy != NULL)
-                {
-                    if (pbuf_copy(p_copy, p) == ERR_OK)
-                    {
-                        // Send DTN-PCK-DELETED message
-                        //dtn_icmpv6_send_pck_deleted(inp_netif, p_copy, ICMP6_CODE_DTN_DEPLETED_STORE, 0);
-                    }
-                    pbuf_free(p_copy);
-                }
+                // Send DTN-PCK-DELETED message
+                //dtn_icmpv6_send_pck_deleted(inp_netif, p, ICMP6_CODE_DTN_DEPLETED_STORE, 0);
 
                 pbuf_free(p);
                 return;
@@ -418,127 +390,329 @@ void dtn_controller_process_incoming(DTN_Controller *controller, struct pbuf *p,
     }
 }
 
-void dtn_controller_attempt_forward_stored(DTN_Controller *controller, struct netif *netif_out)
+// Runs CGR for a stored packet, its header is rebuilt from the metadata when the packet is not
+// resident. Stored packets keep no custodian, the source stands in for it.
+static int stored_entry_next_hop(DTN_Controller *controller, Stored_Packet_Entry *entry, ip6_addr_t *next_hop_ip)
 {
-    if (!controller || !controller->parent_module || !controller->parent_module->storage ||
-        !controller->parent_module->routing || !netif_out)
+    Storage_Function *storage = controller->parent_module->storage;
+    Routing_Function *routing = controller->parent_module->routing;
+    struct ip6_hdr rebuilt_hdr;
+    struct ip6_hdr *ip6hdr = &rebuilt_hdr;
+    ip6_addr_t sender_ip, dest_addr;
+
+    if (entry->p)
+    {
+        ip6hdr = (struct ip6_hdr *)entry->p->payload;
+    }
+    else
+    {
+        dtn_storage_entry_header(storage, entry, &rebuilt_hdr);
+    }
+
+    u32_t v_tc_fl;
+    u16_t plen;
+    u8_t hoplim;
+    memcpy(&v_tc_fl, &ip6hdr->_v_tc_fl, sizeof(u32_t));
+    memcpy(&hoplim, &ip6hdr->_hoplim, sizeof(u8_t));
+    ip6_addr_copy_from_packed(dest_addr, ip6hdr->dest);
+    ip6_addr_set_zone(&dest_addr, IP6_NO_ZONE);
+
+    // A resident packet may carry the custody slot of an earlier forward, which names this node,
+    // so the length and the sender come from the packet as it was stored
+    plen = lwip_htons((u16_t)(entry->packet_len - IP6_HLEN));
+    ip6_addr_copy_from_packed(sender_ip, ip6hdr->src);
+    ip6_addr_set_zone(&sender_ip, IP6_NO_ZONE);
+    return dtn_routing_get_dtn_next_hop(routing, &v_tc_fl, &plen, &hoplim, &dest_addr, &sender_ip, next_hop_ip);
+}
+
+// Sends a resident stored packet to the given next hop
+static void send_stored_entry(DTN_Controller *controller, Stored_Packet_Entry *entry, const ip6_addr_t *next_hop)
+{
+    struct netif *netif_out = controller->forward_netif;
+    struct pbuf *stored_p = entry->p;
+    ip6_addr_t next_hop_ip = *next_hop;
+    const ip6_addr_t *retrieved_dest = dtn_storage_entry_dest(controller->parent_module->storage, entry);
+
+    char node_addr_str[IP6ADDR_STRLEN_MAX];
+    ip6addr_ntoa_r(&next_hop_ip, node_addr_str, sizeof(node_addr_str));
+    printf("DTN Controller: Forwarding to %s (via CGR)\n", node_addr_str);
+
+    bool is_for_this_lwip_stack = dtn_local_addr_contains(&controller->local_addrs, retrieved_dest);
+
+    if (is_for_this_lwip_stack)
+    {
+        // ip6_input consumes the packet, so the stack gets a copy of its own
+        struct pbuf *p_to_fwd = pbuf_alloc(PBUF_RAW, stored_p->tot_len, PBUF_RAM);
+        if (!p_to_fwd || pbuf_copy(p_to_fwd, stored_p) != ERR_OK)
+        {
+            if (p_to_fwd) pbuf_free(p_to_fwd);
+            return;
+        }
+
+        DTN_Packet_Info stored_info;
+        if (dtn_packet_parse_headers(stored_p, &stored_info))
+        {
+            dtn_icmpv6_ack_custody(netif_out, &stored_info.custodian, entry->fingerprint);
+        }
+
+        err_t err = ip6_input(p_to_fwd, netif_out);
+        if (err != ERR_OK)
+        {
+            pbuf_free(p_to_fwd);
+        }
+    }
+    else
+    {
+        // Send DTN-PCK-FORWARDED message (comentat originalment)
+        //dtn_icmpv6_send_pck_forwarded(netif_out, stored_p, ICMP6_CODE_DTN_NO_INFO);
+
+        // The stored packet goes out itself. Its custody slot is inserted into the read headroom on the
+        // first forward and only has its custodian overwritten after that.
+        struct pbuf *p_to_fwd = stored_p;
+        pbuf_ref(p_to_fwd);
+
+        ip6_addr_t my_addr = netif_out->ip6_addr[1];
+        if (!dtn_update_or_add_custodian_option(&p_to_fwd, &my_addr))
+        {
+            fprintf(stderr, "DTN Controller: Failed to add custody option to stored packet.\n");
+            pbuf_free(p_to_fwd);
+            return;
+        }
+
+        err_t err = send_to_next_hop(controller, p_to_fwd, &next_hop_ip) == 0 ? ERR_OK : ERR_IF;
+        if (err != ERR_OK)
+        {
+            fprintf(stderr, "DTN Controller: Error sending stored packet via raw socket: %d.\n", err);
+        }
+        else
+        {
+            start_rtt_sample(controller, retrieved_dest, &next_hop_ip);
+        }
+        pbuf_free(p_to_fwd);
+    }
+}
+
+static void remember_scheduled_read(DTN_Controller *controller, const Stored_Packet_Entry *entry, const ip6_addr_t *next_hop)
+{
+    DTN_Scheduled_Read *read = &controller->scheduled_reads[controller->scheduled_reads_next];
+    controller->scheduled_reads_next = (controller->scheduled_reads_next + 1) % DTN_SCHEDULE_PENDING_READS;
+    read->file_id = entry->file_id;
+    read->next_hop = *next_hop;
+    read->is_valid = true;
+}
+
+static bool take_scheduled_read(DTN_Controller *controller, const Stored_Packet_Entry *entry, ip6_addr_t *next_hop)
+{
+    for (int i = 0; i < DTN_SCHEDULE_PENDING_READS; i++)
+    {
+        DTN_Scheduled_Read *read = &controller->scheduled_reads[i];
+        if (read->is_valid && read->file_id == entry->file_id)
+        {
+            *next_hop = read->next_hop;
+            read->is_valid = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Forwards one stored packet whose pbuf is resident, then drops it back to disk-only
+void dtn_controller_forward_stored_entry(DTN_Controller *controller, Stored_Packet_Entry *entry)
+{
+    if (!controller || !entry || !entry->p || !controller->forward_netif)
     {
         return;
     }
 
+    Routing_Function *routing = controller->parent_module->routing;
+    ip6_addr_t next_hop_ip;
+
+    // A packet read back for the scheduler already has its next hop
+    int contact_available = take_scheduled_read(controller, entry, &next_hop_ip) ||
+                            stored_entry_next_hop(controller, entry, &next_hop_ip);
+    if (contact_available && is_next_hop_active_contact(routing, &next_hop_ip))
+    {
+        send_stored_entry(controller, entry, &next_hop_ip);
+    }
+
+    // Keep only metadata in memory until the next attempt
+    dtn_storage_entry_release_pbuf(entry);
+}
+
+static int compare_schedule_candidates(const void *a, const void *b)
+{
+    const DTN_Schedule_Candidate *x = (const DTN_Schedule_Candidate *)a;
+    const DTN_Schedule_Candidate *y = (const DTN_Schedule_Candidate *)b;
+    if (x->time_left_ms != y->time_left_ms)
+    {
+        return x->time_left_ms < y->time_left_ms ? -1 : 1;
+    }
+    return (int)y->entry->priority - (int)x->entry->priority;
+}
+
+static DTN_Schedule_Candidate *add_schedule_candidate(DTN_Controller *controller, size_t count)
+{
+    if (count == controller->schedule_capacity)
+    {
+        size_t capacity = controller->schedule_capacity ? controller->schedule_capacity * 2 : 16;
+        DTN_Schedule_Candidate *grown = (DTN_Schedule_Candidate *)realloc(controller->schedule, capacity * sizeof(DTN_Schedule_Candidate));
+        if (!grown)
+        {
+            perror("DTN Controller: Failed to grow the transmission schedule");
+            return NULL;
+        }
+        controller->schedule = grown;
+        controller->schedule_capacity = capacity;
+    }
+    return &controller->schedule[count];
+}
+
+// Offers the next packet of a destination that may be tried, adding it to the schedule when its
+// next hop is in contact. Returns the new schedule length.
+static size_t offer_destination(DTN_Controller *controller, Storage_Destination *destination, size_t count)
+{
     Storage_Function *storage = controller->parent_module->storage;
     Routing_Function *routing = controller->parent_module->routing;
 
-    // Update routing contacts based on current time
-    dtn_routing_update_contacts(routing);
+    // Check if the destination is backing off
+    if (!should_attempt_forward(controller, dtn_storage_destination_addr(storage, destination)))
+    {
+        return count;
+    }
+
+    // Higher priority classes get the contact first
+    Stored_Packet_Entry *entry = dtn_storage_drain_next(storage, destination);
+    ip6_addr_t next_hop_ip;
+    Contact_Info *contact = NULL;
+    if (entry && stored_entry_next_hop(controller, entry, &next_hop_ip))
+    {
+        contact = dtn_routing_active_contact_to(routing, &next_hop_ip);
+    }
+    DTN_Schedule_Candidate *candidate = contact ? add_schedule_candidate(controller, count) : NULL;
+    if (candidate)
+    {
+        candidate->entry = entry;
+        candidate->contact = contact;
+        candidate->next_hop = next_hop_ip;
+        candidate->time_left_ms = dtn_storage_entry_time_left(entry, sys_now());
+        count_forward_attempt(controller, dtn_storage_destination_addr(storage, destination), &next_hop_ip, contact);
+        count++;
+    }
+    else if (entry && entry->p)
+    {
+        dtn_storage_entry_release_pbuf(entry);
+    }
+    return count;
+}
+
+// The scheduled packets are sent earliest deadline first for as long as each contact's remaining
+// volume (rate times the time left in the window) holds them
+static void send_schedule(DTN_Controller *controller, size_t count)
+{
+    Storage_Function *storage = controller->parent_module->storage;
 
-    Stored_Packet_Entry *entry = storage->packet_list_head;
+    qsort(controller->schedule, count, sizeof(DTN_Schedule_Candidate), compare_schedule_candidates);
 
-    while (entry != NULL)
+    u32_t now = sys_now();
+    for (size_t i = 0; i < count; i++)
     {
-        Stored_Packet_Entry *next_entry = entry->next;
+        DTN_Schedule_Candidate *candidate = &controller->schedule[i];
+        Stored_Packet_Entry *entry = candidate->entry;
+        Contact_Info *contact = candidate->contact;
 
-        // Check if enough time has passed since last attempt
-        if (should_attempt_forward(controller, &entry->original_dest))
+        // Without a rate in the contact plan the contact is not budgeted
+        if (contact->rate_bytes_per_s > 0)
         {
-            struct ip6_hdr *ip6hdr = (struct ip6_hdr *)entry->p->payload;
-            u32_t v_tc_fl;
-            u16_t plen;
-            u8_t hoplim;
-            ip6_addr_t src_addr, sender_ip, retrieved_dest_nozone;
-            
-            memcpy(&v_tc_fl, &ip6hdr->_v_tc_fl, sizeof(u32_t));
-            memcpy(&plen, &ip6hdr->_plen, sizeof(u16_t));
-            memcpy(&hoplim, &ip6hdr->_hoplim, sizeof(u8_t));
-            memcpy(&src_addr, &ip6hdr->src, sizeof(ip6_addr_t));
-            memcpy(&retrieved_dest_nozone, &ip6hdr->dest, sizeof(ip6_addr_t));
-
-            if (!dtn_extract_custodian_option(entry->p, &sender_ip)) {
-                memcpy(&sender_ip, &src_addr, sizeof(ip6_addr_t));
+            u32_t start = (s32_t)(contact->busy_until_ms - now) > 0 ? contact->busy_until_ms : now;
+            u32_t tx_ms = (u32_t)(((u64_t)entry->packet_len * 1000 + contact->rate_bytes_per_s - 1) / contact->rate_bytes_per_s);
+            u32_t sent_ms = start + tx_ms;
+
+            if ((s32_t)(sent_ms - contact->end_time_ms) > 0)
+            {
+                // No room left in this contact, wait for the next one
+                refund_forward_attempt(controller, dtn_storage_entry_dest(storage, entry));
+                dtn_storage_entry_release_pbuf(entry);
+                continue;
             }
-            ip6_addr_t next_hop_ip;
-            int contact_available = dtn_routing_get_dtn_next_hop(routing, &v_tc_fl, &plen, &hoplim, &retrieved_dest_nozone, &sender_ip, &next_hop_ip);
-            if (contact_available && is_next_hop_active_contact(routing, &next_hop_ip))
+            if ((u64_t)(sent_ms - now) + contact->owlt_ms > candidate->time_left_ms)
             {
-                char node_addr_str[IP6ADDR_STRLEN_MAX];
-                ip6addr_ntoa_r(&next_hop_ip, node_addr_str, sizeof(node_addr_str));
-                printf("DTN Controller: Forwarding to %s (via CGR)\n", node_addr_str);
-
-                struct pbuf *p_to_fwd = pbuf_alloc(PBUF_RAW, entry->p->tot_len, PBUF_RAM);
-                
-                if (p_to_fwd && pbuf_copy(p_to_fwd, entry->p) == ERR_OK)
-                {
-                    bool is_for_this_lwip_stack = false;
-                    ip6_addr_t local_lwip_addr_1, local_lwip_addr_2;
-                    if (ip6addr_aton("fd00:01::2", &local_lwip_addr_1)) {
-                        ip6_addr_t dest_nozone = retrieved_dest_nozone;
-            #if LWIP_IPV6_SCOPES
-                        ip6_addr_set_zone(&dest_nozone, IP6_NO_ZONE);
-                        ip6_addr_set_zone(&local_lwip_addr_1, IP6_NO_ZONE);
-            #endif
-                        if (ip6_addr_cmp(&dest_nozone, &local_lwip_addr_1)) {
-                            is_for_this_lwip_stack = true;
-                        }
-                    }
-                    if (ip6addr_aton("fd00:12::1", &local_lwip_addr_2)) {
-                        ip6_addr_t dest_nozone = retrieved_dest_nozone;
-            #if LWIP_IPV6_SCOPES
-                        ip6_addr_set_zone(&dest_nozone, IP6_NO_ZONE);
-                        ip6_addr_set_zone(&local_lwip_addr_2, IP6_NO_ZONE);
-            #endif
-                        if (ip6_addr_cmp(&dest_nozone, &local_lwip_addr_2)) {
-                            is_for_this_lwip_stack = true;
-                        }
-                    }
-
-                    if (is_for_this_lwip_stack)
-                    {
-                        // Create a copy of the packet for DTN-PCK-RECEIVED message
-                        struct pbuf *p_copy = pbuf_alloc(PBUF_RAW, p_to_fwd->tot_len, PBUF_RAM);
-                        if (p_copy != NULL)
-                        {
-                            if (pbuf_copy(p_copy, p_to_fwd) == ERR_OK)
-                            {
-                                dtn_icmpv6_send_pck_received(netif_out, p_copy, ICMP6_CODE_DTN_NO_INFO);
-                            }
-                            pbuf_free(p_copy);
-                        }
-
-                        err_t err = ip6_input(p_to_fwd, netif_out);
-                        if (err != ERR_OK)
-                        {
-                            pbuf_free(p_to_fwd);
-                        }
-                    }
-                    else
-                    {
-                        struct pbuf *p_copy = pbuf_alloc(PBUF_RAW, p_to_fwd->tot_len, PBUF_RAM);
-                        if (p_copy != NULL)
-                        {
-                            if (pbuf_copy(p_copy, p_to_fwd) == ERR_OK)
-                            {
-                                // Send DTN-PCK-FORWARDED message (comentat originalment)
-                                //dtn_icmpv6_send_pck_forwarded(netif_out, p_copy, ICMP6_CODE_DTN_NO_INFO);
-                            }
-                            pbuf_free(p_copy);
-                        }
-
-                        ip6_addr_t my_addr = netif_out->ip6_addr[1];
-                        dtn_add_custodian_option(&p_to_fwd, &my_addr);
-                        
-                        err_t err = raw_socket_send_ipv6(p_to_fwd, &next_hop_ip) == 0 ? ERR_OK : ERR_IF;
-                        if (err != ERR_OK)
-                        {
-                            fprintf(stderr, "DTN Controller: Error sending stored packet via raw socket: %d.\n", err);
-                        }
-                        pbuf_free(p_to_fwd);
-                    }
-                }
-                else if (p_to_fwd) {
-                    pbuf_free(p_to_fwd); 
-                }
+                char addr_str[IP6ADDR_STRLEN_MAX];
+                ip6addr_ntoa_r(dtn_storage_entry_dest(storage, entry), addr_str, sizeof(addr_str));
+                printf("DTN Controller: Packet for %s can't arrive before its deadline, not sending it\n", addr_str);
+                dtn_storage_entry_release_pbuf(entry);
+                continue;
             }
+            contact->busy_until_ms = sent_ms;
+        }
+
+        if (entry->p)
+        {
+            send_stored_entry(controller, entry, &candidate->next_hop);
+            dtn_storage_entry_release_pbuf(entry);
+        }
+        else
+        {
+            // The read completes on the main loop, which then forwards the entry
+            remember_scheduled_read(controller, entry, &candidate->next_hop);
+            dtn_storage_prefetch_entry(storage, entry);
         }
-        entry = next_entry;
     }
-}
\ No newline at end of file
+}
+
+// Every destination that is not backing off offers its next packet, called when a contact
+// comes up and may open a path to any of them
+void dtn_controller_attempt_forward_stored(DTN_Controller *controller, struct netif *netif_out)
+{
+    if (!controller || !controller->parent_module || !controller->parent_module->storage ||
+        !controller->parent_module->routing || !netif_out)
+    {
+        return;
+    }
+
+    Storage_Function *storage = controller->parent_module->storage;
+    controller->forward_netif = netif_out;
+
+    // Update routing contacts based on current time
+    dtn_routing_update_contacts(controller->parent_module->routing);
+
+    size_t count = 0;
+    Storage_Destination *destination = storage->active_head;
+
+    while (destination != NULL)
+    {
+        Storage_Destination *next_destination = destination->next_active;
+        count = offer_destination(controller, destination, count);
+        destination = next_destination;
+    }
+
+    send_schedule(controller, count);
+}
+
+// Only the destinations whose backoff ran out offer a packet, the others are not looked at.
+// Called once per main loop iteration, destinations still without a contact wait for the next one.
+void dtn_controller_forward_due(DTN_Controller *controller)
+{
+    if (!controller || !dtn_forward_tracker_has_due(&controller->forward_tracker) ||
+        !controller->forward_netif || !controller->parent_module ||
+        !controller->parent_module->storage || !controller->parent_module->routing)
+    {
+        return;
+    }
+
+    Storage_Function *storage = controller->parent_module->storage;
+    size_t count = 0;
+    DTN_Forward_Attempt *attempt;
+    while ((attempt = dtn_forward_tracker_pop_due(&controller->forward_tracker)) != NULL)
+    {
+        Storage_Destination *destination = dtn_storage_destination_for(storage, &attempt->destination);
+        if (!destination || destination->count == 0)
+        {
+            // Nothing left to send there
+            dtn_forward_tracker_remove(&controller->forward_tracker, attempt);
+            continue;
+        }
+        count = offer_destination(controller, destination, count);
+    }
+
+    send_schedule(controller, count);
+}
@@ -14,6 +14,7 @@
 // along with this program. If not, see <https://www.gnu.org/licenses/>.
 
 #include "dtn_custody.h"
+#include "dtn_packet.h"
 #include "lwip/ip6.h"
 #include "lwip/pbuf.h"
 #include <string.h>
@@ -35,15 +36,35 @@ struct hbh_hdr {
 };
 #pragma pack(pop)
 
+static void dtn_fill_custodian_option(struct hbh_hdr *hbh, uint8_t next_header, const ip6_addr_t *custodian) {
+    hbh->next_header  = next_header;
+    hbh->hdr_ext_len  = (HBH_OPT_HDR_LEN/8) - 1;
+    hbh->opt_type     = CUSTODY_OPTION_TYPE;
+    hbh->opt_data_len = 16;
+    memcpy(hbh->addr, custodian->addr, 16);
+    memset(hbh->pad, 0, sizeof(hbh->pad));
+}
+
 bool dtn_add_custodian_option(struct pbuf **p, const ip6_addr_t *custodian) {
     if (!p || !*p || !custodian) return false;
     struct pbuf *orig = *p;
+    if (orig->len < IP6_HLEN) return false;
     struct ip6_hdr *ip6hdr = (struct ip6_hdr *)orig->payload;
 
     uint8_t old_nexth = IP6H_NEXTH(ip6hdr);
     uint16_t orig_len = IP6H_PLEN(ip6hdr);
     uint16_t new_len  = orig_len + HBH_OPT_HDR_LEN;
 
+    // With headroom (DTN_CUSTODY_HEADROOM) only the IPv6 header moves, the payload stays where it is
+    if (pbuf_add_header(orig, HBH_OPT_HDR_LEN) == 0) {
+        memmove(orig->payload, (uint8_t*)orig->payload + HBH_OPT_HDR_LEN, IP6_HLEN);
+        struct ip6_hdr *new_ip6 = orig->payload;
+        IP6H_NEXTH_SET(new_ip6, IP6_NEXTH_HOPOPTS);
+        IP6H_PLEN_SET(new_ip6, new_len);
+        dtn_fill_custodian_option((struct hbh_hdr *)((uint8_t*)orig->payload + IP6_HLEN), old_nexth, custodian);
+        return true;
+    }
+
     // Allocate new pbuf for rebuilt packet
     struct pbuf *newp = pbuf_alloc(PBUF_RAW, IP6_HLEN + new_len, PBUF_RAM);
     if (!newp) return false;
@@ -55,18 +76,11 @@ bool dtn_add_custodian_option(struct pbuf **p, const ip6_addr_t *custodian) {
     IP6H_PLEN_SET(new_ip6, new_len);
 
     // 2. Build Hop-by-Hop header
-    struct hbh_hdr *hbh = (struct hbh_hdr *)((uint8_t*)newp->payload + IP6_HLEN);
-    hbh->next_header  = old_nexth;
-    hbh->hdr_ext_len  = (HBH_OPT_HDR_LEN/8) - 1;
-    hbh->opt_type     = CUSTODY_OPTION_TYPE;
-    hbh->opt_data_len = 16;
-    memcpy(hbh->addr, custodian->addr, 16);
-    memset(hbh->pad, 0, sizeof(hbh->pad));
+    dtn_fill_custodian_option((struct hbh_hdr *)((uint8_t*)newp->payload + IP6_HLEN), old_nexth, custodian);
 
     // 3. Copy original payload after HBH
     uint8_t *dst = (uint8_t*)newp->payload + IP6_HLEN + HBH_OPT_HDR_LEN;
-    uint8_t *src = (uint8_t*)orig->payload   + IP6_HLEN;
-    memcpy(dst, src, orig->tot_len - IP6_HLEN);
+    pbuf_copy_partial(orig, dst, orig->tot_len - IP6_HLEN, IP6_HLEN);
 
     // 4. Replace old packet
     pbuf_free(orig);
@@ -76,23 +90,9 @@ bool dtn_add_custodian_option(struct pbuf **p, const ip6_addr_t *custodian) {
 
 bool dtn_extract_custodian_option(const struct pbuf *p, ip6_addr_t *custodian_out) {
     if (!p || !custodian_out) return false;
-    const struct ip6_hdr *ip6hdr = (const struct ip6_hdr *)p->payload;
-    uint8_t nexth = IP6H_NEXTH(ip6hdr);
-    const uint8_t *ptr = (const uint8_t*)ip6hdr + IP6_HLEN;
-
-    // Skip extension headers until Hop-by-Hop
-    while (nexth != IP6_NEXTH_HOPOPTS && nexth != IP6_NEXTH_NONE) {
-        const uint8_t *ext = ptr;
-        nexth    = ext[0];
-        uint8_t elen = (ext[1] + 1) * 8;
-        ptr += elen;
-    }
-    if (nexth != IP6_NEXTH_HOPOPTS) return false;
-
-    // ptr points at HBH header start
-    const struct hbh_hdr *hbh = (const struct hbh_hdr*)ptr;
-    if (hbh->opt_type != CUSTODY_OPTION_TYPE || hbh->opt_data_len != 16) return false;
-    memcpy(custodian_out->addr, hbh->addr, 16);
+    DTN_Packet_Info info;
+    if (!dtn_packet_parse_headers(p, &info) || info.custody_offset == 0) return false;
+    *custodian_out = info.custodian;
     return true;
 }
 
@@ -114,6 +114,16 @@ bool dtn_strip_custodian_option(struct pbuf **p) {
     // Calculate new packet length
     uint16_t orig_len = IP6H_PLEN(ip6hdr);
     uint16_t new_len = orig_len - hbh_len;
+
+    // Move the IPv6 header over the HBH header and give the space back as headroom
+    if (orig->len >= IP6_HLEN + hbh_len) {
+        memmove((uint8_t*)orig->payload + hbh_len, orig->payload, IP6_HLEN);
+        pbuf_remove_header(orig, hbh_len);
+        struct ip6_hdr *new_ip6 = orig->payload;
+        IP6H_NEXTH_SET(new_ip6, next_nexth);
+        IP6H_PLEN_SET(new_ip6, new_len);
+        return true;
+    }
     
     // Allocate new pbuf without hop-by-hop header
     struct pbuf *newp = pbuf_alloc(PBUF_RAW, IP6_HLEN + new_len, PBUF_RAM);
@@ -127,8 +137,7 @@ bool dtn_strip_custodian_option(struct pbuf **p) {
     
     // Copy remaining payload (skip HBH header)
     uint8_t *dst = (uint8_t*)newp->payload + IP6_HLEN;
-    uint8_t *src = (uint8_t*)orig->payload + IP6_HLEN + hbh_len;
-    memcpy(dst, src, orig->tot_len - IP6_HLEN - hbh_len);
+    pbuf_copy_partial(orig, dst, orig->tot_len - IP6_HLEN - hbh_len, IP6_HLEN + hbh_len);
     
     // Replace old packet
     pbuf_free(orig);
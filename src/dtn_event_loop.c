@@ -0,0 +1,155 @@
+// dtn_event_loop.c: epoll reactor that dispatches descriptor callbacks and sleeps on a timerfd until the next timer is due
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_event_loop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// The timerfd only has to wake epoll_wait up, reading it clears the expiry
+static void dtn_event_loop_timer_expired(int fd, u32_t events, void* arg) {
+    (void)events;
+    (void)arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("DTN Event Loop: Failed to read timerfd");
+    }
+}
+
+int dtn_event_loop_init(DTN_Event_Loop* loop) {
+    memset(loop, 0, sizeof(*loop));
+    loop->timer_fd = -1;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("DTN Event Loop: Failed to create epoll instance");
+        return -1;
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd < 0) {
+        perror("DTN Event Loop: Failed to create timerfd");
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+        return -1;
+    }
+
+    if (dtn_event_loop_add(loop, loop->timer_fd, EPOLLIN, dtn_event_loop_timer_expired, NULL) < 0) {
+        close(loop->timer_fd);
+        close(loop->epoll_fd);
+        loop->timer_fd = -1;
+        loop->epoll_fd = -1;
+        return -1;
+    }
+
+    loop->running = true;
+    return 0;
+}
+
+void dtn_event_loop_destroy(DTN_Event_Loop* loop) {
+    DTN_Event_Handler* handler = loop->handlers;
+    while (handler != NULL) {
+        DTN_Event_Handler* next = handler->next;
+        free(handler);
+        handler = next;
+    }
+    loop->handlers = NULL;
+    if (loop->timer_fd >= 0) close(loop->timer_fd);
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    loop->timer_fd = -1;
+    loop->epoll_fd = -1;
+    loop->running = false;
+}
+
+// Calls back whenever one of the events (EPOLLIN, ...) is pending on fd, errors are always reported
+int dtn_event_loop_add(DTN_Event_Loop* loop, int fd, u32_t events, DTN_Event_Callback callback, void* arg) {
+    DTN_Event_Handler* handler = (DTN_Event_Handler*)malloc(sizeof(DTN_Event_Handler));
+    if (!handler) {
+        perror("DTN Event Loop: Failed to allocate handler");
+        return -1;
+    }
+    handler->fd = fd;
+    handler->callback = callback;
+    handler->arg = arg;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "DTN Event Loop: Failed to register fd %d: %s\n", fd, strerror(errno));
+        free(handler);
+        return -1;
+    }
+
+    handler->next = loop->handlers;
+    loop->handlers = handler;
+    return 0;
+}
+
+// Not from within a callback, the events of the current wakeup may still point at the handler
+void dtn_event_loop_remove(DTN_Event_Loop* loop, int fd) {
+    DTN_Event_Handler** link = &loop->handlers;
+    while (*link != NULL) {
+        DTN_Event_Handler* handler = *link;
+        if (handler->fd == fd) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            *link = handler->next;
+            free(handler);
+            return;
+        }
+        link = &handler->next;
+    }
+}
+
+// Sleeps until a registered descriptor is ready or timeout_ms has passed, then runs the callbacks.
+// Returns the number of events dispatched, or -1 on error.
+int dtn_event_loop_wait(DTN_Event_Loop* loop, u32_t timeout_ms) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (timeout_ms != DTN_EVENT_LOOP_NO_TIMEOUT) {
+        // A zero it_value would disarm the timer, so a due timer still waits a nanosecond
+        spec.it_value.tv_sec = timeout_ms / 1000;
+        spec.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+        if (timeout_ms == 0) spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(loop->timer_fd, 0, &spec, NULL) < 0) {
+        perror("DTN Event Loop: Failed to arm timerfd");
+        return -1;
+    }
+
+    struct epoll_event events[DTN_EVENT_LOOP_MAX_EVENTS];
+    int n = epoll_wait(loop->epoll_fd, events, DTN_EVENT_LOOP_MAX_EVENTS, -1);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        perror("DTN Event Loop: epoll_wait failed");
+        return -1;
+    }
+
+    for (int i = 0; i < n && loop->running; i++) {
+        DTN_Event_Handler* handler = (DTN_Event_Handler*)events[i].data.ptr;
+        handler->callback(handler->fd, events[i].events, handler->arg);
+    }
+    return n;
+}
+
+void dtn_event_loop_stop(DTN_Event_Loop* loop) {
+    loop->running = false;
+}
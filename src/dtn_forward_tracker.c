@@ -0,0 +1,181 @@
+// dtn_forward_tracker.c: Per-destination forwarding attempts, indexed by a hash table and woken by a timer wheel
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_forward_tracker.h"
+#include "dtn_packet.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FORWARD_TRACKER_INITIAL_SIZE 16
+
+static void dtn_forward_tracker_unlink_due(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt) {
+    if (!attempt->due) return;
+    if (attempt->prev_due) {
+        attempt->prev_due->next_due = attempt->next_due;
+    } else {
+        tracker->due_head = attempt->next_due;
+    }
+    if (attempt->next_due) {
+        attempt->next_due->prev_due = attempt->prev_due;
+    }
+    attempt->next_due = attempt->prev_due = NULL;
+    attempt->due = false;
+}
+
+static void dtn_forward_tracker_expire(DTN_Timer_Wheel *wheel, DTN_Timer *timer, void *arg) {
+    LWIP_UNUSED_ARG(wheel);
+    DTN_Forward_Tracker *tracker = (DTN_Forward_Tracker *)arg;
+    DTN_Forward_Attempt *attempt = (DTN_Forward_Attempt *)((u8_t *)timer - offsetof(DTN_Forward_Attempt, retry_timer));
+    if (attempt->due) return;
+    attempt->prev_due = NULL;
+    attempt->next_due = tracker->due_head;
+    if (tracker->due_head) {
+        tracker->due_head->prev_due = attempt;
+    }
+    tracker->due_head = attempt;
+    attempt->due = true;
+}
+
+void dtn_forward_tracker_init(DTN_Forward_Tracker *tracker) {
+    tracker->table = NULL;
+    tracker->table_size = 0;
+    tracker->count = 0;
+    tracker->due_head = NULL;
+    dtn_timer_wheel_init(&tracker->wheel, dtn_forward_tracker_expire, tracker);
+}
+
+void dtn_forward_tracker_destroy(DTN_Forward_Tracker *tracker) {
+    dtn_timer_wheel_stop(&tracker->wheel);
+    for (u32_t i = 0; i < tracker->table_size; i++) {
+        free(tracker->table[i]);
+    }
+    free(tracker->table);
+    tracker->table = NULL;
+    tracker->table_size = 0;
+    tracker->count = 0;
+    tracker->due_head = NULL;
+}
+
+static u32_t dtn_forward_tracker_slot(const DTN_Forward_Tracker *tracker, const ip6_addr_t *dest) {
+    u32_t mask = tracker->table_size - 1;
+    u32_t pos = dtn_addr_hash(dest->addr) & mask;
+    while (tracker->table[pos] != NULL && !ip6_addr_cmp_zoneless(&tracker->table[pos]->destination, dest)) {
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+DTN_Forward_Attempt *dtn_forward_tracker_find(const DTN_Forward_Tracker *tracker, const ip6_addr_t *dest) {
+    if (tracker->table_size == 0) return NULL;
+    return tracker->table[dtn_forward_tracker_slot(tracker, dest)];
+}
+
+static int dtn_forward_tracker_grow(DTN_Forward_Tracker *tracker) {
+    u32_t new_size = tracker->table_size ? tracker->table_size * 2 : FORWARD_TRACKER_INITIAL_SIZE;
+    DTN_Forward_Attempt **table = calloc(new_size, sizeof(DTN_Forward_Attempt *));
+    if (!table) return 0;
+
+    for (u32_t i = 0; i < tracker->table_size; i++) {
+        DTN_Forward_Attempt *attempt = tracker->table[i];
+        if (!attempt) continue;
+        u32_t pos = dtn_addr_hash(attempt->destination.addr) & (new_size - 1);
+        while (table[pos] != NULL) {
+            pos = (pos + 1) & (new_size - 1);
+        }
+        table[pos] = attempt;
+    }
+    free(tracker->table);
+    tracker->table = table;
+    tracker->table_size = new_size;
+    return 1;
+}
+
+DTN_Forward_Attempt *dtn_forward_tracker_get(DTN_Forward_Tracker *tracker, const ip6_addr_t *dest) {
+    DTN_Forward_Attempt *attempt = dtn_forward_tracker_find(tracker, dest);
+    if (attempt) return attempt;
+
+    if ((tracker->count + 1) * 2 > tracker->table_size && !dtn_forward_tracker_grow(tracker)) {
+        perror("DTN Forward Tracker: Failed to grow the table");
+        return NULL;
+    }
+    attempt = (DTN_Forward_Attempt *)calloc(1, sizeof(DTN_Forward_Attempt));
+    if (!attempt) {
+        perror("DTN Forward Tracker: Failed to allocate an attempt record");
+        return NULL;
+    }
+    ip6_addr_copy(attempt->destination, *dest);
+    ip6_addr_clear_zone(&attempt->destination);
+    dtn_timer_init(&attempt->retry_timer);
+    tracker->table[dtn_forward_tracker_slot(tracker, dest)] = attempt;
+    tracker->count++;
+    return attempt;
+}
+
+void dtn_forward_tracker_remove(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt) {
+    if (!attempt || tracker->table_size == 0) return;
+    u32_t mask = tracker->table_size - 1;
+    u32_t pos = dtn_forward_tracker_slot(tracker, &attempt->destination);
+    if (tracker->table[pos] != attempt) return;
+
+    dtn_timer_wheel_cancel(&tracker->wheel, &attempt->retry_timer);
+    dtn_forward_tracker_unlink_due(tracker, attempt);
+    free(attempt);
+    tracker->table[pos] = NULL;
+    tracker->count--;
+
+    // Move later entries of the probe run back so lookups never stop at the hole
+    u32_t hole = pos;
+    for (u32_t next = (pos + 1) & mask; tracker->table[next] != NULL; next = (next + 1) & mask) {
+        u32_t home = dtn_addr_hash(tracker->table[next]->destination.addr) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            tracker->table[hole] = tracker->table[next];
+            tracker->table[next] = NULL;
+            hole = next;
+        }
+    }
+}
+
+void dtn_forward_tracker_count(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt, u32_t timeout_ms) {
+    attempt->retry_count++;
+    dtn_forward_tracker_unlink_due(tracker, attempt);
+
+    // The cap never cuts the wait below the timeout itself, a long light time needs it all
+    u32_t max_delay_ms = timeout_ms > FORWARDING_RETRY_MAX_DELAY_MS ? timeout_ms : FORWARDING_RETRY_MAX_DELAY_MS;
+    u32_t delay_ms = timeout_ms;
+    for (u32_t i = 1; i < attempt->retry_count && delay_ms < max_delay_ms; i++) {
+        delay_ms = delay_ms > max_delay_ms / 2 ? max_delay_ms : delay_ms * 2;
+    }
+    if (delay_ms > max_delay_ms) {
+        delay_ms = max_delay_ms;
+    }
+    dtn_timer_wheel_schedule(&tracker->wheel, &attempt->retry_timer, delay_ms);
+}
+
+void dtn_forward_tracker_refund(DTN_Forward_Tracker *tracker, DTN_Forward_Attempt *attempt) {
+    if (attempt->retry_count > 0) {
+        attempt->retry_count--;
+    }
+    dtn_timer_wheel_cancel(&tracker->wheel, &attempt->retry_timer);
+}
+
+DTN_Forward_Attempt *dtn_forward_tracker_pop_due(DTN_Forward_Tracker *tracker) {
+    DTN_Forward_Attempt *attempt = tracker->due_head;
+    if (attempt) {
+        dtn_forward_tracker_unlink_due(tracker, attempt);
+    }
+    return attempt;
+}
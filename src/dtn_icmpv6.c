@@ -23,6 +23,7 @@
 #include "lwip/inet_chksum.h"
 #include "lwip/netif.h"
 #include "lwip/pbuf.h"
+#include "lwip/timeouts.h"
 #include <string.h>
 #include <stdio.h>
 #include "raw_socket.h"
@@ -31,8 +32,6 @@
 #include "dtn_controller.h" 
 #include "dtn_custody.h"
 
-extern void dtn_storage_delete_packet_by_ip_header(Storage_Function* storage, struct ip6_hdr* orig_ip6hdr);
-
 // Structure for DTN custom ICMPv6 message payload
 #pragma pack(1)
 typedef struct {
@@ -41,241 +40,390 @@ typedef struct {
     u16_t payload_length;  
     u8_t  reason_code;    
 } dtn_icmpv6_payload_t;
+
+// Payload of DTN-PCK-RECEIVED-AGGREGATE, followed by count fingerprints of 8 bytes each, big-endian
+typedef struct {
+    u32_t timestamp;
+    u16_t count;
+    u16_t reserved;
+} dtn_icmpv6_aggregate_t;
 #pragma pack()
 
+// Fingerprints waiting to be acknowledged to one custodian, count 0 for a free batch
+typedef struct {
+    ip6_addr_t custodian;
+    struct netif *netif;
+    u32_t opened_ms;
+    u16_t count;
+    uint64_t fingerprints[DTN_ACK_MAX_FINGERPRINTS];
+} DTN_Ack_Batch;
+
+static DTN_Ack_Batch ack_batches[DTN_ACK_BATCH_CUSTODIANS];
+static bool ack_timer_armed = false;
+
+
+// Allocates a message with icmp_len bytes of ICMPv6 from netif to dest in one pool pbuf, with
+// its IPv6 header filled in. The ICMPv6 part follows the header in the same buffer.
+static struct pbuf *dtn_icmpv6_alloc_message(struct netif *netif, const ip6_addr_t *dest, u16_t icmp_len)
+{
+    struct pbuf *q = pbuf_alloc(PBUF_RAW, IP6_HLEN + icmp_len, PBUF_POOL);
+    if (q == NULL) {
+        printf("DTN ICMPv6: Failed to allocate pbuf for message\n");
+        return NULL;
+    }
+    if (q->len != q->tot_len) {
+        printf("DTN ICMPv6: Message of %u bytes does not fit one pbuf\n", q->tot_len);
+        pbuf_free(q);
+        return NULL;
+    }
+
+    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)q->payload;
+    IP6H_VTCFL_SET(ip6hdr, 6, 0, 0);
+    IP6H_PLEN_SET(ip6hdr, icmp_len);
+    IP6H_NEXTH_SET(ip6hdr, IP6_NEXTH_ICMP6);
+    IP6H_HOPLIM_SET(ip6hdr, 255);
+    ip6_addr_copy_to_packed(ip6hdr->src, *ip_2_ip6(&netif->ip6_addr[1]));
+    ip6_addr_copy_to_packed(ip6hdr->dest, *dest);
+    return q;
+}
+
+// Computes the ICMPv6 checksum of a message from dtn_icmpv6_alloc_message in place and sends it.
+// The caller still frees q.
+static err_t dtn_icmpv6_send_built(struct pbuf *q, u8_t type, u8_t code)
+{
+    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)q->payload;
+    struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)(ip6hdr + 1);
+    ip6_addr_t src_addr, dest_addr;
+    ip6_addr_copy_from_packed(src_addr, ip6hdr->src);
+    ip6_addr_copy_from_packed(dest_addr, ip6hdr->dest);
+    ip6_addr_clear_zone(&src_addr);
+    ip6_addr_clear_zone(&dest_addr);
+
+    // The checksum covers the ICMPv6 message, which starts behind the IPv6 header
+    icmp6hdr->chksum = 0;
+    pbuf_remove_header(q, IP6_HLEN);
+    icmp6hdr->chksum = ip6_chksum_pseudo(q, IP6_NEXTH_ICMP6, q->tot_len, &src_addr, &dest_addr);
+    pbuf_add_header(q, IP6_HLEN);
+
+    err_t err = raw_socket_send_ipv6(q, &dest_addr) == 0 ? ERR_OK : ERR_IF;
+
+    char dst_str[IP6ADDR_STRLEN_MAX];
+    ip6addr_ntoa_r(&dest_addr, dst_str, sizeof(dst_str));
+    if (err != ERR_OK) {
+        printf("DTN ICMPv6: Failed to send message to %s via raw socket, err=%d\n", dst_str, err);
+    } else {
+        printf("DTN ICMPv6: Sent type %d code %d to %s via raw socket\n", type, code, dst_str);
+    }
+    return err;
+}
 
-static err_t dtn_icmpv6_send_message(struct netif *netif, struct pbuf *p, u8_t type, u8_t code, u8_t reason)
+// Reports on p, which is only read: the quote takes its IPv6 header and the 8 bytes behind it
+static err_t dtn_icmpv6_send_message(struct netif *netif, const struct pbuf *p, u8_t type, u8_t code, u8_t reason)
 {
-    struct ip6_hdr *orig_ip6hdr = (struct ip6_hdr *)p->payload;
-    struct pbuf *q;
-    struct icmp6_hdr *icmp6hdr;
-    dtn_icmpv6_payload_t *dtn_payload;
-    u16_t datalen;
+    struct ip6_hdr orig_ip6hdr;
     
-    datalen = sizeof(dtn_icmpv6_payload_t) + IP6_HLEN + 8;
+    if (pbuf_copy_partial(p, &orig_ip6hdr, IP6_HLEN, 0) != IP6_HLEN) {
+        printf("DTN ICMPv6: Packet too short to report on\n");
+        return ERR_ARG;
+    }
+
+    ip6_addr_t dest_addr;
+    if (!dtn_extract_custodian_option(p, &dest_addr)) {
+        ip6_addr_copy_from_packed(dest_addr, orig_ip6hdr.src);
+    }
 
-    q = pbuf_alloc(PBUF_IP, sizeof(struct icmp6_hdr) + datalen, PBUF_RAM);
+    u16_t icmp_len = sizeof(struct icmp6_hdr) + sizeof(dtn_icmpv6_payload_t) + IP6_HLEN + 8;
+    struct pbuf *q = dtn_icmpv6_alloc_message(netif, &dest_addr, icmp_len);
     if (q == NULL) {
-        printf("DTN ICMPv6: Failed to allocate pbuf for message\n");
         return ERR_MEM;
     }
 
     // Set up ICMP header
-    icmp6hdr = (struct icmp6_hdr *)q->payload;
+    struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)((u8_t *)q->payload + IP6_HLEN);
     icmp6hdr->type = type;
     icmp6hdr->code = code;
     icmp6hdr->data = 0;
 
     // Set up DTN payload
-    dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
+    dtn_icmpv6_payload_t *dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
     dtn_payload->timestamp = sys_now();
     dtn_payload->fragment_offset = 0;
-    dtn_payload->payload_length = lwip_ntohs(IP6H_PLEN(orig_ip6hdr));
+    dtn_payload->payload_length = lwip_ntohs(IP6H_PLEN(&orig_ip6hdr));
     dtn_payload->reason_code = reason;
 
     // Copy IPv6 header + first 8 bytes of payload from original packet
+    memset(dtn_payload + 1, 0, IP6_HLEN + 8);
     pbuf_copy_partial(p, (u8_t *)(dtn_payload + 1), IP6_HLEN + 8, 0);
 
-    ip6_addr_t src_addr, dest_addr;
-    
-    ip6_addr_copy(src_addr, netif->ip6_addr[1]);
-    
-    if (!dtn_extract_custodian_option(p, &dest_addr)) {
-        IP6_ADDR(&dest_addr, 
-                 orig_ip6hdr->src.addr[0],
-                 orig_ip6hdr->src.addr[1],
-                 orig_ip6hdr->src.addr[2],
-                 orig_ip6hdr->src.addr[3]);
-    }
-    
-    // Calculate checksum
-    icmp6hdr->chksum = 0;
-    icmp6hdr->chksum = ip6_chksum_pseudo(q, IP6_NEXTH_ICMP6, q->tot_len, 
-                                         &src_addr, &dest_addr);
-
-    // New Header
-    struct pbuf *complete_pkt = pbuf_alloc(PBUF_IP, IP6_HLEN + q->tot_len, PBUF_RAM);
-    if (complete_pkt == NULL) {
-        printf("DTN ICMPv6: Failed to allocate pbuf for complete packet\n");
-        pbuf_free(q);
-        return ERR_MEM;
-    }
-    
-    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)complete_pkt->payload;
-    IP6H_VTCFL_SET(ip6hdr, 6, 0, 0);
-    IP6H_PLEN_SET(ip6hdr, q->tot_len);
-    IP6H_NEXTH_SET(ip6hdr, IP6_NEXTH_ICMP6);
-    IP6H_HOPLIM_SET(ip6hdr, 255);
-    
-    // Set source and destination
-    ip6_addr_copy_to_packed(ip6hdr->src, src_addr);
-    ip6_addr_copy_to_packed(ip6hdr->dest, dest_addr);
-    
-    // Copy ICMPv6 message after IPv6 header
-    if (pbuf_copy_partial(q, (u8_t *)complete_pkt->payload + IP6_HLEN, q->tot_len, 0) != q->tot_len) {
-        printf("DTN ICMPv6: Failed to copy ICMPv6 message to complete packet\n");
-        pbuf_free(q);
-        pbuf_free(complete_pkt);
-        return ERR_BUF;
-    }
-    
+    err_t err = dtn_icmpv6_send_built(q, type, code);
     pbuf_free(q);
-    
-    err_t err = raw_socket_send_ipv6(complete_pkt, &dest_addr) == 0 ? ERR_OK : ERR_IF;
-    
-    char dst_str[IP6ADDR_STRLEN_MAX];
-    ip6addr_ntoa_r(&dest_addr, dst_str, sizeof(dst_str));
-    
-    if (err != ERR_OK) {
-        printf("DTN ICMPv6: Failed to send message to %s via raw socket, err=%d\n", dst_str, err);
-    } else {
-        printf("DTN ICMPv6: Sent type %d code %d to %s via raw socket\n", type, code, dst_str);
-    }
-    
-    pbuf_free(complete_pkt);
     return err;
 }
 
 // Send DTN-PCK-RECEIVED message
 void 
-dtn_icmpv6_send_pck_received(struct netif *netif, struct pbuf *p, u8_t code)
+dtn_icmpv6_send_pck_received(struct netif *netif, const struct pbuf *p, u8_t code)
 {
     dtn_icmpv6_send_message(netif, p, ICMP6_TYPE_DTN_PCK_RECEIVED, code, 0);
 }
 
 // Send DTN-PCK-FORWARDED message
 void 
-dtn_icmpv6_send_pck_forwarded(struct netif *netif, struct pbuf *p, u8_t code)
+dtn_icmpv6_send_pck_forwarded(struct netif *netif, const struct pbuf *p, u8_t code)
 {
     dtn_icmpv6_send_message(netif, p, ICMP6_TYPE_DTN_PCK_FORWARDED, code, 0);
 }
 
 // Send DTN-PCK-DELIVERED message
 void 
-dtn_icmpv6_send_pck_delivered(struct netif *netif, struct pbuf *p, u8_t code)
+dtn_icmpv6_send_pck_delivered(struct netif *netif, const struct pbuf *p, u8_t code)
 {
     dtn_icmpv6_send_message(netif, p, ICMP6_TYPE_DTN_PCK_DELIVERED, code, 0);
 }
 
 // Send DTN-PCK-DELETED message with additional reason
 void 
-dtn_icmpv6_send_pck_deleted(struct netif *netif, struct pbuf *p, u8_t code, u8_t reason)
+dtn_icmpv6_send_pck_deleted(struct netif *netif, const struct pbuf *p, u8_t code, u8_t reason)
 {
     dtn_icmpv6_send_message(netif, p, ICMP6_TYPE_DTN_PCK_DELETED, code, reason);
 }
 
-// Extract original IPv6 header from an ICMPv6 message
-static struct ip6_hdr* extract_original_header(struct icmp6_hdr *icmp6hdr) {
-    // Skip ICMP header and DTN payload to get to the original IPv6 header
-    dtn_icmpv6_payload_t *dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
-    return (struct ip6_hdr *)((u8_t *)dtn_payload + sizeof(dtn_icmpv6_payload_t));
+// Sends a batch as one DTN-PCK-RECEIVED-AGGREGATE and frees the batch
+static void dtn_icmpv6_send_ack_batch(DTN_Ack_Batch *batch)
+{
+    u16_t icmp_len = sizeof(struct icmp6_hdr) + sizeof(dtn_icmpv6_aggregate_t) + batch->count * 8;
+    struct pbuf *q = dtn_icmpv6_alloc_message(batch->netif, &batch->custodian, icmp_len);
+    if (q == NULL) {
+        printf("DTN ICMPv6: Dropping aggregate acknowledgement of %u packets\n", batch->count);
+        batch->count = 0;
+        return;
+    }
+
+    struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)((u8_t *)q->payload + IP6_HLEN);
+    icmp6hdr->type = ICMP6_TYPE_DTN_PCK_RECEIVED_AGGREGATE;
+    icmp6hdr->code = ICMP6_CODE_DTN_NO_INFO;
+    icmp6hdr->data = 0;
+
+    dtn_icmpv6_aggregate_t *aggregate = (dtn_icmpv6_aggregate_t *)(icmp6hdr + 1);
+    aggregate->timestamp = sys_now();
+    aggregate->count = lwip_htons(batch->count);
+    aggregate->reserved = 0;
+
+    u8_t *out = (u8_t *)(aggregate + 1);
+    for (u16_t i = 0; i < batch->count; i++) {
+        for (int b = 0; b < 8; b++) {
+            *out++ = (u8_t)(batch->fingerprints[i] >> (56 - 8 * b));
+        }
+    }
+
+    if (dtn_icmpv6_send_built(q, ICMP6_TYPE_DTN_PCK_RECEIVED_AGGREGATE, ICMP6_CODE_DTN_NO_INFO) == ERR_OK) {
+        char dst_str[IP6ADDR_STRLEN_MAX];
+        ip6addr_ntoa_r(&batch->custodian, dst_str, sizeof(dst_str));
+        printf("DTN ICMPv6: Acknowledged %u packets to %s\n", batch->count, dst_str);
+    }
+    pbuf_free(q);
+    batch->count = 0;
+}
+
+// Sends the batches that have waited DTN_ACK_BATCH_MS and waits for the next one to
+static void dtn_icmpv6_ack_timeout(void *arg)
+{
+    LWIP_UNUSED_ARG(arg);
+    ack_timer_armed = false;
+
+    u32_t now = sys_now();
+    u32_t next_delay = 0;
+    for (int i = 0; i < DTN_ACK_BATCH_CUSTODIANS; i++) {
+        DTN_Ack_Batch *batch = &ack_batches[i];
+        if (batch->count == 0) continue;
+        u32_t waited = now - batch->opened_ms;
+        if (waited >= DTN_ACK_BATCH_MS) {
+            dtn_icmpv6_send_ack_batch(batch);
+        } else if (next_delay == 0 || DTN_ACK_BATCH_MS - waited < next_delay) {
+            next_delay = DTN_ACK_BATCH_MS - waited;
+        }
+    }
+    if (next_delay > 0) {
+        sys_timeout(next_delay, dtn_icmpv6_ack_timeout, NULL);
+        ack_timer_armed = true;
+    }
+}
+
+void dtn_icmpv6_ack_custody(struct netif *netif, const ip6_addr_t *custodian, uint64_t fingerprint)
+{
+    if (!netif || !custodian || fingerprint == 0) {
+        return;
+    }
+
+    DTN_Ack_Batch *batch = NULL;
+    DTN_Ack_Batch *oldest = NULL;
+    for (int i = 0; i < DTN_ACK_BATCH_CUSTODIANS; i++) {
+        DTN_Ack_Batch *candidate = &ack_batches[i];
+        if (candidate->count == 0) {
+            if (!batch) batch = candidate;
+            continue;
+        }
+        if (candidate->netif == netif && ip6_addr_cmp_zoneless(&candidate->custodian, custodian)) {
+            batch = candidate;
+            break;
+        }
+        if (!oldest || (s32_t)(candidate->opened_ms - oldest->opened_ms) < 0) {
+            oldest = candidate;
+        }
+    }
+    if (!batch) {
+        // Every batch is taken by another custodian, the oldest one goes early
+        dtn_icmpv6_send_ack_batch(oldest);
+        batch = oldest;
+    }
+
+    if (batch->count == 0) {
+        ip6_addr_copy(batch->custodian, *custodian);
+        ip6_addr_clear_zone(&batch->custodian);
+        batch->netif = netif;
+        batch->opened_ms = sys_now();
+        if (!ack_timer_armed) {
+            sys_timeout(DTN_ACK_BATCH_MS, dtn_icmpv6_ack_timeout, NULL);
+            ack_timer_armed = true;
+        }
+    }
+    batch->fingerprints[batch->count++] = fingerprint;
+    if (batch->count == DTN_ACK_MAX_FINGERPRINTS) {
+        dtn_icmpv6_send_ack_batch(batch);
+    }
+}
+
+void dtn_icmpv6_flush_custody_acks(void)
+{
+    if (ack_timer_armed) {
+        sys_untimeout(dtn_icmpv6_ack_timeout, NULL);
+        ack_timer_armed = false;
+    }
+    for (int i = 0; i < DTN_ACK_BATCH_CUSTODIANS; i++) {
+        if (ack_batches[i].count > 0) {
+            dtn_icmpv6_send_ack_batch(&ack_batches[i]);
+        }
+    }
 }
 
-// Convert a packed IPv6 address to an ip6_addr_t structure
-static void packed_ip6_addr_to_ip6_addr_t(const u32_t packed_addr[4], ip6_addr_t *ip6_addr) {
-    IP6_ADDR(ip6_addr, packed_addr[0], packed_addr[1], packed_addr[2], packed_addr[3]);
+// Deletes every stored packet an aggregate acknowledgement names
+static void dtn_icmpv6_process_aggregate(Storage_Function *storage, struct pbuf *p, const DTN_Packet_Info *info,
+                                         const u8_t *msg, u16_t msg_len, const char *src_addr_str)
+{
+    if (msg_len < sizeof(struct icmp6_hdr) + sizeof(dtn_icmpv6_aggregate_t)) {
+        printf("DTN ICMPv6: PCK-RECEIVED-AGGREGATE from %s is too short\n", src_addr_str);
+        return;
+    }
+    dtn_icmpv6_aggregate_t aggregate;
+    memcpy(&aggregate, msg + sizeof(struct icmp6_hdr), sizeof(aggregate));
+
+    u16_t offset = info->l4_offset + sizeof(struct icmp6_hdr) + sizeof(dtn_icmpv6_aggregate_t);
+    u16_t count = lwip_ntohs(aggregate.count);
+    u16_t present = (p->tot_len - offset) / 8;
+    if (count > present) count = present;
+    if (count > DTN_ACK_MAX_FINGERPRINTS) count = DTN_ACK_MAX_FINGERPRINTS;
+
+    u8_t raw[DTN_ACK_MAX_FINGERPRINTS * 8];
+    uint64_t fingerprints[DTN_ACK_MAX_FINGERPRINTS];
+    pbuf_copy_partial(p, raw, count * 8, offset);
+    for (u16_t i = 0; i < count; i++) {
+        uint64_t fingerprint = 0;
+        for (int b = 0; b < 8; b++) {
+            fingerprint = (fingerprint << 8) | raw[i * 8 + b];
+        }
+        fingerprints[i] = fingerprint;
+    }
+
+    size_t deleted = dtn_storage_delete_packets_by_fingerprint(storage, fingerprints, count, &info->src);
+    printf("DTN ICMPv6: Received PCK-RECEIVED-AGGREGATE from %s, timestamp %u, %u packets, %zu deleted\n",
+           src_addr_str, aggregate.timestamp, count, deleted);
 }
 
-// Process incoming DTN ICMPv6 message
-u8_t dtn_icmpv6_process(struct pbuf *p, struct netif *inp_netif)
+// Process incoming DTN ICMPv6 message. p is the whole IPv6 packet, info its parsed headers.
+u8_t dtn_icmpv6_process(struct pbuf *p, const DTN_Packet_Info *info, struct netif *inp_netif)
 {
     extern DTN_Module* global_dtn_module;
+    LWIP_UNUSED_ARG(inp_netif);
     
-    if (!p || !p->payload || !global_dtn_module || !global_dtn_module->storage || !global_dtn_module->controller) {
+    if (!p || !info || !global_dtn_module || !global_dtn_module->storage || !global_dtn_module->controller) {
         return 0;
     }
     
-    struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)p->payload;
-    dtn_icmpv6_payload_t *dtn_payload;
-    
+    // ICMPv6 header, DTN payload and the quoted packet, read in place unless the pbuf splits them
+    u8_t msg_buf[sizeof(struct icmp6_hdr) + sizeof(dtn_icmpv6_payload_t) + IP6_HLEN + 8];
+    if (info->l4_offset + sizeof(struct icmp6_hdr) > p->tot_len) {
+        return 0;
+    }
+    u16_t msg_len = p->tot_len - info->l4_offset;
+    if (msg_len > sizeof(msg_buf)) msg_len = sizeof(msg_buf);
+    const u8_t *msg = (const u8_t *)pbuf_get_contiguous(p, msg_buf, sizeof(msg_buf), msg_len, info->l4_offset);
+    if (msg == NULL) {
+        return 0;
+    }
+
+    const struct icmp6_hdr *icmp6hdr = (const struct icmp6_hdr *)msg;
+    dtn_icmpv6_payload_t dtn_payload;
+    memset(&dtn_payload, 0, sizeof(dtn_payload));
+    if (msg_len >= sizeof(struct icmp6_hdr) + sizeof(dtn_payload)) {
+        memcpy(&dtn_payload, msg + sizeof(struct icmp6_hdr), sizeof(dtn_payload));
+    }
+    const u8_t *quote = msg + sizeof(struct icmp6_hdr) + sizeof(dtn_payload);
+    u16_t quote_len = msg_len > sizeof(struct icmp6_hdr) + sizeof(dtn_payload) ?
+                      msg_len - sizeof(struct icmp6_hdr) - sizeof(dtn_payload) : 0;
+
     // Check if this is a DTN ICMPv6 message
+    if (icmp6hdr->type < ICMP6_TYPE_DTN_PCK_RECEIVED || icmp6hdr->type > ICMP6_TYPE_DTN_PCK_RECEIVED_AGGREGATE) {
+        return 0;
+    }
+
+    char src_addr_str[IP6ADDR_STRLEN_MAX] = {0};
+    ip6addr_ntoa_r(&info->src, src_addr_str, sizeof(src_addr_str));
+    
     switch (icmp6hdr->type) {
         case ICMP6_TYPE_DTN_PCK_RECEIVED: {
-            dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
-            
-            char src_addr_str[IP6ADDR_STRLEN_MAX] = {0};
-            ip6addr_ntoa_r(ip6_current_src_addr(), src_addr_str, sizeof(src_addr_str));
-            
             printf("DTN ICMPv6: Received PCK-RECEIVED type %d code %d from %s, timestamp %u, reason %d\n", 
                    icmp6hdr->type, icmp6hdr->code, src_addr_str, 
-                   dtn_payload->timestamp, dtn_payload->reason_code);
-            
-            // Extract original IPv6 header
-            struct ip6_hdr *orig_ip6hdr = extract_original_header(icmp6hdr);
+                   dtn_payload.timestamp, dtn_payload.reason_code);
             
-            // Delete the stored packet
-            struct pbuf *icmp_with_ipv6 = pbuf_alloc(PBUF_RAW, IP6_HLEN + p->tot_len, PBUF_RAM);
-            if (icmp_with_ipv6 != NULL) {
-                // Copy the outer IPv6 header
-                struct ip6_hdr *outer_ipv6 = (struct ip6_hdr *)icmp_with_ipv6->payload;
-                // Set basic IPv6 header fields
-                IP6H_VTCFL_SET(outer_ipv6, 6, 0, 0);
-                IP6H_PLEN_SET(outer_ipv6, p->tot_len);
-                IP6H_NEXTH_SET(outer_ipv6, IP6_NEXTH_ICMP6);
-                IP6H_HOPLIM_SET(outer_ipv6, 255);
-                // Copy source and destination from current IP context
-                memcpy(&outer_ipv6->src, ip6_current_src_addr(), sizeof(ip6_addr_p_t));
-                memcpy(&outer_ipv6->dest, ip6_current_dest_addr(), sizeof(ip6_addr_p_t));
-                
-                // Copy the ICMP payload
-                if (pbuf_copy_partial(p, (u8_t*)icmp_with_ipv6->payload + IP6_HLEN, p->tot_len, 0) == p->tot_len) {
-                    dtn_storage_delete_packet_by_icmp_data(global_dtn_module->storage, icmp_with_ipv6);
-                } else {
-                    dtn_storage_delete_packet_by_ip_header(global_dtn_module->storage, orig_ip6hdr);
-                }
-                pbuf_free(icmp_with_ipv6);
-            } else {
-                dtn_storage_delete_packet_by_ip_header(global_dtn_module->storage, orig_ip6hdr);
+            // Delete the stored packet the quote names
+            DTN_Packet_Info orig;
+            if (!dtn_packet_parse_buffer(quote, quote_len, &orig)) {
+                printf("DTN ICMPv6: PCK-RECEIVED from %s quotes no IPv6 header\n", src_addr_str);
+                return 1;
             }
+            dtn_storage_delete_packet_by_quote(global_dtn_module->storage, quote, quote_len, &orig);
             
-            // Remove tracking for this destination
-            ip6_addr_t dest_addr;
-            
-            u32_t temp_addr[4];
-            memcpy(temp_addr, orig_ip6hdr->dest.addr, sizeof(temp_addr));
-            packed_ip6_addr_to_ip6_addr_t(temp_addr, &dest_addr);
-            
-            // Remove destination from forwarding tracking list
-            dtn_controller_remove_tracking(global_dtn_module->controller, &dest_addr);
+            // The sender took custody, which times the round trip to it and ends the tracking
+            dtn_controller_custody_acked(global_dtn_module->controller, &orig.dest, &info->src);
             
             return 1;
         }
         
+        case ICMP6_TYPE_DTN_PCK_RECEIVED_AGGREGATE: {
+            dtn_icmpv6_process_aggregate(global_dtn_module->storage, p, info, msg, msg_len, src_addr_str);
+            return 1;
+        }
+        
         case ICMP6_TYPE_DTN_PCK_FORWARDED: {
-            dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
-            
-            char src_addr_str[IP6ADDR_STRLEN_MAX] = {0};
-            ip6addr_ntoa_r(ip6_current_src_addr(), src_addr_str, sizeof(src_addr_str));
-            
             printf("DTN ICMPv6: Received PCK-FORWARDED type %d code %d from %s, timestamp %u, reason %d\n", 
                    icmp6hdr->type, icmp6hdr->code, src_addr_str, 
-                   dtn_payload->timestamp, dtn_payload->reason_code);
+                   dtn_payload.timestamp, dtn_payload.reason_code);
                    
             return 1;
         }
         
         case ICMP6_TYPE_DTN_PCK_DELIVERED: {
-            dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
-            
-            char src_addr_str[IP6ADDR_STRLEN_MAX] = {0};
-            ip6addr_ntoa_r(ip6_current_src_addr(), src_addr_str, sizeof(src_addr_str));
-            
             printf("DTN ICMPv6: Received PCK-DELIVERED type %d code %d from %s, timestamp %u, reason %d\n", 
                    icmp6hdr->type, icmp6hdr->code, src_addr_str, 
-                   dtn_payload->timestamp, dtn_payload->reason_code);
+                   dtn_payload.timestamp, dtn_payload.reason_code);
             
             return 1;
         }
         
         case ICMP6_TYPE_DTN_PCK_DELETED: {
-            dtn_payload = (dtn_icmpv6_payload_t *)(icmp6hdr + 1);
-            
-            char src_addr_str[IP6ADDR_STRLEN_MAX] = {0};
-            ip6addr_ntoa_r(ip6_current_src_addr(), src_addr_str, sizeof(src_addr_str));
-            
             printf("DTN ICMPv6: Received PCK-DELETED type %d code %d from %s, timestamp %u, reason %d\n", 
                    icmp6hdr->type, icmp6hdr->code, src_addr_str, 
-                   dtn_payload->timestamp, dtn_payload->reason_code);
+                   dtn_payload.timestamp, dtn_payload.reason_code);
             
             return 1;
         }
@@ -0,0 +1,82 @@
+// dtn_local_addr.c: Set of IPv6 addresses the local lwIP stack answers to, kept in step with the netifs
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_local_addr.h"
+#include <stdio.h>
+#include <string.h>
+
+#if !LWIP_NETIF_EXT_STATUS_CALLBACK
+#error "dtn_local_addr.c needs LWIP_NETIF_EXT_STATUS_CALLBACK to follow address changes"
+#endif
+
+NETIF_DECLARE_EXT_CALLBACK(local_addr_callback)
+static DTN_Local_Addr_Set* watched_set = NULL;
+
+void dtn_local_addr_init(DTN_Local_Addr_Set* set) {
+    memset(set, 0, sizeof(*set));
+}
+
+static void dtn_local_addr_insert(DTN_Local_Addr_Set* set, const ip6_addr_t* addr) {
+    if (ip6_addr_isany(addr) || dtn_local_addr_contains(set, addr)) return;
+    if (set->count >= DTN_LOCAL_ADDR_SLOTS / 2) {
+        fprintf(stderr, "DTN Local Addresses: Set full, ignoring further addresses\n");
+        return;
+    }
+    u32_t slot = dtn_local_addr_slot(addr->addr);
+    while (set->slots[slot][0] | set->slots[slot][1] | set->slots[slot][2] | set->slots[slot][3]) {
+        slot = (slot + 1) & (DTN_LOCAL_ADDR_SLOTS - 1);
+    }
+    memcpy(set->slots[slot], addr->addr, sizeof(set->slots[slot]));
+    set->count++;
+}
+
+void dtn_local_addr_rebuild(DTN_Local_Addr_Set* set, const struct netif* except) {
+    dtn_local_addr_init(set);
+    struct netif* netif;
+    NETIF_FOREACH(netif) {
+        if (netif == except) continue;
+        for (int i = 0; i < LWIP_IPV6_NUM_ADDRESSES; i++) {
+            if (!ip6_addr_isinvalid(netif_ip6_addr_state(netif, i))) {
+                dtn_local_addr_insert(set, netif_ip6_addr(netif, i));
+            }
+        }
+    }
+}
+
+static void dtn_local_addr_changed(struct netif* netif, netif_nsc_reason_t reason, const netif_ext_callback_args_t* args) {
+    LWIP_UNUSED_ARG(args);
+    if (!watched_set) return;
+    if (reason & LWIP_NSC_NETIF_REMOVED) {
+        // The netif is still listed while the callback runs
+        dtn_local_addr_rebuild(watched_set, netif);
+    } else if (reason & (LWIP_NSC_NETIF_ADDED | LWIP_NSC_IPV6_SET | LWIP_NSC_IPV6_ADDR_STATE_CHANGED)) {
+        dtn_local_addr_rebuild(watched_set, NULL);
+    }
+}
+
+void dtn_local_addr_watch(DTN_Local_Addr_Set* set) {
+    dtn_local_addr_rebuild(set, NULL);
+    if (!watched_set) {
+        netif_add_ext_callback(&local_addr_callback, dtn_local_addr_changed);
+    }
+    watched_set = set;
+}
+
+void dtn_local_addr_unwatch(void) {
+    if (watched_set) {
+        netif_remove_ext_callback(&local_addr_callback);
+        watched_set = NULL;
+    }
+}
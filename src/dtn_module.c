@@ -17,6 +17,7 @@
 #include "dtn_controller.h"
 #include "dtn_routing.h"
 #include "dtn_storage.h"
+#include "dtn_icmpv6.h"
 #include <stdlib.h> 
 #include <stdio.h>  
 
@@ -54,5 +55,8 @@ void dtn_module_cleanup(DTN_Module* module) {
     dtn_routing_destroy(module->routing);
     dtn_storage_destroy(module->storage);
 
+    // Acknowledgements of the packets storage made durable while closing
+    dtn_icmpv6_flush_custody_acks();
+
     free(module);
 }
\ No newline at end of file
@@ -0,0 +1,266 @@
+// dtn_pacer.c: Per-neighbor token-bucket pacing of raw socket egress at the rate of the contact in use
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_pacer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+#include "raw_socket.h"
+
+static void dtn_pacer_tick(void* arg);
+
+// Bucket depth in thousandths of a byte
+static u64_t dtn_pacer_depth(const DTN_Pacer_Neighbor* neighbor) {
+    u64_t depth = (u64_t)neighbor->rate_bytes_per_s * DTN_PACER_BURST_MS;
+    if (depth < DTN_PACER_MIN_BURST_BYTES * 1000ULL) {
+        depth = DTN_PACER_MIN_BURST_BYTES * 1000ULL;
+    }
+    return depth;
+}
+
+static void dtn_pacer_refill(DTN_Pacer_Neighbor* neighbor, u32_t now) {
+    u32_t elapsed_ms = now - neighbor->last_refill_ms;
+    neighbor->last_refill_ms = now;
+    neighbor->tokens += (u64_t)elapsed_ms * neighbor->rate_bytes_per_s;
+    u64_t depth = dtn_pacer_depth(neighbor);
+    if (neighbor->tokens > depth) {
+        neighbor->tokens = depth;
+    }
+}
+
+static bool dtn_pacer_same_hop(const ip6_addr_t* a, const ip6_addr_t* b) {
+    return a->addr[0] == b->addr[0] && a->addr[1] == b->addr[1] &&
+           a->addr[2] == b->addr[2] && a->addr[3] == b->addr[3];
+}
+
+// The neighbor's bucket, claiming a free or idle one for a new next hop. NULL if all are busy.
+static DTN_Pacer_Neighbor* dtn_pacer_neighbor(DTN_Pacer* pacer, const ip6_addr_t* next_hop, u32_t now) {
+    DTN_Pacer_Neighbor* spare = NULL;
+    for (int i = 0; i < DTN_PACER_MAX_NEIGHBORS; i++) {
+        DTN_Pacer_Neighbor* neighbor = &pacer->neighbors[i];
+        if (neighbor->is_valid && dtn_pacer_same_hop(&neighbor->next_hop, next_hop)) {
+            return neighbor;
+        }
+        if (!spare && (!neighbor->is_valid || neighbor->head == NULL)) {
+            spare = neighbor;
+        }
+    }
+    if (spare) {
+        memset(spare, 0, sizeof(*spare));
+        spare->next_hop = *next_hop;
+        spare->is_valid = true;
+        spare->last_refill_ms = now;
+        spare->tokens = dtn_pacer_depth(spare);
+    }
+    return spare;
+}
+
+// Sends queued packets for as long as the bucket has tokens for them
+static void dtn_pacer_drain(DTN_Pacer_Neighbor* neighbor, u32_t now) {
+    dtn_pacer_refill(neighbor, now);
+    while (neighbor->head != NULL) {
+        Paced_Packet* packet = neighbor->head;
+        u64_t cost = (u64_t)packet->len * 1000;
+        if (neighbor->rate_bytes_per_s > 0) {
+            if (neighbor->tokens < cost) break;
+            neighbor->tokens -= cost;
+        }
+
+        neighbor->head = packet->next;
+        if (neighbor->head == NULL) neighbor->tail = NULL;
+        neighbor->queue_packets--;
+        neighbor->queue_bytes -= packet->len;
+
+        // The raw socket frees the packet once it is sent, if it can't queue it the packet is still ours
+        u32_t delay_ms = now - packet->queued_ms;
+        if (raw_socket_send_ipv6_buffer(packet->data, packet->len, &packet->dest, packet) == 0) {
+            neighbor->sent_packets++;
+            neighbor->paced_packets++;
+            neighbor->delay_total_ms += delay_ms;
+            if (delay_ms > neighbor->delay_max_ms) neighbor->delay_max_ms = delay_ms;
+        } else {
+            fprintf(stderr, "DTN Pacer: Error sending paced packet via raw socket\n");
+            free(packet);
+        }
+    }
+}
+
+// Time until the packet at the head of the queue can go, 0 if the queue is empty
+static u32_t dtn_pacer_wait_ms(const DTN_Pacer_Neighbor* neighbor) {
+    if (neighbor->head == NULL) return 0;
+    if (neighbor->rate_bytes_per_s == 0) return 1;
+    u64_t cost = (u64_t)neighbor->head->len * 1000;
+    if (neighbor->tokens >= cost) return 1;
+    u64_t missing = cost - neighbor->tokens;
+    return (u32_t)((missing + neighbor->rate_bytes_per_s - 1) / neighbor->rate_bytes_per_s);
+}
+
+// Keeps one lwIP timeout armed for the neighbor that can send next
+static void dtn_pacer_arm(DTN_Pacer* pacer, u32_t now) {
+    u32_t wait_ms = 0;
+    for (int i = 0; i < DTN_PACER_MAX_NEIGHBORS; i++) {
+        if (!pacer->neighbors[i].is_valid) continue;
+        u32_t neighbor_wait = dtn_pacer_wait_ms(&pacer->neighbors[i]);
+        if (neighbor_wait > 0 && (wait_ms == 0 || neighbor_wait < wait_ms)) {
+            wait_ms = neighbor_wait;
+        }
+    }
+
+    if (pacer->timer_armed) {
+        if (wait_ms > 0 && pacer->timer_due_ms == now + wait_ms) return;
+        sys_untimeout(dtn_pacer_tick, pacer);
+        pacer->timer_armed = false;
+    }
+    if (wait_ms > 0) {
+        pacer->timer_armed = true;
+        pacer->timer_due_ms = now + wait_ms;
+        sys_timeout(wait_ms, dtn_pacer_tick, pacer);
+    }
+}
+
+static void dtn_pacer_maybe_report(DTN_Pacer* pacer, u32_t now) {
+    if (now - pacer->last_report_ms >= DTN_PACER_REPORT_INTERVAL_MS) {
+        dtn_pacer_report(pacer);
+    }
+}
+
+static void dtn_pacer_tick(void* arg) {
+    DTN_Pacer* pacer = (DTN_Pacer*)arg;
+    u32_t now = sys_now();
+    pacer->timer_armed = false;
+    for (int i = 0; i < DTN_PACER_MAX_NEIGHBORS; i++) {
+        if (pacer->neighbors[i].is_valid) {
+            dtn_pacer_drain(&pacer->neighbors[i], now);
+        }
+    }
+    dtn_pacer_arm(pacer, now);
+    dtn_pacer_maybe_report(pacer, now);
+}
+
+void dtn_pacer_init(DTN_Pacer* pacer) {
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->last_report_ms = sys_now();
+}
+
+// Drops whatever is still queued, the senders keep their own copies (stored packets are retried)
+void dtn_pacer_flush(DTN_Pacer* pacer) {
+    if (pacer->timer_armed) {
+        sys_untimeout(dtn_pacer_tick, pacer);
+        pacer->timer_armed = false;
+    }
+    for (int i = 0; i < DTN_PACER_MAX_NEIGHBORS; i++) {
+        DTN_Pacer_Neighbor* neighbor = &pacer->neighbors[i];
+        while (neighbor->head != NULL) {
+            Paced_Packet* packet = neighbor->head;
+            neighbor->head = packet->next;
+            free(packet);
+        }
+        neighbor->tail = NULL;
+        neighbor->queue_packets = 0;
+        neighbor->queue_bytes = 0;
+    }
+}
+
+// Sends the packet to the next hop now if the neighbor's bucket allows it, otherwise queues a copy
+// that goes out once it does. The caller keeps ownership of p.
+// Returns 0 if the packet was sent or queued, -1 if it was dropped or couldn't be sent.
+int dtn_pacer_send(DTN_Pacer* pacer, struct pbuf* p, const ip6_addr_t* next_hop, u32_t rate_bytes_per_s) {
+    if (!pacer || !p || !next_hop) return -1;
+
+    u32_t now = sys_now();
+    DTN_Pacer_Neighbor* neighbor = dtn_pacer_neighbor(pacer, next_hop, now);
+    if (!neighbor) {
+        return raw_socket_send_ipv6(p, next_hop);
+    }
+
+    // Tokens earned so far count at the old rate
+    dtn_pacer_refill(neighbor, now);
+    neighbor->rate_bytes_per_s = rate_bytes_per_s;
+    dtn_pacer_drain(neighbor, now);
+
+    int result = 0;
+    u64_t cost = (u64_t)p->tot_len * 1000;
+    if (neighbor->head == NULL && (rate_bytes_per_s == 0 || neighbor->tokens >= cost)) {
+        if (rate_bytes_per_s > 0) {
+            neighbor->tokens -= cost;
+        }
+        result = raw_socket_send_ipv6(p, next_hop);
+        if (result == 0) {
+            neighbor->sent_packets++;
+        }
+    } else if (neighbor->queue_packets >= DTN_PACER_QUEUE_LIMIT) {
+        neighbor->dropped_packets++;
+        fprintf(stderr, "DTN Pacer: Queue for next hop full (%u packets), dropping packet\n", neighbor->queue_packets);
+        result = -1;
+    } else {
+        Paced_Packet* packet = (Paced_Packet*)malloc(sizeof(Paced_Packet) + p->tot_len);
+        if (!packet) {
+            perror("DTN Pacer: Failed to allocate paced packet");
+            neighbor->dropped_packets++;
+            result = -1;
+        } else {
+            packet->next = NULL;
+            packet->dest = *next_hop;
+            packet->queued_ms = now;
+            packet->len = p->tot_len;
+            pbuf_copy_partial(p, packet->data, p->tot_len, 0);
+            if (neighbor->tail) {
+                neighbor->tail->next = packet;
+            } else {
+                neighbor->head = packet;
+            }
+            neighbor->tail = packet;
+            neighbor->queue_packets++;
+            neighbor->queue_bytes += packet->len;
+            if (neighbor->queue_packets > neighbor->queue_max_packets) {
+                neighbor->queue_max_packets = neighbor->queue_packets;
+            }
+        }
+    }
+
+    dtn_pacer_arm(pacer, now);
+    dtn_pacer_maybe_report(pacer, now);
+    return result;
+}
+
+// Prints the pacing delay and queue depth of every neighbor active since the last report
+void dtn_pacer_report(DTN_Pacer* pacer) {
+    pacer->last_report_ms = sys_now();
+    for (int i = 0; i < DTN_PACER_MAX_NEIGHBORS; i++) {
+        DTN_Pacer_Neighbor* neighbor = &pacer->neighbors[i];
+        if (!neighbor->is_valid ||
+            (neighbor->sent_packets == 0 && neighbor->dropped_packets == 0 && neighbor->queue_packets == 0)) {
+            continue;
+        }
+
+        char addr_str[IP6ADDR_STRLEN_MAX];
+        ip6addr_ntoa_r(&neighbor->next_hop, addr_str, sizeof(addr_str));
+        u32_t delay_avg_ms = neighbor->paced_packets ? (u32_t)(neighbor->delay_total_ms / neighbor->paced_packets) : 0;
+        printf("DTN Pacer: %s at %u B/s, queue %u packets / %u bytes (max %u), "
+               "pacing delay avg %u ms max %u ms, %u sent (%u paced), %u dropped\n",
+               addr_str, neighbor->rate_bytes_per_s, neighbor->queue_packets, neighbor->queue_bytes,
+               neighbor->queue_max_packets, delay_avg_ms, neighbor->delay_max_ms,
+               neighbor->sent_packets, neighbor->paced_packets, neighbor->dropped_packets);
+
+        neighbor->sent_packets = 0;
+        neighbor->paced_packets = 0;
+        neighbor->dropped_packets = 0;
+        neighbor->delay_total_ms = 0;
+        neighbor->delay_max_ms = 0;
+        neighbor->queue_max_packets = neighbor->queue_packets;
+    }
+}
@@ -0,0 +1,144 @@
+// dtn_packet.c: Single-pass IPv6 packet parser filling the descriptor the DTN modules share
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_packet.h"
+#include "dtn_custody.h"
+#include "lwip/ip6.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/def.h"
+#include <string.h>
+
+#define DTN_PACKET_PAD1 0
+#define DTN_PACKET_HEAD_LEN (IP6_HLEN + 2048)    // the largest hop-by-hop header
+
+// Parses the IPv6 header and a hop-by-hop header right behind it. data holds the first len bytes
+// of the packet and every field is bounds-checked against them, so truncated packets and the
+// quotes inside ICMPv6 messages are safe to parse. A hop-by-hop header cut off by len still gives
+// nexth and l4_offset, callers compare l4_offset with tot_len before they look behind it.
+// Returns false without a complete IPv6 header.
+bool dtn_packet_parse_buffer(const u8_t* data, size_t len, DTN_Packet_Info* info) {
+    if (!data || !info || len < IP6_HLEN) return false;
+    memset(info, 0, sizeof(*info));
+
+    const struct ip6_hdr* ip6hdr = (const struct ip6_hdr*)data;
+    if (IP6H_V(ip6hdr) != 6) return false;
+
+    memcpy(&info->v_tc_fl, &ip6hdr->_v_tc_fl, sizeof(info->v_tc_fl));
+    memcpy(&info->plen, &ip6hdr->_plen, sizeof(info->plen));
+    info->hoplim = IP6H_HOPLIM(ip6hdr);
+    info->nexth = IP6H_NEXTH(ip6hdr);
+    memcpy(info->src.addr, &ip6hdr->src, 16);
+    memcpy(info->dest.addr, &ip6hdr->dest, 16);
+    ip6_addr_clear_zone(&info->src);
+    ip6_addr_clear_zone(&info->dest);
+    info->custodian = info->src;
+    info->l4_offset = IP6_HLEN;
+    info->tot_len = len > 0xFFFF ? 0xFFFF : (u16_t)len;
+
+    if (info->nexth != IP6_NEXTH_HOPBYHOP || len < IP6_HLEN + 2) return true;
+
+    const u8_t* hbh = data + IP6_HLEN;
+    size_t hbh_len = (size_t)(hbh[1] + 1) * 8;
+    size_t avail = len - IP6_HLEN < hbh_len ? len - IP6_HLEN : hbh_len;
+    info->nexth = hbh[0];
+    info->hbh_len = (u16_t)hbh_len;
+    info->l4_offset = (u16_t)(IP6_HLEN + hbh_len);
+
+    // Walk the options for the custodian, anything malformed or cut off just ends the walk
+    size_t off = 2;
+    while (off < avail) {
+        u8_t type = hbh[off];
+        if (type == DTN_PACKET_PAD1) {
+            off++;
+            continue;
+        }
+        if (off + 2 > avail || off + 2 + hbh[off + 1] > avail) break;
+        u8_t opt_len = hbh[off + 1];
+        if (type == CUSTODY_OPTION_TYPE && opt_len == 16) {
+            info->custody_offset = (u16_t)(IP6_HLEN + off + 2);
+            memcpy(info->custodian.addr, hbh + off + 2, 16);
+            ip6_addr_clear_zone(&info->custodian);
+            break;
+        }
+        off += 2 + opt_len;
+    }
+    return true;
+}
+
+// Headers only, reads the first segment in place and copies the head only when it is split
+bool dtn_packet_parse_headers(const struct pbuf* p, DTN_Packet_Info* info) {
+    if (!p || !info) return false;
+    if (p->len >= IP6_HLEN) {
+        const u8_t* data = (const u8_t*)p->payload;
+        const struct ip6_hdr* ip6hdr = (const struct ip6_hdr*)data;
+        size_t need = IP6_HLEN;
+        if (IP6H_NEXTH(ip6hdr) == IP6_NEXTH_HOPBYHOP && p->len >= IP6_HLEN + 2) {
+            need += (size_t)(data[IP6_HLEN + 1] + 1) * 8;
+        }
+        if (p->len >= need || p->len == p->tot_len) {
+            if (!dtn_packet_parse_buffer(data, p->len, info)) return false;
+            info->tot_len = p->tot_len;
+            return true;
+        }
+    }
+
+    u8_t head[DTN_PACKET_HEAD_LEN];
+    u16_t copied = pbuf_copy_partial(p, head, sizeof(head), 0);
+    if (!dtn_packet_parse_buffer(head, copied, info)) return false;
+    info->tot_len = p->tot_len;
+    return true;
+}
+
+static uint64_t dtn_packet_fnv1a(uint64_t hash, const void* data, size_t len) {
+    const u8_t* bytes = (const u8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= DTN_PACKET_FNV_PRIME;
+    }
+    return hash;
+}
+
+// Fills info->fingerprint for a packet dtn_packet_parse_headers has parsed. It hashes what stays
+// the same from hop to hop: the addresses, the flow label, the upper-layer protocol and everything
+// after the hop-by-hop header. The hop limit and the custody option are rewritten along the way.
+// Returns 0, and leaves the fingerprint 0, when the packet ends inside its hop-by-hop header.
+uint64_t dtn_packet_fingerprint(const struct pbuf* p, DTN_Packet_Info* info) {
+    if (!p || !info || info->l4_offset > p->tot_len) return 0;
+
+    u32_t flow_label = lwip_htonl(lwip_ntohl(info->v_tc_fl) & 0x000FFFFFUL);
+    uint64_t hash = DTN_PACKET_FNV_OFFSET;
+    hash = dtn_packet_fnv1a(hash, info->src.addr, 16);
+    hash = dtn_packet_fnv1a(hash, info->dest.addr, 16);
+    hash = dtn_packet_fnv1a(hash, &flow_label, sizeof(flow_label));
+    hash = dtn_packet_fnv1a(hash, &info->nexth, sizeof(info->nexth));
+    u16_t offset = info->l4_offset;
+    for (const struct pbuf* q = p; q != NULL; q = q->next) {
+        if (offset >= q->len) {
+            offset -= q->len;
+            continue;
+        }
+        hash = dtn_packet_fnv1a(hash, (const u8_t*)q->payload + offset, q->len - offset);
+        offset = 0;
+    }
+    info->fingerprint = hash != 0 ? hash : 1;
+    return info->fingerprint;
+}
+
+// Headers and fingerprint in one call
+bool dtn_packet_parse(const struct pbuf* p, DTN_Packet_Info* info) {
+    if (!dtn_packet_parse_headers(p, info)) return false;
+    dtn_packet_fingerprint(p, info);
+    return true;
+}
@@ -73,6 +73,8 @@ int dtn_routing_add_contact(Routing_Function* routing,
                           const ip6_addr_t* next_hop,
                           u32_t start_time_ms, 
                           u32_t end_time_ms,
+                          u32_t rate_bytes_per_s,
+                          u32_t owlt_ms,
                           bool is_dtn_node) {
     if (!routing || !node_addr || !next_hop) return 0;
     
@@ -86,6 +88,9 @@ int dtn_routing_add_contact(Routing_Function* routing,
     ip6_addr_copy(new_contact->next_hop, *next_hop);
     new_contact->start_time_ms = start_time_ms;
     new_contact->end_time_ms = end_time_ms;
+    new_contact->rate_bytes_per_s = rate_bytes_per_s;
+    new_contact->owlt_ms = owlt_ms;
+    new_contact->busy_until_ms = start_time_ms;
     new_contact->is_dtn_node = is_dtn_node;
     new_contact->next = NULL;
     
@@ -104,13 +109,51 @@ int dtn_routing_add_contact(Routing_Function* routing,
     ip6addr_ntoa_r(node_addr, node_addr_str, sizeof(node_addr_str));
     ip6addr_ntoa_r(next_hop, next_hop_str, sizeof(next_hop_str));
     
-    printf("DTN Routing: Added contact for %s via %s (%s), start: %u ms, end: %u ms\n",
+    printf("DTN Routing: Added contact for %s via %s (%s), start: %u ms, end: %u ms, rate: %u B/s, owlt: %u ms\n",
             node_addr_str, next_hop_str, is_dtn_node ? "DTN" : "non-DTN", 
-           start_time_ms, end_time_ms);
+           start_time_ms, end_time_ms, rate_bytes_per_s, owlt_ms);
     
     return 1;
 }
 
+// The contact currently open towards a next hop, NULL if there is none
+Contact_Info* dtn_routing_active_contact_to(Routing_Function* routing, const ip6_addr_t* next_hop_ip) {
+    if (!routing || !next_hop_ip) return NULL;
+
+    u32_t current_time = sys_now();
+    for (Contact_Info* contact = routing->contact_list_head; contact != NULL; contact = contact->next) {
+        if (next_hop_ip->addr[0] == contact->node_addr.addr[0] &&
+            next_hop_ip->addr[1] == contact->node_addr.addr[1] &&
+            next_hop_ip->addr[2] == contact->node_addr.addr[2] &&
+            next_hop_ip->addr[3] == contact->node_addr.addr[3] &&
+            current_time >= contact->start_time_ms && current_time <= contact->end_time_ms) {
+            return contact;
+        }
+    }
+    return NULL;
+}
+
+// Time until the next contact opens or closes, as seen by dtn_routing_update_contacts,
+// DTN_ROUTING_NO_CONTACT_CHANGE if none is left
+u32_t dtn_routing_next_contact_change_ms(Routing_Function* routing) {
+    if (!routing) return DTN_ROUTING_NO_CONTACT_CHANGE;
+
+    u32_t current_time = sys_now();
+    u32_t next_change = DTN_ROUTING_NO_CONTACT_CHANGE;
+    for (Contact_Info* contact = routing->contact_list_head; contact != NULL; contact = contact->next) {
+        u32_t until;
+        if (current_time < contact->start_time_ms) {
+            until = contact->start_time_ms - current_time;
+        } else if (current_time <= contact->end_time_ms) {
+            until = contact->end_time_ms - current_time + 1;    // the window includes its last millisecond
+        } else {
+            continue;
+        }
+        if (until < next_change) next_change = until;
+    }
+    return next_change;
+}
+
 // not used
 int dtn_routing_remove_contact(Routing_Function* routing, const ip6_addr_t* node_addr) {
     if (!routing || !node_addr || !routing->contact_list_head) return 0;
@@ -330,7 +373,7 @@ int dtn_routing_get_dtn_next_hop(Routing_Function* routing, u32_t* v_tc_fl, u16_
     if (v_tc_fl != NULL) v_tc_fl_val = *v_tc_fl;
     if (plen != NULL) plen_val = *plen;
 
-    long deadline = hoplim_val*10000;                 //multiplying factor
+    long deadline = hoplim_val*DTN_LIFETIME_PER_HOP_S;
     uint8_t tc = (uint8_t)((v_tc_fl_val >> 20) & 0xFF); // traffic class (8 bits) 
     uint8_t dscp = (uint8_t)(tc >> 2);              // DSCP = TC[7:2] (6 bits)
 
@@ -532,6 +575,7 @@ int dtn_routing_load_contacts(Routing_Function* routing, const char* filename) {
         }
 
         char *from_tok = NULL, *to_tok = NULL;
+        int to_idx = -1;
         for (int i = 0; i < ntok; ++i) {
             bool all_digits = true;
             size_t L = strlen(tok[i]);
@@ -539,10 +583,20 @@ int dtn_routing_load_contacts(Routing_Function* routing, const char* filename) {
             for (size_t j = 0; j < L; ++j) if (!isdigit((unsigned char)tok[i][j])) { all_digits = false; break; }
             if (all_digits) {
                 if (!from_tok) from_tok = tok[i];
-                else if (!to_tok) to_tok = tok[i];
+                else if (!to_tok) { to_tok = tok[i]; to_idx = i; }
             }
         }
 
+        // <rate> <range> follow the nodes, as in the CGR contact plan: the rate in bytes/s, which both
+        // CGR and the pacer use as is, and the range (one-way light time) in seconds, kept in ms.
+        // A rate of 0 or below, or none, leaves the contact unpaced.
+        long rate = 0, owlt_sec = 0;
+        if (to_idx >= 0 && to_idx + 1 < ntok) rate = strtol(tok[to_idx + 1], NULL, 10);
+        if (to_idx >= 0 && to_idx + 2 < ntok) owlt_sec = strtol(tok[to_idx + 2], NULL, 10);
+        if (rate < 0) rate = 0;
+        if (rate > (long)UINT32_MAX) rate = UINT32_MAX;
+        if (owlt_sec < 0) owlt_sec = 0;
+
         if (!start_tok || !end_tok || !from_tok || !to_tok) {
             continue;
         }
@@ -577,7 +631,8 @@ int dtn_routing_load_contacts(Routing_Function* routing, const char* filename) {
             ip6_addr_set_zone(&to_ip6, IP6_NO_ZONE);
         #endif
 
-        int added = dtn_routing_add_contact(routing, &to_ip6, &from_ip6, start_ms + routing->base_time, end_ms + routing->base_time, true);
+        int added = dtn_routing_add_contact(routing, &to_ip6, &from_ip6, start_ms + routing->base_time, end_ms + routing->base_time,
+                                            (u32_t)rate, (u32_t)owlt_sec * 1000, true);
         if (added) loaded++;
     }
 
@@ -0,0 +1,101 @@
+// dtn_rtt.c: Round-trip time estimation per next hop, from the custody acknowledgements it sends back
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_rtt.h"
+#include <stdio.h>
+#include <string.h>
+#include "lwip/sys.h"
+
+#define DTN_RTT_MAX_SAMPLE_MS 0x0FFFFFFFUL      // keeps the scaled values within 32 bits
+
+void dtn_rtt_init(DTN_Rtt_Table* table) {
+    memset(table, 0, sizeof(*table));
+}
+
+static bool dtn_rtt_same_hop(const ip6_addr_t* a, const ip6_addr_t* b) {
+    return a->addr[0] == b->addr[0] && a->addr[1] == b->addr[1] &&
+           a->addr[2] == b->addr[2] && a->addr[3] == b->addr[3];
+}
+
+static const DTN_Rtt_Estimator* dtn_rtt_find(const DTN_Rtt_Table* table, const ip6_addr_t* next_hop) {
+    for (int i = 0; i < DTN_RTT_MAX_NEIGHBORS; i++) {
+        const DTN_Rtt_Estimator* estimator = &table->neighbors[i];
+        if (estimator->is_valid && dtn_rtt_same_hop(&estimator->next_hop, next_hop)) {
+            return estimator;
+        }
+    }
+    return NULL;
+}
+
+// The next hop's estimator, taking a free one or the least recently sampled for a new next hop
+static DTN_Rtt_Estimator* dtn_rtt_claim(DTN_Rtt_Table* table, const ip6_addr_t* next_hop, u32_t now) {
+    DTN_Rtt_Estimator* found = (DTN_Rtt_Estimator*)dtn_rtt_find(table, next_hop);
+    if (found) return found;
+
+    DTN_Rtt_Estimator* spare = &table->neighbors[0];
+    for (int i = 0; i < DTN_RTT_MAX_NEIGHBORS; i++) {
+        DTN_Rtt_Estimator* estimator = &table->neighbors[i];
+        if (!estimator->is_valid) {
+            spare = estimator;
+            break;
+        }
+        if (now - estimator->last_sample_ms > now - spare->last_sample_ms) {
+            spare = estimator;
+        }
+    }
+    memset(spare, 0, sizeof(*spare));
+    spare->next_hop = *next_hop;
+    spare->is_valid = true;
+    return spare;
+}
+
+void dtn_rtt_sample(DTN_Rtt_Table* table, const ip6_addr_t* next_hop, u32_t rtt_ms) {
+    if (!table || !next_hop) return;
+    if (rtt_ms > DTN_RTT_MAX_SAMPLE_MS) rtt_ms = DTN_RTT_MAX_SAMPLE_MS;
+
+    u32_t now = sys_now();
+    DTN_Rtt_Estimator* estimator = dtn_rtt_claim(table, next_hop, now);
+    if (estimator->samples == 0) {
+        estimator->srtt_x8 = rtt_ms << 3;
+        estimator->rttvar_x4 = rtt_ms << 1;
+    } else {
+        // SRTT += (R - SRTT) / 8, RTTVAR += (|R - SRTT| - RTTVAR) / 4
+        s32_t delta = (s32_t)rtt_ms - (s32_t)(estimator->srtt_x8 >> 3);
+        estimator->srtt_x8 = (u32_t)((s32_t)estimator->srtt_x8 + delta);
+        if (delta < 0) delta = -delta;
+        estimator->rttvar_x4 = (u32_t)((s32_t)estimator->rttvar_x4 + delta - (s32_t)(estimator->rttvar_x4 >> 2));
+    }
+    estimator->samples++;
+    estimator->last_sample_ms = now;
+
+    char addr_str[IP6ADDR_STRLEN_MAX];
+    ip6addr_ntoa_r(next_hop, addr_str, sizeof(addr_str));
+    printf("DTN RTT: %s acknowledged after %u ms, srtt %u ms, rttvar %u ms\n",
+           addr_str, rtt_ms, estimator->srtt_x8 >> 3, estimator->rttvar_x4 >> 2);
+}
+
+// RTO = SRTT + max(G, 4 * RTTVAR), raised to the round-trip light time of the contact
+u32_t dtn_rtt_timeout(const DTN_Rtt_Table* table, const ip6_addr_t* next_hop, u32_t owlt_ms) {
+    u64_t floor_ms = 2ULL * owlt_ms + DTN_RTT_MIN_RTO_MS;
+    u64_t rto_ms = DTN_RTT_INITIAL_RTO_MS;
+
+    const DTN_Rtt_Estimator* estimator = table && next_hop ? dtn_rtt_find(table, next_hop) : NULL;
+    if (estimator && estimator->samples > 0) {
+        u32_t variation = estimator->rttvar_x4 > DTN_RTT_GRANULARITY_MS ? estimator->rttvar_x4 : DTN_RTT_GRANULARITY_MS;
+        rto_ms = (u64_t)(estimator->srtt_x8 >> 3) + variation;
+    }
+    if (rto_ms < floor_ms) rto_ms = floor_ms;
+    return rto_ms > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (u32_t)rto_ms;
+}
@@ -20,22 +20,390 @@
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
 #include "lwip/ip6_addr.h"
+#include "lwip/timeouts.h"
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include "dtn_icmpv6.h"
+#include "dtn_controller.h"
+#include "dtn_routing.h"
 #include "dtn_custody.h"
 
+#define STORAGE_INDEX_NAME_LEN 64
+#define STORAGE_FILE_VERSION 2     // version 1 stored process-local times
+#define STORAGE_INDEX_VERSION 3    // version 2 had no fingerprints
+
 // File header for stored packets
 typedef struct {
     char magic[4];             // DTN Packet
     u32_t version;             // File format version
-    u32_t timestamp;           // When the packet was stored
+    u32_t stored_at;           // When the packet was stored, wall-clock seconds
     u32_t packet_len;          // Length of the packet data
     ip6_addr_t original_dest;  // Original destination
 } PacketFileHeader;
 
+// Header of the storage index file
+typedef struct {
+    char magic[4];             // DTN Index
+    u32_t version;             // Index format version
+    u32_t record_size;         // Size of one IndexRecord
+} IndexFileHeader;
+
+// One slot of the storage index, describing a stored packet without its payload
+typedef struct {
+    u8_t in_use;
+    u8_t reserved[3];
+    u32_t stored_at;           // wall-clock seconds
+    uint64_t fingerprint;      // 0 if unknown
+    u32_t packet_len;
+    ip6_addr_t original_dest;
+    u8_t header_snapshot[STORAGE_SNAPSHOT_LEN];
+    char name[STORAGE_INDEX_NAME_LEN];
+} IndexRecord;
+
+// Result of reading one packet file during a header-only scan
+typedef struct {
+    bool valid;
+    PacketFileHeader header;
+    u8_t header_snapshot[STORAGE_SNAPSHOT_LEN];
+    uint64_t fingerprint;
+} ScanResult;
+
+typedef struct {
+    const char* directory;
+    char (*names)[STORAGE_INDEX_NAME_LEN];
+    ScanResult* results;
+    size_t count;
+    size_t first;
+    size_t stride;
+} ScanJob;
+
+static off_t index_slot_offset(u32_t slot) {
+    return (off_t)sizeof(IndexFileHeader) + (off_t)slot * sizeof(IndexRecord);
+}
+
+static int dtn_storage_addr_table_grow(Storage_Function* storage) {
+    u32_t new_size = storage->addr_table_size ? storage->addr_table_size * 2 : 256;
+    u16_t* table = calloc(new_size, sizeof(u16_t));
+    if (!table) return 0;
+
+    for (u32_t i = 0; i < storage->addr_count; i++) {
+        if (storage->addr_refs[i] == 0) continue;
+        u32_t pos = dtn_addr_hash(storage->addrs[i].addr) & (new_size - 1);
+        while (table[pos] != 0) {
+            pos = (pos + 1) & (new_size - 1);
+        }
+        table[pos] = (u16_t)(i + 1);
+    }
+    free(storage->addr_table);
+    storage->addr_table = table;
+    storage->addr_table_size = new_size;
+    return 1;
+}
+
+// Returns the index of an address in the storage address table, or -1 if it isn't there.
+// addr points at the 16 address bytes, as found in a packet header.
+static int dtn_storage_lookup_addr(const Storage_Function* storage, const void* addr) {
+    u32_t words[4];
+    memcpy(words, addr, sizeof(words));
+
+    if (storage->addr_table_size) {
+        u32_t pos = dtn_addr_hash(words) & (storage->addr_table_size - 1);
+        while (storage->addr_table[pos] != 0) {
+            u32_t index = storage->addr_table[pos] - 1;
+            if (memcmp(storage->addrs[index].addr, words, sizeof(words)) == 0) {
+                return (int)index;
+            }
+            pos = (pos + 1) & (storage->addr_table_size - 1);
+        }
+    }
+    return -1;
+}
+
+static int dtn_storage_addr_arrays_grow(Storage_Function* storage) {
+    u32_t new_capacity = storage->addr_capacity ? storage->addr_capacity * 2 : 64;
+    ip6_addr_t* addrs = realloc(storage->addrs, new_capacity * sizeof(ip6_addr_t));
+    if (addrs) storage->addrs = addrs;
+    u32_t* refs = realloc(storage->addr_refs, new_capacity * sizeof(u32_t));
+    if (refs) storage->addr_refs = refs;
+    u32_t* free_addrs = realloc(storage->free_addrs, new_capacity * sizeof(u32_t));
+    if (free_addrs) storage->free_addrs = free_addrs;
+    if (!addrs || !refs || !free_addrs) return 0;
+
+    storage->addr_capacity = new_capacity;
+    return 1;
+}
+
+// Returns the index of an address in the storage address table, adding it if needed, and takes
+// a reference on it. Returns -1 if the table is full.
+static int dtn_storage_intern_addr(Storage_Function* storage, const void* addr) {
+    int existing = dtn_storage_lookup_addr(storage, addr);
+    if (existing >= 0) {
+        storage->addr_refs[existing]++;
+        return existing;
+    }
+
+    u32_t words[4];
+    memcpy(words, addr, sizeof(words));
+
+    u32_t live = storage->addr_count - storage->free_addrs_count;
+    if (storage->free_addrs_count == 0) {
+        if (storage->addr_count >= STORAGE_MAX_ADDRESSES) {
+            fprintf(stderr, "DTN Storage: Address table is full\n");
+            return -1;
+        }
+        if (storage->addr_count == storage->addr_capacity && !dtn_storage_addr_arrays_grow(storage)) {
+            perror("DTN Storage: Failed to grow address table");
+            return -1;
+        }
+    }
+    // Kept at most half full so probes stay short
+    if ((live + 1) * 2 > storage->addr_table_size && !dtn_storage_addr_table_grow(storage)) {
+        perror("DTN Storage: Failed to grow address table");
+        return -1;
+    }
+
+    u32_t index = storage->free_addrs_count > 0 ? storage->free_addrs[--storage->free_addrs_count]
+                                                : storage->addr_count++;
+    storage->addr_refs[index] = 1;
+    ip6_addr_t* slot = &storage->addrs[index];
+    IP6_ADDR(slot, words[0], words[1], words[2], words[3]);
+    ip6_addr_clear_zone(slot);
+
+    u32_t pos = dtn_addr_hash(words) & (storage->addr_table_size - 1);
+    while (storage->addr_table[pos] != 0) {
+        pos = (pos + 1) & (storage->addr_table_size - 1);
+    }
+    storage->addr_table[pos] = (u16_t)(index + 1);
+    return (int)index;
+}
+
+// Removes an index from the hash table, moving later entries of its probe run back into the hole
+static void dtn_storage_addr_table_remove(Storage_Function* storage, u32_t index) {
+    u32_t mask = storage->addr_table_size - 1;
+    u32_t hole = dtn_addr_hash(storage->addrs[index].addr) & mask;
+    while (storage->addr_table[hole] != index + 1) {
+        hole = (hole + 1) & mask;
+    }
+    storage->addr_table[hole] = 0;
+
+    for (u32_t pos = (hole + 1) & mask; storage->addr_table[pos] != 0; pos = (pos + 1) & mask) {
+        u32_t home = dtn_addr_hash(storage->addrs[storage->addr_table[pos] - 1].addr) & mask;
+        // An entry may only move back if the hole lies between its home slot and where it is now
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            storage->addr_table[hole] = storage->addr_table[pos];
+            storage->addr_table[pos] = 0;
+            hole = pos;
+        }
+    }
+}
+
+// Drops a reference taken by dtn_storage_intern_addr(). The last one frees the address and its
+// destination queue, which by then holds no packets.
+static void dtn_storage_release_addr(Storage_Function* storage, u32_t index) {
+    if (--storage->addr_refs[index] > 0) return;
+
+    dtn_storage_addr_table_remove(storage, index);
+    if (index < storage->destinations_capacity) {
+        free(storage->destinations[index]);
+        storage->destinations[index] = NULL;
+    }
+    storage->free_addrs[storage->free_addrs_count++] = index;
+}
+
+// Interns a destination address and makes sure it has a queue
+static int dtn_storage_intern_dest(Storage_Function* storage, const void* addr) {
+    int index = dtn_storage_intern_addr(storage, addr);
+    if (index < 0) return -1;
+
+    if ((u32_t)index >= storage->destinations_capacity) {
+        u32_t new_capacity = storage->addr_capacity;
+        Storage_Destination** destinations = realloc(storage->destinations, new_capacity * sizeof(Storage_Destination*));
+        if (!destinations) {
+            perror("DTN Storage: Failed to grow destination table");
+            dtn_storage_release_addr(storage, (u32_t)index);
+            return -1;
+        }
+        memset(destinations + storage->destinations_capacity, 0,
+               (new_capacity - storage->destinations_capacity) * sizeof(Storage_Destination*));
+        storage->destinations = destinations;
+        storage->destinations_capacity = new_capacity;
+    }
+    if (!storage->destinations[index]) {
+        Storage_Destination* destination = calloc(1, sizeof(Storage_Destination));
+        if (!destination) {
+            perror("DTN Storage: Failed to allocate destination queue");
+            dtn_storage_release_addr(storage, (u32_t)index);
+            return -1;
+        }
+        destination->dest_index = (u16_t)index;
+        storage->destinations[index] = destination;
+    }
+    return index;
+}
+
+Storage_Destination* dtn_storage_destination_for(const Storage_Function* storage, const ip6_addr_t* dest) {
+    int index = dtn_storage_lookup_addr(storage, dest->addr);
+    if (index < 0 || (u32_t)index >= storage->destinations_capacity) return NULL;
+    return storage->destinations[index];
+}
+
+Storage_Class dtn_storage_class_from_tc(u8_t traffic_class) {
+    u8_t dscp = traffic_class >> 2;
+    if (dscp == DTN_DSCP_EXPEDITED) return STORAGE_CLASS_EXPEDITED;
+    if (dscp == DTN_DSCP_BULK) return STORAGE_CLASS_BULK;
+    return STORAGE_CLASS_NORMAL;
+}
+
+const ip6_addr_t* dtn_storage_entry_dest(const Storage_Function* storage, const Stored_Packet_Entry* entry) {
+    return &storage->addrs[entry->dest_index];
+}
+
+const ip6_addr_t* dtn_storage_entry_src(const Storage_Function* storage, const Stored_Packet_Entry* entry) {
+    return &storage->addrs[entry->src_index];
+}
+
+// What is left at now of the packet's lifetime, as derived from its hop limit, 0 once it has run out.
+// A lifetime reaches past 2^31 ms from hop limit 215, so it is only ever compared as an unsigned age.
+u32_t dtn_storage_entry_time_left(const Stored_Packet_Entry* entry, u32_t now) {
+    u32_t lifetime_ms = (u32_t)entry->hoplim * (DTN_LIFETIME_PER_HOP_S * 1000UL);
+    u32_t age_ms = now - entry->stored_time_ms;
+    return age_ms < lifetime_ms ? lifetime_ms - age_ms : 0;
+}
+
+// In memory an entry's store time follows sys_now(), which starts over with the process. On disk it
+// is kept as wall-clock seconds, so a restart doesn't hand recovered packets a fresh lifetime.
+static u32_t dtn_storage_wall_time(const Stored_Packet_Entry* entry) {
+    return (u32_t)time(NULL) - (sys_now() - entry->stored_time_ms) / 1000;
+}
+
+static u32_t dtn_storage_local_time(u32_t stored_at) {
+    u32_t now_s = (u32_t)time(NULL);
+    // A wall clock set back since leaves the packet as if it was just stored
+    u64_t age_ms = (s32_t)(now_s - stored_at) > 0 ? (u64_t)(now_s - stored_at) * 1000 : 0;
+    if (age_ms > 0xFFFFFFFFULL) {
+        age_ms = 0xFFFFFFFFULL;     // beyond any lifetime
+    }
+    return sys_now() - (u32_t)age_ms;
+}
+
+// Rebuilds the IPv6 header of a stored packet from its metadata, the traffic class only keeps the DSCP of its class
+void dtn_storage_entry_header(const Storage_Function* storage, const Stored_Packet_Entry* entry, struct ip6_hdr* ip6hdr) {
+    u8_t dscp = 0;
+    if (entry->priority == STORAGE_CLASS_EXPEDITED) dscp = DTN_DSCP_EXPEDITED;
+    else if (entry->priority == STORAGE_CLASS_BULK) dscp = DTN_DSCP_BULK;
+
+    IP6H_VTCFL_SET(ip6hdr, 6, dscp << 2, 0);
+    IP6H_PLEN_SET(ip6hdr, entry->packet_len - IP6_HLEN);
+    IP6H_NEXTH_SET(ip6hdr, entry->nexth);
+    IP6H_HOPLIM_SET(ip6hdr, entry->hoplim);
+    ip6_addr_copy_to_packed(ip6hdr->src, *dtn_storage_entry_src(storage, entry));
+    ip6_addr_copy_to_packed(ip6hdr->dest, *dtn_storage_entry_dest(storage, entry));
+}
+
+static void dtn_storage_file_name(u32_t file_id, char* name, size_t len) {
+    snprintf(name, len, "pkt_%08x.dat", file_id);
+}
+
+// Returns 1 if the name is one of ours, filling in its file id
+static int dtn_storage_parse_file_name(const char* name, u32_t* file_id) {
+    unsigned int id;
+    int consumed = 0;
+    if (sscanf(name, "pkt_%8x.dat%n", &id, &consumed) != 1 || consumed != 16 || name[consumed] != '\0') {
+        return 0;
+    }
+    *file_id = id;
+    return 1;
+}
+
+// Keeps new file ids clear of one already used on disk
+static void dtn_storage_note_file_name(Storage_Function* storage, const char* name) {
+    u32_t file_id;
+    if (dtn_storage_parse_file_name(name, &file_id) && file_id >= storage->next_file_id) {
+        storage->next_file_id = file_id + 1;
+    }
+}
+
+int dtn_storage_entry_path(const Storage_Function* storage, const Stored_Packet_Entry* entry, char* path, size_t len) {
+    char name[STORAGE_INDEX_NAME_LEN];
+    dtn_storage_file_name(entry->file_id, name, sizeof(name));
+    if (snprintf(path, len, "%s/%s", storage->storage_directory, name) >= (int)len) {
+        fprintf(stderr, "DTN Storage: Warning - Path was truncated\n");
+        return 0;
+    }
+    return 1;
+}
+
+static Stored_Packet_Entry* dtn_storage_entry_alloc(Storage_Function* storage) {
+    if (!storage->free_entries) {
+        Storage_Slab* slab = malloc(sizeof(Storage_Slab));
+        if (!slab) {
+            perror("DTN Storage: Failed to allocate entry slab");
+            return NULL;
+        }
+        slab->next = storage->slabs;
+        storage->slabs = slab;
+        for (int i = STORAGE_SLAB_ENTRIES - 1; i >= 0; i--) {
+            slab->entries[i].next = storage->free_entries;
+            storage->free_entries = &slab->entries[i];
+        }
+    }
+
+    Stored_Packet_Entry* entry = storage->free_entries;
+    storage->free_entries = entry->next;
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+// Returns an entry record to the slab free list, along with any packet it still holds
+static void dtn_storage_entry_release(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (entry->p) {
+        pbuf_free(entry->p);
+    }
+    if (entry->flags & STORED_ENTRY_INTERNED) {
+        dtn_storage_release_addr(storage, entry->dest_index);
+        dtn_storage_release_addr(storage, entry->src_index);
+    }
+    entry->p = NULL;
+    entry->flags = 0;
+    entry->next = storage->free_entries;
+    storage->free_entries = entry;
+}
+
+// Fills entry fields from a header snapshot: the IPv6 header plus the 8 bytes that follow it
+static int dtn_storage_entry_set_snapshot(Storage_Function* storage, Stored_Packet_Entry* entry, const u8_t* snapshot) {
+    const struct ip6_hdr* ip6hdr = (const struct ip6_hdr*)snapshot;
+    int src_index = dtn_storage_intern_addr(storage, &ip6hdr->src);
+    if (src_index < 0) return 0;
+
+    entry->src_index = (u16_t)src_index;
+    entry->nexth = IP6H_NEXTH(ip6hdr);
+    entry->hoplim = IP6H_HOPLIM(ip6hdr);
+    entry->priority = (u8_t)dtn_storage_class_from_tc(IP6H_TC(ip6hdr));
+    memcpy(entry->payload_head, snapshot + IP6_HLEN, sizeof(entry->payload_head));
+    return 1;
+}
+
+// Interns the destination and source of an entry, which holds on to them until it is released
+static int dtn_storage_entry_intern(Storage_Function* storage, Stored_Packet_Entry* entry,
+                                    const ip6_addr_t* dest, const u8_t* snapshot) {
+    int dest_index = dtn_storage_intern_dest(storage, dest->addr);
+    if (dest_index < 0) return 0;
+
+    if (!dtn_storage_entry_set_snapshot(storage, entry, snapshot)) {
+        dtn_storage_release_addr(storage, (u32_t)dest_index);
+        return 0;
+    }
+    entry->dest_index = (u16_t)dest_index;
+    entry->flags |= STORED_ENTRY_INTERNED;
+    return 1;
+}
+
 // Creates storage directory if it doesn't exist
 int dtn_storage_init_directory(Storage_Function* storage) {
     struct stat st = {0};
@@ -51,212 +419,1251 @@ int dtn_storage_init_directory(Storage_Function* storage) {
     return 1;
 }
 
-int dtn_storage_save_packet_to_disk(Storage_Function* storage, Stored_Packet_Entry* entry) {
-    if (!storage || !entry || !entry->p) return 0;
-    
-    char addr_str[IP6ADDR_STRLEN_MAX];
-    ip6addr_ntoa_r(&entry->original_dest, addr_str, sizeof(addr_str));
-    
-    for (char* p = addr_str; *p; p++) {
-        if (*p == ':') *p = '_';
+// Opens the index file, returns 1 if it holds a usable index and 0 if it was (re)initialized empty
+static int dtn_storage_index_open(Storage_Function* storage) {
+    char path[MAX_PATH_LENGTH];
+    if (snprintf(path, sizeof(path), "%s/%s", storage->storage_directory, STORAGE_INDEX_FILE) >= (int)sizeof(path)) {
+        fprintf(stderr, "DTN Storage: Index path too long\n");
+        return -1;
     }
-    
-    if (snprintf(entry->filename, MAX_PATH_LENGTH, "%s/pkt_%s_%u.dat", 
-                storage->storage_directory, addr_str, entry->stored_time_ms) >= MAX_PATH_LENGTH) {
-        fprintf(stderr, "DTN Storage: Warning - Filename was truncated\n");
+
+    storage->index_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (storage->index_fd < 0) {
+        perror("DTN Storage: Failed to open index file");
+        return -1;
     }
-    
-    FILE* file = fopen(entry->filename, "wb");
-    if (!file) {
-        perror("DTN Storage: Failed to open file for writing");
-        return 0;
+
+    IndexFileHeader header;
+    if (pread(storage->index_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, "DTNI", 4) == 0 && header.version == STORAGE_INDEX_VERSION &&
+        header.record_size == sizeof(IndexRecord)) {
+        return 1;
     }
-    
-    PacketFileHeader header;
-    memcpy(header.magic, "DTNP", 4);
-    header.version = 1;
-    header.timestamp = entry->stored_time_ms;
-    header.packet_len = entry->p->tot_len;
-    memcpy(&header.original_dest, &entry->original_dest, sizeof(ip6_addr_t));
-    
-    if (fwrite(&header, sizeof(header), 1, file) != 1) {
-        perror("DTN Storage: Failed to write packet header");
-        fclose(file);
-        return 0;
+
+    memcpy(header.magic, "DTNI", 4);
+    header.version = STORAGE_INDEX_VERSION;
+    header.record_size = sizeof(IndexRecord);
+    if (ftruncate(storage->index_fd, 0) != 0 ||
+        pwrite(storage->index_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("DTN Storage: Failed to initialize index file");
+        close(storage->index_fd);
+        storage->index_fd = -1;
+        return -1;
     }
-    
-    char* buffer = malloc(entry->p->tot_len);
-    if (!buffer) {
-        perror("DTN Storage: Failed to allocate buffer for packet data");
-        fclose(file);
-        return 0;
+    return 0;
+}
+
+static u32_t dtn_storage_index_alloc_slot(Storage_Function* storage) {
+    if (storage->free_slots_count > 0) {
+        return storage->free_slots[--storage->free_slots_count];
     }
-    
-    if (pbuf_copy_partial(entry->p, buffer, entry->p->tot_len, 0) != entry->p->tot_len) {
-        perror("DTN Storage: Failed to copy packet data to buffer");
-        free(buffer);
-        fclose(file);
+    return storage->index_slot_count++;
+}
+
+static void dtn_storage_index_push_free_slot(Storage_Function* storage, u32_t slot) {
+    if (storage->free_slots_count == storage->free_slots_capacity) {
+        size_t new_capacity = storage->free_slots_capacity ? storage->free_slots_capacity * 2 : 64;
+        u32_t* slots = realloc(storage->free_slots, new_capacity * sizeof(u32_t));
+        if (!slots) {
+            // The slot is simply leaked in the index file, it stays marked free
+            return;
+        }
+        storage->free_slots = slots;
+        storage->free_slots_capacity = new_capacity;
+    }
+    storage->free_slots[storage->free_slots_count++] = slot;
+}
+
+// Clearing an index slot, the slot is only reused once the clear has reached the file
+typedef struct {
+    Storage_Function* storage;
+    u32_t slot;
+    u8_t in_use;
+} IndexClearOp;
+
+static void dtn_storage_group_op_done(void* arg, int result);
+static void dtn_storage_group_advance(Storage_Group* group);
+static void dtn_storage_group_seal(Storage_Group* group);
+static void dtn_storage_entry_io_done(Storage_Function* storage, Stored_Packet_Entry* entry);
+static void dtn_storage_dedup_forget(Storage_Function* storage, uint64_t fingerprint);
+static void dtn_storage_unlink_entry(Storage_Function* storage, Stored_Packet_Entry* entry);
+static void dtn_storage_discard_entry_on_disk(Storage_Function* storage, Stored_Packet_Entry* entry);
+
+// One index record write, the entry's slot is not cleared before it completes
+typedef struct {
+    Storage_Function* storage;
+    Storage_Group* group;
+    Stored_Packet_Entry* entry;
+    IndexRecord record;
+} IndexWriteOp;
+
+static void dtn_storage_index_write_done(void* arg, int result) {
+    IndexWriteOp* op = (IndexWriteOp*)arg;
+    Storage_Group* group = op->group;
+
+    if (result != (int)sizeof(IndexRecord)) {
+        fprintf(stderr, "DTN Storage: Failed to write index record %u: %s\n", op->entry->index_slot,
+                result < 0 ? strerror(-result) : "short write");
+    }
+    dtn_storage_entry_io_done(op->storage, op->entry);
+
+    if (group) {
+        if (result != (int)sizeof(IndexRecord)) {
+            group->failed = true;
+        }
+        group->ops_pending--;
+        dtn_storage_group_advance(group);
+    }
+}
+
+static int dtn_storage_index_write(Storage_Function* storage, Stored_Packet_Entry* entry,
+                                   const u8_t* header_snapshot, Storage_Group* group) {
+    if (storage->index_fd < 0) return 0;
+
+    IndexWriteOp* op = calloc(1, sizeof(IndexWriteOp));
+    if (!op) {
+        perror("DTN Storage: Failed to allocate index record");
         return 0;
     }
-    
-    if (fwrite(buffer, 1, entry->p->tot_len, file) != entry->p->tot_len) {
-        perror("DTN Storage: Failed to write packet data");
-        free(buffer);
-        fclose(file);
+    op->storage = storage;
+    op->group = group;
+    op->entry = entry;
+    IndexRecord* record = &op->record;
+    record->in_use = 1;
+    record->stored_at = dtn_storage_wall_time(entry);
+    record->fingerprint = entry->fingerprint;
+    record->packet_len = entry->packet_len;
+    memcpy(&record->original_dest, dtn_storage_entry_dest(storage, entry), sizeof(ip6_addr_t));
+    memcpy(record->header_snapshot, header_snapshot, STORAGE_SNAPSHOT_LEN);
+    dtn_storage_file_name(entry->file_id, record->name, sizeof(record->name));
+
+    struct iovec iov = { record, sizeof(IndexRecord) };
+    if (dtn_storage_io_writev(storage->io, storage->index_fd, &iov, 1, index_slot_offset(entry->index_slot),
+                              op, dtn_storage_index_write_done, op) != 0) {
+        fprintf(stderr, "DTN Storage: Failed to submit index record write\n");
+        free(op);
         return 0;
     }
-    
-    free(buffer);
-    fclose(file);
-    
-    printf("DTN Storage: Packet saved to %s\n", entry->filename);
+    entry->io_pending++;
+    if (group) {
+        group->ops_pending++;
+    }
     return 1;
 }
 
+static void dtn_storage_index_clear_done(void* arg, int result) {
+    IndexClearOp* op = (IndexClearOp*)arg;
+    if (result != 1) {
+        fprintf(stderr, "DTN Storage: Failed to clear index record %u: %s\n", op->slot, strerror(-result));
+        return;
+    }
+    dtn_storage_index_push_free_slot(op->storage, op->slot);
+}
+
+static void dtn_storage_index_free_slot(Storage_Function* storage, u32_t slot) {
+    if (storage->index_fd < 0) return;
+
+    IndexClearOp* op = malloc(sizeof(IndexClearOp));
+    if (!op) {
+        perror("DTN Storage: Failed to allocate index clear");
+        return;
+    }
+    op->storage = storage;
+    op->slot = slot;
+    op->in_use = 0;
+
+    struct iovec iov = { &op->in_use, 1 };
+    if (dtn_storage_io_writev(storage->io, storage->index_fd, &iov, 1, index_slot_offset(slot),
+                              op, dtn_storage_index_clear_done, op) != 0) {
+        fprintf(stderr, "DTN Storage: Failed to submit index record clear\n");
+        free(op);
+    }
+}
+
+// Drops one completed operation from an entry. The last one clears the index slot the entry
+// gave up meanwhile, and frees the entry if it was deleted meanwhile.
+static void dtn_storage_entry_io_done(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (--entry->io_pending > 0) return;
+
+    if (entry->flags & STORED_ENTRY_SLOT_PENDING) {
+        entry->flags &= ~STORED_ENTRY_SLOT_PENDING;
+        dtn_storage_index_free_slot(storage, entry->index_slot);
+    }
+    if (entry->flags & STORED_ENTRY_ORPHANED) {
+        dtn_storage_entry_release(storage, entry);
+    }
+}
+
+// Appends an entry to its destination and class queue and starts its lifetime, counted from
+// when it was stored. The destination must have been interned with dtn_storage_intern_dest().
+static int dtn_storage_fp_grow(Storage_Function* storage) {
+    u32_t new_count = storage->fp_bucket_count ? storage->fp_bucket_count * 2 : 256;
+    Stored_Packet_Entry** buckets = calloc(new_count, sizeof(Stored_Packet_Entry*));
+    if (!buckets) return 0;
+
+    for (u32_t i = 0; i < storage->fp_bucket_count; i++) {
+        Stored_Packet_Entry* entry = storage->fp_buckets[i];
+        while (entry != NULL) {
+            Stored_Packet_Entry* next = entry->fp_next;
+            Stored_Packet_Entry** bucket = &buckets[entry->fingerprint & (new_count - 1)];
+            entry->fp_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(storage->fp_buckets);
+    storage->fp_buckets = buckets;
+    storage->fp_bucket_count = new_count;
+    return 1;
+}
+
+// Stored entries with a known fingerprint are hashed by it
+static void dtn_storage_fp_insert(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (entry->fingerprint == 0) return;
+    // Grown at a load factor of one, a failed grow keeps the longer chains
+    if (storage->fp_count >= storage->fp_bucket_count && !dtn_storage_fp_grow(storage) &&
+        storage->fp_bucket_count == 0) {
+        perror("DTN Storage: Failed to grow fingerprint table, packet can't be acknowledged in aggregate");
+        return;
+    }
+    Stored_Packet_Entry** bucket = &storage->fp_buckets[entry->fingerprint & (storage->fp_bucket_count - 1)];
+    entry->fp_next = *bucket;
+    *bucket = entry;
+    storage->fp_count++;
+}
+
+static void dtn_storage_fp_remove(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (entry->fingerprint == 0 || storage->fp_bucket_count == 0) return;
+    Stored_Packet_Entry** link = &storage->fp_buckets[entry->fingerprint & (storage->fp_bucket_count - 1)];
+    while (*link != NULL) {
+        if (*link == entry) {
+            *link = entry->fp_next;
+            entry->fp_next = NULL;
+            storage->fp_count--;
+            return;
+        }
+        link = &(*link)->fp_next;
+    }
+}
+
+static void dtn_storage_link_entry(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    Storage_Destination* destination = storage->destinations[entry->dest_index];
+    u8_t class = entry->priority;
+    entry->next = NULL;
+    entry->prev = destination->tail[class];
+    if (destination->tail[class]) {
+        destination->tail[class]->next = entry;
+    } else {
+        destination->head[class] = entry;
+    }
+    destination->tail[class] = entry;
+    if (destination->count++ == 0) {
+        destination->next_active = NULL;
+        destination->prev_active = storage->active_tail;
+        if (storage->active_tail) {
+            storage->active_tail->next_active = destination;
+        } else {
+            storage->active_head = destination;
+        }
+        storage->active_tail = destination;
+    }
+    entry->flags |= STORED_ENTRY_LISTED;
+    storage->stored_packets_count++;
+    storage->stored_bytes += entry->packet_len;
+    dtn_storage_fp_insert(storage, entry);
+
+    dtn_timer_wheel_schedule(&storage->expiry_wheel, &entry->expiry, dtn_storage_entry_time_left(entry, sys_now()));
+}
+
+static void dtn_storage_free_entry(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (entry->p) {
+        pbuf_free(entry->p);
+        entry->p = NULL;
+    }
+    if (entry->io_pending > 0) {
+        entry->flags |= STORED_ENTRY_ORPHANED;
+    } else {
+        dtn_storage_entry_release(storage, entry);
+    }
+}
+
+static void dtn_storage_group_commit_timeout(void* arg) {
+    Storage_Function* storage = (Storage_Function*)arg;
+    if (storage->open_group) {
+        dtn_storage_group_seal(storage->open_group);
+    }
+}
+
+static Storage_Group* dtn_storage_open_group(Storage_Function* storage) {
+    if (storage->open_group) return storage->open_group;
+
+    Storage_Group* group = calloc(1, sizeof(Storage_Group));
+    if (!group) {
+        perror("DTN Storage: Failed to allocate storage group");
+        return NULL;
+    }
+    group->storage = storage;
+    storage->open_group = group;
+
+    // The first packet of a group bounds how long the group may stay unsynced
+    if (storage->sync_mode == STORAGE_SYNC_GROUP) {
+        sys_timeout(storage->group_commit_latency_ms, dtn_storage_group_commit_timeout, storage);
+    }
+    return group;
+}
+
+static int dtn_storage_group_add_file(Storage_Group* group, int fd, Stored_Packet_Entry* entry) {
+    if (group->files_count == group->files_capacity) {
+        size_t new_capacity = group->files_capacity ? group->files_capacity * 2 : 16;
+        Storage_Group_File* files = realloc(group->files, new_capacity * sizeof(Storage_Group_File));
+        if (!files) {
+            perror("DTN Storage: Failed to grow storage group");
+            return 0;
+        }
+        group->files = files;
+        group->files_capacity = new_capacity;
+    }
+    Storage_Group_File* file = &group->files[group->files_count++];
+    file->fd = fd;
+    file->entry = entry;
+    file->file_id = entry->file_id;
+    return 1;
+}
+
+static void dtn_storage_group_submit_sync(Storage_Group* group, int fd, bool datasync) {
+    if (fd < 0) return;
+    if (dtn_storage_io_fsync(group->storage->io, fd, datasync, dtn_storage_group_op_done, group) != 0) {
+        fprintf(stderr, "DTN Storage: Failed to submit sync\n");
+        group->failed = true;
+        return;
+    }
+    group->ops_pending++;
+}
+
+// Drops a packet of a failed group. Its fingerprint is forgotten, so the retransmission
+// from its custodian is stored again instead of being acknowledged as a duplicate.
+static void dtn_storage_drop_failed_entry(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    char name[STORAGE_INDEX_NAME_LEN];
+    dtn_storage_file_name(entry->file_id, name, sizeof(name));
+    fprintf(stderr, "DTN Storage: Dropping %s, it did not reach the disk\n", name);
+
+    dtn_storage_dedup_forget(storage, entry->fingerprint);
+    dtn_storage_unlink_entry(storage, entry);
+    dtn_storage_discard_entry_on_disk(storage, entry);
+    dtn_storage_free_entry(storage, entry);
+}
+
+// Sends the acknowledgements of a durable group and releases it. A failed group takes back its
+// packets instead, their custodians still hold them and retransmit.
+static void dtn_storage_group_finish(Storage_Group* group) {
+    Storage_Function* storage = group->storage;
+
+    for (size_t i = 0; i < group->files_count; i++) {
+        close(group->files[i].fd);
+    }
+    if (storage->last_group == group) {
+        storage->last_group = NULL;
+    }
+
+    if (group->failed) {
+        fprintf(stderr, "DTN Storage: Storage group of %u packets failed, not acknowledging them\n", group->packets);
+        for (size_t i = 0; i < group->files_count; i++) {
+            Stored_Packet_Entry* entry = group->files[i].entry;
+            // Entries already deleted, or reused for another packet, are left alone
+            if ((entry->flags & STORED_ENTRY_LISTED) && entry->file_id == group->files[i].file_id) {
+                dtn_storage_drop_failed_entry(storage, entry);
+            }
+        }
+    }
+
+    Pending_Custody_Ack* ack = group->acks_head;
+    while (ack != NULL) {
+        Pending_Custody_Ack* next = ack->next;
+        if (!group->failed) {
+            dtn_icmpv6_ack_custody(ack->netif, &ack->custodian, ack->fingerprint);
+        }
+        free(ack);
+        ack = next;
+    }
+    free(group->files);
+    free(group);
+}
+
+// Moves a sealed group on once its outstanding operations are done: writes, then syncs, then acknowledgements
+static void dtn_storage_group_advance(Storage_Group* group) {
+    if (!group->sealed || group->ops_pending > 0) return;
+
+    if (!group->syncing && group->storage->sync_mode != STORAGE_SYNC_NONE) {
+        group->syncing = true;
+        // Packet files, their index slots and their directory entries all have to be durable
+        for (size_t i = 0; i < group->files_count; i++) {
+            dtn_storage_group_submit_sync(group, group->files[i].fd, false);
+        }
+        dtn_storage_group_submit_sync(group, group->storage->index_fd, true);
+        dtn_storage_group_submit_sync(group, group->storage->dir_fd, false);
+        if (group->ops_pending > 0) return;
+    }
+    dtn_storage_group_finish(group);
+}
+
+static void dtn_storage_group_seal(Storage_Group* group) {
+    Storage_Function* storage = group->storage;
+    if (storage->open_group == group) {
+        storage->open_group = NULL;
+        sys_untimeout(dtn_storage_group_commit_timeout, storage);
+    }
+    group->sealed = true;
+    dtn_storage_group_advance(group);
+}
+
+static void dtn_storage_group_op_done(void* arg, int result) {
+    Storage_Group* group = (Storage_Group*)arg;
+    if (result < 0) {
+        fprintf(stderr, "DTN Storage: Sync failed: %s\n", strerror(-result));
+        group->failed = true;
+    }
+    group->ops_pending--;
+    dtn_storage_group_advance(group);
+}
+
+// One packet file write, the file header and patched IPv6 header go out ahead of the pbuf chain
+typedef struct {
+    Storage_Function* storage;
+    Storage_Group* group;
+    Stored_Packet_Entry* entry;
+    struct pbuf* p;                 // referenced until the write completes
+    PacketFileHeader header;
+    u8_t ip6_header[IP6_HLEN];
+} PacketWriteOp;
+
+static void dtn_storage_packet_write_done(void* arg, int result) {
+    PacketWriteOp* op = (PacketWriteOp*)arg;
+    Stored_Packet_Entry* entry = op->entry;
+    Storage_Group* group = op->group;
+
+    pbuf_free(op->p);
+
+    char name[STORAGE_INDEX_NAME_LEN];
+    dtn_storage_file_name(entry->file_id, name, sizeof(name));
+    if (result != (int)(sizeof(PacketFileHeader) + entry->packet_len)) {
+        fprintf(stderr, "DTN Storage: Failed to write packet file %s: %s\n", name,
+                result < 0 ? strerror(-result) : "short write");
+        group->failed = true;
+    } else if (!(entry->flags & STORED_ENTRY_ORPHANED)) {
+        printf("DTN Storage: Packet saved to %s\n", name);
+    }
+
+    entry->flags &= ~STORED_ENTRY_WRITING;
+    dtn_storage_entry_io_done(op->storage, entry);
+
+    group->ops_pending--;
+    dtn_storage_group_advance(group);
+}
+
+// Fills iov with the pbuf chain from offset on, returns the number of entries used or -1 if it doesn't fit
+static int dtn_storage_chain_iov(struct pbuf* p, u16_t offset, struct iovec* iov, int max_iov) {
+    int count = 0;
+    for (struct pbuf* q = p; q != NULL; q = q->next) {
+        if (offset >= q->len) {
+            offset -= q->len;
+            continue;
+        }
+        if (count == max_iov) return -1;
+        iov[count].iov_base = (u8_t*)q->payload + offset;
+        iov[count].iov_len = q->len - offset;
+        count++;
+        offset = 0;
+    }
+    return count;
+}
+
+// Queues the packet file write for an entry in the open storage group, returning that group.
+// The file is written straight from p, with ip6_header in place of p's own IPv6 header and
+// skipping strip_len bytes after it.
+static Storage_Group* dtn_storage_write_packet_file(Storage_Function* storage, Stored_Packet_Entry* entry,
+                                                   struct pbuf* p, const u8_t* ip6_header, u16_t strip_len) {
+    Storage_Group* group = dtn_storage_open_group(storage);
+    if (!group) return NULL;
+
+    PacketWriteOp* op = malloc(sizeof(PacketWriteOp));
+    if (!op) {
+        perror("DTN Storage: Failed to allocate packet write");
+        return NULL;
+    }
+    op->storage = storage;
+    op->group = group;
+    op->entry = entry;
+    op->p = p;
+    memcpy(op->header.magic, "DTNP", 4);
+    op->header.version = STORAGE_FILE_VERSION;
+    op->header.stored_at = dtn_storage_wall_time(entry);
+    op->header.packet_len = entry->packet_len;
+    memcpy(&op->header.original_dest, dtn_storage_entry_dest(storage, entry), sizeof(ip6_addr_t));
+    memcpy(op->ip6_header, ip6_header, IP6_HLEN);
+
+    struct iovec iov[STORAGE_IO_MAX_IOV];
+    iov[0].iov_base = &op->header;
+    iov[0].iov_len = sizeof(PacketFileHeader);
+    iov[1].iov_base = op->ip6_header;
+    iov[1].iov_len = IP6_HLEN;
+    int iovcnt = dtn_storage_chain_iov(p, IP6_HLEN + strip_len, &iov[2], STORAGE_IO_MAX_IOV - 2);
+    if (iovcnt < 0) {
+        fprintf(stderr, "DTN Storage: Packet has too many segments to write\n");
+        free(op);
+        return NULL;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    dtn_storage_entry_path(storage, entry, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("DTN Storage: Failed to open file for writing");
+        free(op);
+        return NULL;
+    }
+    if (!dtn_storage_group_add_file(group, fd, entry)) {
+        close(fd);
+        free(op);
+        return NULL;
+    }
+
+    // The fd stays in the group, which closes it once the group is durable
+    pbuf_ref(p);
+    if (dtn_storage_io_writev(storage->io, fd, iov, iovcnt + 2, 0, op, dtn_storage_packet_write_done, op) != 0) {
+        fprintf(stderr, "DTN Storage: Failed to submit packet write\n");
+        pbuf_free(p);
+        free(op);
+        return NULL;
+    }
+    entry->flags |= STORED_ENTRY_WRITING;
+    entry->io_pending++;
+    group->ops_pending++;
+    return group;
+}
+
+// Makes every packet stored so far durable and sends the acknowledgements that waited for it.
+// Blocks until the disk has caught up; the packet path relies on the main loop instead.
+int dtn_storage_sync(Storage_Function* storage) {
+    if (!storage) return 0;
+
+    if (storage->open_group) {
+        dtn_storage_group_seal(storage->open_group);
+    }
+    dtn_storage_io_wait_idle(storage->io);
+    return 1;
+}
+
+void dtn_storage_set_sync_mode(Storage_Function* storage, Storage_Sync_Mode mode, u32_t group_packets, u32_t group_latency_ms) {
+    if (!storage) return;
+
+    // Whatever was written under the previous mode is settled first
+    dtn_storage_sync(storage);
+    storage->sync_mode = mode;
+    storage->group_commit_packets = group_packets > 0 ? group_packets : 1;
+    storage->group_commit_latency_ms = group_latency_ms;
+}
+
+// Acknowledges custody of a packet that was just stored, or a duplicate of one, once that packet is durable.
+// The packet itself is not kept, its custodian and fingerprint name it in the acknowledgement.
+void dtn_storage_ack_when_durable(Storage_Function* storage, const DTN_Packet_Info* info, struct netif* netif) {
+    if (!storage || !info) return;
+
+    Storage_Group* group = storage->last_group;
+    Pending_Custody_Ack* ack = group ? malloc(sizeof(Pending_Custody_Ack)) : NULL;
+    if (!ack) {
+        if (group) {
+            perror("DTN Storage: Failed to allocate pending acknowledgement");
+        }
+        dtn_icmpv6_ack_custody(netif, &info->custodian, info->fingerprint);
+        return;
+    }
+    ack->custodian = info->custodian;
+    ack->fingerprint = info->fingerprint;
+    ack->netif = netif;
+    ack->next = NULL;
+    if (group->acks_tail) {
+        group->acks_tail->next = ack;
+    } else {
+        group->acks_head = ack;
+    }
+    group->acks_tail = ack;
+}
+
+static void dtn_storage_unlink_done(void* arg, int result) {
+    LWIP_UNUSED_ARG(arg);
+    // A file lost in a crash is already gone
+    if (result < 0 && result != -ENOENT) {
+        fprintf(stderr, "DTN Storage: Failed to remove packet file: %s\n", strerror(-result));
+    }
+}
+
 int dtn_storage_remove_packet_from_disk(Storage_Function* storage, const char* filename) {
     if (!storage || !filename) return 0;
     
-    if (remove(filename) != 0) {
-        perror("DTN Storage: Failed to remove packet file");
+    if (dtn_storage_io_unlink(storage->io, filename, dtn_storage_unlink_done, NULL) != 0) {
+        fprintf(stderr, "DTN Storage: Failed to submit removal of %s\n", filename);
         return 0;
     }
     
-    printf("DTN Storage: Removed packet file %s\n", filename);
+    printf("DTN Storage: Removing packet file %s\n", filename);
     return 1;
 }
 
-static Stored_Packet_Entry* dtn_storage_load_packet_from_file(Storage_Function* storage, const char* filename) {
-    if (!storage || !filename) return NULL;
-    
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        perror("DTN Storage: Failed to open packet file for reading");
-        return NULL;
+// Drops both the index slot and the packet file of an entry. While the entry's own I/O is in flight
+// the slot is left alone, its clear must not race the record write it would undo.
+static void dtn_storage_discard_entry_on_disk(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    char path[MAX_PATH_LENGTH];
+    if (entry->io_pending > 0) {
+        entry->flags |= STORED_ENTRY_SLOT_PENDING;
+    } else {
+        dtn_storage_index_free_slot(storage, entry->index_slot);
+    }
+    if (dtn_storage_entry_path(storage, entry, path, sizeof(path))) {
+        dtn_storage_remove_packet_from_disk(storage, path);
+    }
+}
+
+// Allocates the pbuf a stored packet is read into, from the pool when its chain fits the iovec limit.
+// iov is filled with the pbuf's segments. The headroom takes the custody option when it is forwarded.
+static struct pbuf* dtn_storage_alloc_read_pbuf(u32_t packet_len, struct iovec* iov, int* iovcnt) {
+    if (packet_len == 0 || packet_len > 0xFFFF) return NULL;
+
+    struct pbuf* p = pbuf_alloc(DTN_CUSTODY_HEADROOM, (u16_t)packet_len, PBUF_POOL);
+    if (p) {
+        *iovcnt = dtn_storage_chain_iov(p, 0, iov, STORAGE_IO_MAX_IOV);
+        if (*iovcnt > 0) return p;
+        pbuf_free(p);
+    }
+
+    p = pbuf_alloc(DTN_CUSTODY_HEADROOM, (u16_t)packet_len, PBUF_RAM);
+    if (!p) return NULL;
+    *iovcnt = dtn_storage_chain_iov(p, 0, iov, STORAGE_IO_MAX_IOV);
+    return p;
+}
+
+static void dtn_storage_unlink_entry(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (!(entry->flags & STORED_ENTRY_LISTED)) return;
+
+    Storage_Destination* destination = storage->destinations[entry->dest_index];
+    u8_t class = entry->priority;
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        destination->head[class] = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        destination->tail[class] = entry->prev;
+    }
+    if (--destination->count == 0) {
+        if (destination->prev_active) {
+            destination->prev_active->next_active = destination->next_active;
+        } else {
+            storage->active_head = destination->next_active;
+        }
+        if (destination->next_active) {
+            destination->next_active->prev_active = destination->prev_active;
+        } else {
+            storage->active_tail = destination->prev_active;
+        }
+        destination->next_active = NULL;
+        destination->prev_active = NULL;
+    }
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->flags &= ~STORED_ENTRY_LISTED;
+    dtn_timer_wheel_cancel(&storage->expiry_wheel, &entry->expiry);
+    storage->stored_packets_count--;
+    storage->stored_bytes -= entry->packet_len;
+    dtn_storage_fp_remove(storage, entry);
+}
+
+// Walks every stored packet: destination by destination, higher classes first, oldest first
+Stored_Packet_Entry* dtn_storage_first_entry(const Storage_Function* storage) {
+    if (!storage) return NULL;
+    for (const Storage_Destination* destination = storage->active_head; destination; destination = destination->next_active) {
+        for (int class = STORAGE_CLASS_COUNT - 1; class >= 0; class--) {
+            if (destination->head[class]) return destination->head[class];
+        }
+    }
+    return NULL;
+}
+
+// The packet a destination is served first: the oldest one of its highest class
+static Stored_Packet_Entry* dtn_storage_first_for_dest(const Storage_Function* storage, const ip6_addr_t* target_dest) {
+    const Storage_Destination* destination = dtn_storage_destination_for(storage, target_dest);
+    if (!destination) return NULL;
+    for (int class = STORAGE_CLASS_COUNT - 1; class >= 0; class--) {
+        if (destination->head[class]) return destination->head[class];
+    }
+    return NULL;
+}
+
+// Next packet for the same destination, in the same order
+static Stored_Packet_Entry* dtn_storage_next_for_dest(const Storage_Function* storage, const Stored_Packet_Entry* entry) {
+    if (entry->next) return entry->next;
+
+    const Storage_Destination* destination = storage->destinations[entry->dest_index];
+    for (int class = entry->priority - 1; class >= 0; class--) {
+        if (destination->head[class]) return destination->head[class];
+    }
+    return NULL;
+}
+
+Stored_Packet_Entry* dtn_storage_next_entry(const Storage_Function* storage, const Stored_Packet_Entry* entry) {
+    if (!storage || !entry) return NULL;
+    Stored_Packet_Entry* next = dtn_storage_next_for_dest(storage, entry);
+    if (next) return next;
+
+    const Storage_Destination* destination = storage->destinations[entry->dest_index];
+    for (destination = destination->next_active; destination; destination = destination->next_active) {
+        for (int class = STORAGE_CLASS_COUNT - 1; class >= 0; class--) {
+            if (destination->head[class]) return destination->head[class];
+        }
+    }
+    return NULL;
+}
+
+const ip6_addr_t* dtn_storage_destination_addr(const Storage_Function* storage, const Storage_Destination* destination) {
+    return &storage->addrs[destination->dest_index];
+}
+
+static const u8_t storage_class_weights[STORAGE_CLASS_COUNT] = {
+    STORAGE_WEIGHT_BULK, STORAGE_WEIGHT_NORMAL, STORAGE_WEIGHT_EXPEDITED
+};
+
+// Picks the packet a destination should send next. Strict draining always takes the highest
+// non-empty class; weighted draining gives each class its weight in turns per round, higher
+// classes first, and starts a new round once every waiting class has used its turns.
+Stored_Packet_Entry* dtn_storage_drain_next(Storage_Function* storage, Storage_Destination* destination) {
+    if (!storage || !destination || destination->count == 0) return NULL;
+
+    if (storage->drain_policy == STORAGE_DRAIN_WEIGHTED) {
+        for (int round = 0; round < 2; round++) {
+            for (int class = STORAGE_CLASS_COUNT - 1; class >= 0; class--) {
+                if (destination->head[class] && destination->credits[class] > 0) {
+                    destination->credits[class]--;
+                    return destination->head[class];
+                }
+            }
+            memcpy(destination->credits, storage_class_weights, sizeof(destination->credits));
+        }
+    }
+
+    for (int class = STORAGE_CLASS_COUNT - 1; class >= 0; class--) {
+        if (destination->head[class]) return destination->head[class];
+    }
+    return NULL;
+}
+
+void dtn_storage_set_drain_policy(Storage_Function* storage, Storage_Drain_Policy policy) {
+    if (!storage) return;
+    storage->drain_policy = policy;
+}
+
+// Reports an expired packet upstream with DTN-PCK-DELETED. The report quotes the IPv6 header and
+// the first 8 bytes after it, which the entry keeps, so the packet file is not read back.
+static void dtn_storage_report_expired(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (!netif_default) return;
+
+    struct pbuf* quote = pbuf_alloc(PBUF_RAW, IP6_HLEN + sizeof(entry->payload_head), PBUF_RAM);
+    if (!quote) {
+        fprintf(stderr, "DTN Storage: Failed to allocate pbuf for lifetime expiry report\n");
+        return;
+    }
+    dtn_storage_entry_header(storage, entry, (struct ip6_hdr*)quote->payload);
+    memcpy((u8_t*)quote->payload + IP6_HLEN, entry->payload_head, sizeof(entry->payload_head));
+
+    dtn_icmpv6_send_pck_deleted(netif_default, quote, ICMP6_CODE_DTN_LIFETIME_EXP, 0);
+    pbuf_free(quote);
+}
+
+static void dtn_storage_expire_entry(DTN_Timer_Wheel* wheel, DTN_Timer* timer, void* arg) {
+    LWIP_UNUSED_ARG(wheel);
+    Storage_Function* storage = (Storage_Function*)arg;
+    Stored_Packet_Entry* entry = (Stored_Packet_Entry*)((u8_t*)timer - offsetof(Stored_Packet_Entry, expiry));
+
+    char addr_str[IP6ADDR_STRLEN_MAX];
+    ip6addr_ntoa_r(dtn_storage_entry_dest(storage, entry), addr_str, sizeof(addr_str));
+    printf("DTN Storage: Lifetime of packet for %s (stored at %u) expired, deleting it\n",
+           addr_str, entry->stored_time_ms);
+
+    dtn_storage_report_expired(storage, entry);
+    dtn_storage_unlink_entry(storage, entry);
+    dtn_storage_discard_entry_on_disk(storage, entry);
+    dtn_storage_free_entry(storage, entry);
+}
+
+// Packets recovered without a fingerprint (older files) get one once read back
+static void dtn_storage_entry_note_fingerprint(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    DTN_Packet_Info info;
+    if (entry->fingerprint == 0 && dtn_packet_parse_headers(entry->p, &info)) {
+        entry->fingerprint = dtn_packet_fingerprint(entry->p, &info);
+        if (entry->flags & STORED_ENTRY_LISTED) {
+            dtn_storage_fp_insert(storage, entry);
+        }
+    }
+}
+
+static bool dtn_storage_start_read(Storage_Function* storage, Stored_Packet_Entry* entry);
+
+// Returns the packet of an entry if it is resident. Otherwise a read from disk is started, the main
+// loop is never blocked on it, and NULL is returned; the packet stays resident once the read completes.
+// NULL is also returned while the entry's file is still being written.
+struct pbuf* dtn_storage_entry_pbuf(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (!storage || !entry) return NULL;
+    if (entry->p) return entry->p;
+    if (!(entry->flags & (STORED_ENTRY_READING | STORED_ENTRY_WRITING))) {
+        dtn_storage_start_read(storage, entry);
+    }
+    return NULL;
+}
+
+// Drops the in-memory copy of a stored packet, it will be read back from disk when needed
+void dtn_storage_entry_release_pbuf(Stored_Packet_Entry* entry) {
+    // Until its write completes the packet is not on disk yet
+    if (entry && entry->p && !(entry->flags & STORED_ENTRY_WRITING)) {
+        pbuf_free(entry->p);
+        entry->p = NULL;
+    }
+}
+
+// Packet files are only checked when they are read back, which is where a file lost or cut short
+// by a crash shows up
+static void dtn_storage_drop_unreadable_entry(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    char name[STORAGE_INDEX_NAME_LEN];
+    dtn_storage_file_name(entry->file_id, name, sizeof(name));
+    fprintf(stderr, "DTN Storage: Dropping unreadable stored packet %s\n", name);
+    dtn_storage_unlink_entry(storage, entry);
+    dtn_storage_discard_entry_on_disk(storage, entry);
+    dtn_storage_free_entry(storage, entry);
+}
+
+typedef struct {
+    Storage_Function* storage;
+    Stored_Packet_Entry* entry;
+    struct pbuf* p;
+    int fd;
+} PacketReadOp;
+
+static void dtn_storage_packet_read_done(void* arg, int result) {
+    PacketReadOp* op = (PacketReadOp*)arg;
+    Storage_Function* storage = op->storage;
+    Stored_Packet_Entry* entry = op->entry;
+
+    close(op->fd);
+    bool forward = entry->flags & STORED_ENTRY_FORWARD;
+    entry->flags &= ~(STORED_ENTRY_READING | STORED_ENTRY_FORWARD);
+
+    if (entry->flags & STORED_ENTRY_ORPHANED) {
+        pbuf_free(op->p);
+        free(op);
+        dtn_storage_entry_io_done(storage, entry);
+        return;
+    }
+    dtn_storage_entry_io_done(storage, entry);
+
+    if (result != (int)entry->packet_len) {
+        pbuf_free(op->p);
+        free(op);
+        dtn_storage_drop_unreadable_entry(storage, entry);
+        return;
+    }
+
+    entry->p = op->p;
+    dtn_storage_entry_note_fingerprint(storage, entry);
+    free(op);
+
+    if (forward && !storage->closing && storage->parent_module && storage->parent_module->controller) {
+        dtn_controller_forward_stored_entry(storage->parent_module->controller, entry);
+    }
+}
+
+// Submits the read of a stored packet file, the packet becomes resident when it completes
+static bool dtn_storage_start_read(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    PacketReadOp* op = malloc(sizeof(PacketReadOp));
+    if (!op) {
+        perror("DTN Storage: Failed to allocate packet read");
+        return false;
+    }
+    op->storage = storage;
+    op->entry = entry;
+    char path[MAX_PATH_LENGTH];
+    struct iovec iov[STORAGE_IO_MAX_IOV];
+    int iovcnt = 0;
+    dtn_storage_entry_path(storage, entry, path, sizeof(path));
+    op->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (op->fd < 0 && errno == ENOENT) {
+        free(op);
+        dtn_storage_drop_unreadable_entry(storage, entry);
+        return false;
+    }
+    op->p = dtn_storage_alloc_read_pbuf(entry->packet_len, iov, &iovcnt);
+    if (op->fd < 0 || !op->p) {
+        if (op->fd < 0) {
+            perror("DTN Storage: Failed to open packet file for reading");
+        } else {
+            close(op->fd);
+        }
+        if (op->p) {
+            pbuf_free(op->p);
+        } else {
+            fprintf(stderr, "DTN Storage: Failed to allocate pbuf for loaded packet\n");
+        }
+        free(op);
+        return false;
+    }
+
+    if (dtn_storage_io_readv(storage->io, op->fd, iov, iovcnt, sizeof(PacketFileHeader),
+                             dtn_storage_packet_read_done, op) != 0) {
+        fprintf(stderr, "DTN Storage: Failed to submit packet read\n");
+        close(op->fd);
+        pbuf_free(op->p);
+        free(op);
+        return false;
+    }
+    entry->flags |= STORED_ENTRY_READING;
+    entry->io_pending++;
+    return true;
+}
+
+// Starts reading a stored packet back from disk without waiting for it. Once it is resident
+// the controller is handed the entry to forward.
+void dtn_storage_prefetch_entry(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    // A packet still being written is picked up on a later attempt
+    if (!storage || !entry || entry->p || (entry->flags & STORED_ENTRY_WRITING)) return;
+
+    // A read already in flight forwards the entry too once it completes
+    if ((entry->flags & STORED_ENTRY_READING) || dtn_storage_start_read(storage, entry)) {
+        entry->flags |= STORED_ENTRY_FORWARD;
+    }
+}
+
+int dtn_storage_completion_fd(Storage_Function* storage) {
+    return storage ? dtn_storage_io_fd(storage->io) : -1;
+}
+
+void dtn_storage_process_completions(Storage_Function* storage) {
+    if (storage) {
+        dtn_storage_io_poll(storage->io);
+    }
+}
+
+// Builds the entry for a packet file found on disk. Files still named after the packet's destination
+// and time are renamed to a fresh file id; renamed is set so the caller can update the index.
+// Callers note every existing file name first so fresh ids don't collide.
+static Stored_Packet_Entry* dtn_storage_new_recovered_entry(Storage_Function* storage, const char* name,
+                                                            u32_t stored_at, u32_t packet_len,
+                                                            const ip6_addr_t* original_dest,
+                                                            const u8_t* header_snapshot, bool* renamed) {
+    *renamed = false;
+    if (packet_len < IP6_HLEN || packet_len > 0xFFFF) {
+        fprintf(stderr, "DTN Storage: Invalid packet length in %s, skipping\n", name);
+        return NULL;
+    }
+
+    Stored_Packet_Entry* entry = dtn_storage_entry_alloc(storage);
+    if (!entry) {
+        return NULL;
+    }
+    
+    if (!dtn_storage_entry_intern(storage, entry, original_dest, header_snapshot)) {
+        dtn_storage_entry_release(storage, entry);
+        return NULL;
+    }
+    entry->stored_time_ms = dtn_storage_local_time(stored_at);
+    entry->packet_len = (u16_t)packet_len;
+
+    if (!dtn_storage_parse_file_name(name, &entry->file_id)) {
+        char old_path[MAX_PATH_LENGTH];
+        char new_path[MAX_PATH_LENGTH];
+        entry->file_id = storage->next_file_id++;
+        dtn_storage_entry_path(storage, entry, new_path, sizeof(new_path));
+        if (snprintf(old_path, sizeof(old_path), "%s/%s", storage->storage_directory, name) >= (int)sizeof(old_path) ||
+            rename(old_path, new_path) != 0) {
+            fprintf(stderr, "DTN Storage: Failed to rename %s, skipping\n", name);
+            dtn_storage_entry_release(storage, entry);
+            return NULL;
+        }
+        *renamed = true;
+    }
+    return entry;
+}
+
+static int compare_entries_by_time(const void* a, const void* b) {
+    const Stored_Packet_Entry* ea = *(Stored_Packet_Entry* const*)a;
+    const Stored_Packet_Entry* eb = *(Stored_Packet_Entry* const*)b;
+    // Recovered times may lie before sys_now() started, so their ages are compared
+    u32_t now = sys_now();
+    u32_t age_a = now - ea->stored_time_ms;
+    u32_t age_b = now - eb->stored_time_ms;
+    if (age_a != age_b) return age_a > age_b ? -1 : 1;
+    // Wall-clock seconds tie often, file ids are handed out in storing order
+    if (ea->file_id < eb->file_id) return -1;
+    if (ea->file_id > eb->file_id) return 1;
+    return 0;
+}
+
+// Links recovered entries into the storage list in the order they were stored
+static void dtn_storage_link_recovered(Storage_Function* storage, Stored_Packet_Entry** entries, size_t count) {
+    qsort(entries, count, sizeof(Stored_Packet_Entry*), compare_entries_by_time);
+
+    for (size_t i = 0; i < count; i++) {
+        dtn_storage_link_entry(storage, entries[i]);
     }
-    
-    PacketFileHeader header;
-    if (fread(&header, sizeof(header), 1, file) != 1) {
-        perror("DTN Storage: Failed to read packet header");
-        fclose(file);
-        return NULL;
+}
+
+// Rebuilds the packet list from the index without touching the packet files. A file that is missing
+// or shorter than its record is found when the packet is first read back, and its entry dropped then.
+static int dtn_storage_load_from_index(Storage_Function* storage) {
+    struct stat st;
+    if (fstat(storage->index_fd, &st) != 0) {
+        perror("DTN Storage: Failed to stat index file");
+        return -1;
     }
-    
-    if (memcmp(header.magic, "DTNP", 4) != 0) {
-        fprintf(stderr, "DTN Storage: Invalid packet file format\n");
-        fclose(file);
-        return NULL;
+
+    size_t slot_count = 0;
+    if ((size_t)st.st_size > sizeof(IndexFileHeader)) {
+        slot_count = ((size_t)st.st_size - sizeof(IndexFileHeader)) / sizeof(IndexRecord);
     }
-    
-    char* buffer = malloc(header.packet_len);
-    if (!buffer) {
-        perror("DTN Storage: Failed to allocate buffer for packet data");
-        fclose(file);
-        return NULL;
+
+    IndexRecord* records = NULL;
+    Stored_Packet_Entry** entries = NULL;
+    if (slot_count > 0) {
+        records = malloc(slot_count * sizeof(IndexRecord));
+        entries = malloc(slot_count * sizeof(Stored_Packet_Entry*));
+        if (!records || !entries) {
+            perror("DTN Storage: Failed to allocate memory for index");
+            free(records);
+            free(entries);
+            return -1;
+        }
+
+        size_t want = slot_count * sizeof(IndexRecord);
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(storage->index_fd, (u8_t*)records + got, want - got, index_slot_offset(0) + got);
+            if (n <= 0) break;
+            got += n;
+        }
+        // A torn trailing record from a crash is treated as free
+        slot_count = got / sizeof(IndexRecord);
     }
-    
-    if (fread(buffer, 1, header.packet_len, file) != header.packet_len) {
-        perror("DTN Storage: Failed to read packet data");
-        free(buffer);
-        fclose(file);
-        return NULL;
+
+    for (u32_t slot = 0; slot < slot_count; slot++) {
+        records[slot].name[STORAGE_INDEX_NAME_LEN - 1] = '\0';
+        if (records[slot].in_use) {
+            dtn_storage_note_file_name(storage, records[slot].name);
+        }
     }
-    
-    fclose(file);
-    
-    struct pbuf* p = pbuf_alloc(PBUF_RAW, header.packet_len, PBUF_RAM);
-    if (!p) {
-        perror("DTN Storage: Failed to allocate pbuf for loaded packet");
-        free(buffer);
-        return NULL;
+
+    size_t count = 0;
+    for (u32_t slot = 0; slot < slot_count; slot++) {
+        IndexRecord* record = &records[slot];
+        Stored_Packet_Entry* entry = NULL;
+        bool renamed = false;
+        if (record->in_use) {
+            entry = dtn_storage_new_recovered_entry(storage, record->name, record->stored_at, record->packet_len,
+                                                    &record->original_dest, record->header_snapshot, &renamed);
+        }
+        if (entry) {
+            entry->fingerprint = record->fingerprint;
+            entry->index_slot = slot;
+            if (renamed) {
+                dtn_storage_index_write(storage, entry, record->header_snapshot, NULL);
+            }
+            entries[count++] = entry;
+        } else {
+            dtn_storage_index_push_free_slot(storage, slot);
+        }
     }
-    
-    if (pbuf_take(p, buffer, header.packet_len) != ERR_OK) {
-        perror("DTN Storage: Failed to copy data to pbuf");
-        pbuf_free(p);
-        free(buffer);
+    storage->index_slot_count = slot_count;
+
+    dtn_storage_link_recovered(storage, entries, count);
+    free(records);
+    free(entries);
+
+    printf("DTN Storage: Recovered %zu packets from index\n", count);
+    return (int)count;
+}
+
+// Fingerprint of a packet read whole into memory, 0 if it doesn't parse
+static uint64_t dtn_storage_buffer_fingerprint(u8_t* data, u16_t len) {
+    struct pbuf p;
+    memset(&p, 0, sizeof(p));
+    p.payload = data;
+    p.len = len;
+    p.tot_len = len;
+    DTN_Packet_Info info;
+    return dtn_packet_parse_headers(&p, &info) ? dtn_packet_fingerprint(&p, &info) : 0;
+}
+
+static void* dtn_storage_scan_worker(void* arg) {
+    ScanJob* job = (ScanJob*)arg;
+
+    // Files are read whole, the fingerprint that names a packet in acknowledgements covers all of it
+    u8_t* buf = malloc(sizeof(PacketFileHeader) + 0xFFFF);
+    if (!buf) {
+        perror("DTN Storage: Failed to allocate scan buffer");
+        for (size_t i = job->first; i < job->count; i += job->stride) {
+            job->results[i].valid = false;
+        }
         return NULL;
     }
-    
-    free(buffer);
-    
-    Stored_Packet_Entry* entry = malloc(sizeof(Stored_Packet_Entry));
-    if (!entry) {
-        perror("DTN Storage: Failed to allocate memory for packet entry");
-        pbuf_free(p);
-        return NULL;
+
+    for (size_t i = job->first; i < job->count; i += job->stride) {
+        ScanResult* result = &job->results[i];
+        result->valid = false;
+
+        char full_path[PATH_MAX];
+        if (snprintf(full_path, sizeof(full_path), "%s/%s", job->directory, job->names[i]) >= (int)sizeof(full_path)) {
+            continue;
+        }
+
+        int fd = open(full_path, O_RDONLY);
+        if (fd < 0) continue;
+
+        ssize_t n = pread(fd, buf, sizeof(PacketFileHeader) + 0xFFFF, 0);
+        close(fd);
+        if (n < (ssize_t)sizeof(PacketFileHeader)) continue;
+
+        memcpy(&result->header, buf, sizeof(PacketFileHeader));
+        if (memcmp(result->header.magic, "DTNP", 4) != 0) continue;
+
+        size_t payload_len = (size_t)n - sizeof(PacketFileHeader);
+        memset(result->header_snapshot, 0, STORAGE_SNAPSHOT_LEN);
+        memcpy(result->header_snapshot, buf + sizeof(PacketFileHeader),
+               payload_len < STORAGE_SNAPSHOT_LEN ? payload_len : STORAGE_SNAPSHOT_LEN);
+        result->fingerprint = 0;
+        if (result->header.packet_len <= 0xFFFF && payload_len >= result->header.packet_len) {
+            result->fingerprint = dtn_storage_buffer_fingerprint(buf + sizeof(PacketFileHeader),
+                                                                 (u16_t)result->header.packet_len);
+        }
+        result->valid = true;
     }
-    
-    entry->p = p;
-    memcpy(&entry->original_dest, &header.original_dest, sizeof(ip6_addr_t));
-    entry->stored_time_ms = header.timestamp;
-    entry->next = NULL;
-    
-    strncpy(entry->filename, filename, MAX_PATH_LENGTH-1);
-    entry->filename[MAX_PATH_LENGTH-1] = '\0';
-    
-    char addr_str[IP6ADDR_STRLEN_MAX];
-    ip6addr_ntoa_r(&entry->original_dest, addr_str, sizeof(addr_str));
-    printf("DTN Storage: Loaded packet for %s from %s\n", addr_str, filename);
-    
-    return entry;
+    free(buf);
+    return NULL;
 }
 
-int dtn_storage_load_packets_from_disk(Storage_Function* storage) {
-    if (!storage) return 0;
-    
+// Fallback when there is no usable index: reads the packet files, spread over several threads
+static int dtn_storage_scan_directory(Storage_Function* storage) {
     DIR* dir = opendir(storage->storage_directory);
     if (!dir) {
         perror("DTN Storage: Failed to open storage directory");
-        return 0;
+        return -1;
     }
     
-    int loaded_count = 0;
-    struct dirent* entry;
+    size_t count = 0;
+    size_t capacity = 0;
+    char (*names)[STORAGE_INDEX_NAME_LEN] = NULL;
+    struct dirent* dirent;
     
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        char* ext = strrchr(entry->d_name, '.');
+    while ((dirent = readdir(dir)) != NULL) {
+        char* ext = strrchr(dirent->d_name, '.');
         if (!ext || strcmp(ext, ".dat") != 0) {
             continue;
         }
-        
-        char full_path[PATH_MAX]; 
-        
-        if (strlen(storage->storage_directory) + strlen(entry->d_name) + 2 > sizeof(full_path)) {
-            fprintf(stderr, "DTN Storage: Path too long for file %s, skipping\n", entry->d_name);
+        if (strlen(dirent->d_name) >= STORAGE_INDEX_NAME_LEN) {
+            fprintf(stderr, "DTN Storage: File name too long %s, skipping\n", dirent->d_name);
             continue;
         }
-        
-        strcpy(full_path, storage->storage_directory);
-        strcat(full_path, "/");
-        strcat(full_path, entry->d_name);
-        
-        Stored_Packet_Entry* packet_entry = dtn_storage_load_packet_from_file(storage, full_path);
-        if (packet_entry) {
-            if (storage->packet_list_head == NULL) {
-                storage->packet_list_head = packet_entry;
-            } else {
-                Stored_Packet_Entry* current = storage->packet_list_head;
-                while (current->next != NULL) {
-                    current = current->next;
-                }
-                current->next = packet_entry;
-            }
-            
-            storage->stored_packets_count++;
-            loaded_count++;
-            
-            if (storage->stored_packets_count >= MAX_STORED_PACKETS) {
-                printf("DTN Storage: Maximum packet count reached, stopping load\n");
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 256;
+            void* grown = realloc(names, new_capacity * sizeof(*names));
+            if (!grown) {
+                perror("DTN Storage: Failed to allocate memory for directory scan");
                 break;
             }
+            names = grown;
+            capacity = new_capacity;
         }
+        strcpy(names[count++], dirent->d_name);
     }
-    
     closedir(dir);
+
+    ScanResult* results = count ? calloc(count, sizeof(ScanResult)) : NULL;
+    Stored_Packet_Entry** entries = count ? malloc(count * sizeof(Stored_Packet_Entry*)) : NULL;
+    if (count && (!results || !entries)) {
+        perror("DTN Storage: Failed to allocate memory for directory scan");
+        free(names);
+        free(results);
+        free(entries);
+        return -1;
+    }
+
+    pthread_t threads[STORAGE_SCAN_THREADS];
+    ScanJob jobs[STORAGE_SCAN_THREADS];
+    size_t nthreads = count < STORAGE_SCAN_THREADS ? count : STORAGE_SCAN_THREADS;
+    bool started[STORAGE_SCAN_THREADS] = {false};
+
+    for (size_t t = 0; t < nthreads; t++) {
+        jobs[t] = (ScanJob){ storage->storage_directory, names, results, count, t, nthreads };
+        started[t] = pthread_create(&threads[t], NULL, dtn_storage_scan_worker, &jobs[t]) == 0;
+        if (!started[t]) {
+            dtn_storage_scan_worker(&jobs[t]);
+        }
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        dtn_storage_note_file_name(storage, names[i]);
+    }
+
+    size_t loaded = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!results[i].valid) {
+            fprintf(stderr, "DTN Storage: Invalid packet file %s, skipping\n", names[i]);
+            continue;
+        }
+        // Older files carry a process-local time, which means nothing after a restart
+        u32_t stored_at = results[i].header.stored_at;
+        if (results[i].header.version < STORAGE_FILE_VERSION) {
+            stored_at = (u32_t)time(NULL);
+        }
+        bool renamed;
+        Stored_Packet_Entry* entry = dtn_storage_new_recovered_entry(storage, names[i], stored_at,
+                                                                     results[i].header.packet_len,
+                                                                     &results[i].header.original_dest,
+                                                                     results[i].header_snapshot, &renamed);
+        if (!entry) continue;
+
+        entry->fingerprint = results[i].fingerprint;
+        entry->index_slot = dtn_storage_index_alloc_slot(storage);
+        dtn_storage_index_write(storage, entry, results[i].header_snapshot, NULL);
+        entries[loaded++] = entry;
+    }
+
+    dtn_storage_link_recovered(storage, entries, loaded);
+    free(names);
+    free(results);
+    free(entries);
+
+    printf("DTN Storage: Recovered %zu packets by scanning %s\n", loaded, storage->storage_directory);
+    return (int)loaded;
+}
+
+int dtn_storage_load_packets_from_disk(Storage_Function* storage) {
+    if (!storage) return 0;
+    
+    int index_state = dtn_storage_index_open(storage);
+    int loaded_count = -1;
+    if (index_state == 1) {
+        loaded_count = dtn_storage_load_from_index(storage);
+    }
+    if (loaded_count < 0) {
+        loaded_count = dtn_storage_scan_directory(storage);
+    }
+    if (loaded_count < 0) {
+        loaded_count = 0;
+    }
+    
+    if (dtn_storage_is_full(storage)) {
+        printf("DTN Storage: Recovered backlog fills storage (%zu packets, %zu bytes), new packets are refused until it drains\n",
+               storage->stored_packets_count, storage->stored_bytes);
+    }
     printf("DTN Storage: Loaded %d packets from disk\n", loaded_count);
     return loaded_count;
 }
@@ -266,17 +1673,79 @@ Storage_Function* dtn_storage_create(DTN_Module* parent) {
     if (storage) {
         storage->parent_module = parent;
         storage->stored_packets_count = 0;
-        storage->max_storage_bytes = 1024 * 1024; // 1MB limit
-        storage->packet_list_head = NULL;
+        storage->stored_bytes = 0;
+        storage->max_storage_bytes = STORAGE_MAX_BYTES;
+        storage->max_stored_packets = STORAGE_MAX_PACKETS;
+        storage->destinations = NULL;
+        storage->destinations_capacity = 0;
+        storage->active_head = NULL;
+        storage->active_tail = NULL;
+        storage->drain_policy = STORAGE_DRAIN_POLICY;
+        dtn_timer_wheel_init(&storage->expiry_wheel, dtn_storage_expire_entry, storage);
+        storage->slabs = NULL;
+        storage->free_entries = NULL;
+        storage->next_file_id = 0;
+        storage->addrs = NULL;
+        storage->addr_count = 0;
+        storage->addr_capacity = 0;
+        storage->addr_table = NULL;
+        storage->addr_table_size = 0;
+        storage->addr_refs = NULL;
+        storage->free_addrs = NULL;
+        storage->free_addrs_count = 0;
+        storage->fp_buckets = NULL;
+        storage->fp_bucket_count = 0;
+        storage->fp_count = 0;
+        storage->dedup_records = (Storage_Dedup_Record*)malloc(STORAGE_DEDUP_ENTRIES * sizeof(Storage_Dedup_Record));
+        storage->dedup_buckets = (u32_t*)calloc(STORAGE_DEDUP_ENTRIES, sizeof(u32_t));
+        storage->dedup_oldest = 0;
+        storage->dedup_count = 0;
+        storage->dedup_window_ms = STORAGE_DEDUP_WINDOW_MS;
+        if (!storage->dedup_records || !storage->dedup_buckets) {
+            perror("DTN Storage: Failed to allocate duplicate table, duplicates will be stored");
+            free(storage->dedup_records);
+            free(storage->dedup_buckets);
+            storage->dedup_records = NULL;
+            storage->dedup_buckets = NULL;
+        }
+        storage->index_fd = -1;
+        storage->index_slot_count = 0;
+        storage->free_slots = NULL;
+        storage->free_slots_count = 0;
+        storage->free_slots_capacity = 0;
+        storage->sync_mode = STORAGE_SYNC_MODE;
+        storage->group_commit_packets = STORAGE_GROUP_COMMIT_PACKETS;
+        storage->group_commit_latency_ms = STORAGE_GROUP_COMMIT_LATENCY_MS;
+        storage->dir_fd = -1;
+        storage->open_group = NULL;
+        storage->last_group = NULL;
+        storage->closing = false;
         
         strncpy(storage->storage_directory, STORAGE_DIR, MAX_PATH_LENGTH - 1);
         storage->storage_directory[MAX_PATH_LENGTH - 1] = '\0';
         
-        printf("DTN Storage Function created (Max: %zu bytes, Max Packets: %d).\n", 
-               storage->max_storage_bytes, MAX_STORED_PACKETS);
+        printf("DTN Storage Function created (Max: %zu bytes, Max Packets: %zu).\n", 
+               storage->max_storage_bytes, storage->max_stored_packets);
         
         if (!dtn_storage_init_directory(storage)) {
             fprintf(stderr, "DTN Storage: Failed to initialize storage directory\n");
+            free(storage->dedup_records);
+            free(storage->dedup_buckets);
+            free(storage);
+            return NULL;
+        }
+
+        storage->dir_fd = open(storage->storage_directory, O_RDONLY | O_DIRECTORY);
+        if (storage->dir_fd < 0) {
+            perror("DTN Storage: Failed to open storage directory for syncing");
+        }
+
+        storage->io = dtn_storage_io_create(STORAGE_IO_QUEUE_DEPTH);
+        if (!storage->io) {
+            fprintf(stderr, "DTN Storage: Failed to initialize asynchronous I/O\n");
+            if (storage->dir_fd >= 0) close(storage->dir_fd);
+            free(storage->dedup_records);
+            free(storage->dedup_buckets);
             free(storage);
             return NULL;
         }
@@ -292,29 +1761,153 @@ void dtn_storage_destroy(Storage_Function* storage) {
     if (!storage) return;
     printf("Destroying DTN Storage Function...\n");
 
-    Stored_Packet_Entry* current = storage->packet_list_head;
+    // Outstanding writes are finished and acknowledged, reads no longer reach the controller
+    storage->closing = true;
+    dtn_storage_sync(storage);
+    dtn_storage_io_destroy(storage->io);
+    dtn_timer_wheel_stop(&storage->expiry_wheel);
+
+    Stored_Packet_Entry* current = dtn_storage_first_entry(storage);
     Stored_Packet_Entry* next_entry;
     while (current != NULL) {
-        next_entry = current->next;
+        next_entry = dtn_storage_next_entry(storage, current);
         char addr_str[IP6ADDR_STRLEN_MAX];
-        ip6addr_ntoa_r(&current->original_dest, addr_str, sizeof(addr_str));
+        ip6addr_ntoa_r(dtn_storage_entry_dest(storage, current), addr_str, sizeof(addr_str));
         printf("DTN Storage: Freeing stored pbuf (original dest: %s) during destroy.\n", addr_str);
-        pbuf_free(current->p); 
-        free(current);         
+        dtn_storage_free_entry(storage, current);
         current = next_entry;
     }
-    storage->packet_list_head = NULL;
+    for (u32_t i = 0; i < storage->destinations_capacity; i++) {
+        free(storage->destinations[i]);
+    }
+    free(storage->destinations);
+    storage->destinations = NULL;
+    storage->active_head = NULL;
+    storage->active_tail = NULL;
     storage->stored_packets_count = 0;
+    storage->stored_bytes = 0;
+
+    if (storage->index_fd >= 0) {
+        close(storage->index_fd);
+    }
+    if (storage->dir_fd >= 0) {
+        close(storage->dir_fd);
+    }
+    free(storage->free_slots);
 
+    // Entries still held by callers go with their slabs
+    while (storage->slabs != NULL) {
+        Storage_Slab* slab = storage->slabs;
+        storage->slabs = slab->next;
+        free(slab);
+    }
+    free(storage->addrs);
+    free(storage->addr_refs);
+    free(storage->free_addrs);
+    free(storage->addr_table);
+    free(storage->fp_buckets);
+    free(storage->dedup_records);
+    free(storage->dedup_buckets);
     free(storage);
 }
 
+// Forgets fingerprints older than the window, and the oldest one when room is needed
+static void dtn_storage_dedup_expire(Storage_Function* storage, u32_t now, bool make_room) {
+    while (storage->dedup_count > 0) {
+        Storage_Dedup_Record* oldest = &storage->dedup_records[storage->dedup_oldest];
+        bool full = storage->dedup_count == STORAGE_DEDUP_ENTRIES;
+        if (!(make_room && full) && (u32_t)(now - oldest->seen_ms) <= storage->dedup_window_ms) {
+            break;
+        }
+
+        // The oldest record is the last one of its bucket chain, unless it was forgotten
+        u32_t* link = &storage->dedup_buckets[oldest->fingerprint & (STORAGE_DEDUP_ENTRIES - 1)];
+        while (*link != 0 && *link != storage->dedup_oldest + 1) {
+            link = &storage->dedup_records[*link - 1].next;
+        }
+        if (*link != 0) {
+            *link = oldest->next;
+        }
+
+        storage->dedup_oldest = (storage->dedup_oldest + 1) % STORAGE_DEDUP_ENTRIES;
+        storage->dedup_count--;
+    }
+}
+
+bool dtn_storage_dedup_seen(Storage_Function* storage, uint64_t fingerprint) {
+    if (!storage || !storage->dedup_records || storage->dedup_window_ms == 0 || fingerprint == 0) {
+        return false;
+    }
+
+    dtn_storage_dedup_expire(storage, sys_now(), false);
+    u32_t index = storage->dedup_buckets[fingerprint & (STORAGE_DEDUP_ENTRIES - 1)];
+    while (index != 0) {
+        if (storage->dedup_records[index - 1].fingerprint == fingerprint) {
+            return true;
+        }
+        index = storage->dedup_records[index - 1].next;
+    }
+    return false;
+}
+
+void dtn_storage_dedup_remember(Storage_Function* storage, uint64_t fingerprint) {
+    if (!storage || !storage->dedup_records || storage->dedup_window_ms == 0 || fingerprint == 0) {
+        return;
+    }
+
+    u32_t now = sys_now();
+    dtn_storage_dedup_expire(storage, now, true);
+    u32_t slot = (storage->dedup_oldest + storage->dedup_count) % STORAGE_DEDUP_ENTRIES;
+    u32_t* bucket = &storage->dedup_buckets[fingerprint & (STORAGE_DEDUP_ENTRIES - 1)];
+    Storage_Dedup_Record* record = &storage->dedup_records[slot];
+    record->fingerprint = fingerprint;
+    record->seen_ms = now;
+    record->next = *bucket;
+    *bucket = slot + 1;
+    storage->dedup_count++;
+}
+
+// Unlinks a fingerprint from its bucket chain, its record is left in the ring to expire
+static void dtn_storage_dedup_forget(Storage_Function* storage, uint64_t fingerprint) {
+    if (!storage->dedup_records || fingerprint == 0) return;
+
+    u32_t* link = &storage->dedup_buckets[fingerprint & (STORAGE_DEDUP_ENTRIES - 1)];
+    while (*link != 0) {
+        Storage_Dedup_Record* record = &storage->dedup_records[*link - 1];
+        if (record->fingerprint == fingerprint) {
+            *link = record->next;
+            return;
+        }
+        link = &record->next;
+    }
+}
+
+void dtn_storage_set_dedup_window(Storage_Function* storage, u32_t window_ms) {
+    if (!storage) return;
+
+    storage->dedup_window_ms = window_ms;
+    if (window_ms == 0 && storage->dedup_buckets) {
+        memset(storage->dedup_buckets, 0, STORAGE_DEDUP_ENTRIES * sizeof(u32_t));
+        storage->dedup_oldest = 0;
+        storage->dedup_count = 0;
+    }
+}
+
 int dtn_storage_is_full(Storage_Function* storage) {
     if (!storage) return 1;
-    return storage->stored_packets_count >= MAX_STORED_PACKETS;
+    return storage->stored_packets_count >= storage->max_stored_packets ||
+           storage->stored_bytes >= storage->max_storage_bytes;
+}
+
+// Packets already stored stay when the limits are lowered, new ones are refused until they drain
+void dtn_storage_set_limits(Storage_Function* storage, size_t max_bytes, size_t max_packets) {
+    if (!storage) return;
+
+    storage->max_storage_bytes = max_bytes;
+    storage->max_stored_packets = max_packets;
 }
 
-int dtn_storage_store_packet(Storage_Function* storage, struct pbuf* p, const ip6_addr_t* original_dest) {
+int dtn_storage_store_packet(Storage_Function* storage, struct pbuf* p, const ip6_addr_t* original_dest, uint64_t fingerprint) {
     if (!storage || !p || !original_dest) {
         fprintf(stderr, "DTN Storage: Invalid arguments to store_packet.\n");
         return 0;
@@ -327,53 +1920,82 @@ int dtn_storage_store_packet(Storage_Function* storage, struct pbuf* p, const ip
         return 0;
     }
     
-    // Create a copy of the packet to strip headers if needed
-    struct pbuf *p_to_store = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-    if (!p_to_store) {
-        perror("DTN Storage: Failed to allocate pbuf for storage copy");
+    if (p->len < IP6_HLEN) {
+        fprintf(stderr, "DTN Storage: Packet too small to store.\n");
         return 0;
     }
-    
-    if (pbuf_copy(p_to_store, p) != ERR_OK) {
-        perror("DTN Storage: Failed to copy packet for storage");
-        pbuf_free(p_to_store);
+
+    // A hop-by-hop header is not stored, the file is written around it
+    u8_t ip6_header[IP6_HLEN];
+    memcpy(ip6_header, p->payload, IP6_HLEN);
+    struct ip6_hdr* ip6hdr = (struct ip6_hdr*)ip6_header;
+    u16_t strip_len = 0;
+    if (IP6H_NEXTH(ip6hdr) == IP6_NEXTH_HOPBYHOP) {
+        u8_t hbh[2];
+        if (pbuf_copy_partial(p, hbh, sizeof(hbh), IP6_HLEN) != sizeof(hbh) ||
+            p->tot_len < IP6_HLEN + (hbh[1] + 1) * 8) {
+            fprintf(stderr, "DTN Storage: Truncated hop-by-hop header, not storing packet.\n");
+            return 0;
+        }
+        strip_len = (hbh[1] + 1) * 8;
+        IP6H_NEXTH_SET(ip6hdr, hbh[0]);
+        IP6H_PLEN_SET(ip6hdr, IP6H_PLEN(ip6hdr) - strip_len);
+    }
+
+    if (storage->stored_bytes + (p->tot_len - strip_len) > storage->max_storage_bytes) {
+        char addr_str[IP6ADDR_STRLEN_MAX];
+        ip6addr_ntoa_r(original_dest, addr_str, sizeof(addr_str));
+        printf("DTN Storage: Storage is full. Cannot store packet for %s.\n", addr_str);
         return 0;
     }
-    
-    // Strip hop-by-hop header if present
-    dtn_strip_custodian_option(&p_to_store);
 
-    Stored_Packet_Entry* new_entry = (Stored_Packet_Entry*)malloc(sizeof(Stored_Packet_Entry));
+    u8_t header_snapshot[STORAGE_SNAPSHOT_LEN];
+    memset(header_snapshot, 0, STORAGE_SNAPSHOT_LEN);
+    memcpy(header_snapshot, ip6_header, IP6_HLEN);
+    pbuf_copy_partial(p, header_snapshot + IP6_HLEN, STORAGE_SNAPSHOT_LEN - IP6_HLEN, IP6_HLEN + strip_len);
+
+    Stored_Packet_Entry* new_entry = dtn_storage_entry_alloc(storage);
     if (!new_entry) {
-        perror("DTN Storage: Failed to allocate memory for Stored_Packet_Entry");
-        pbuf_free(p_to_store);
         return 0;
     }
 
-    new_entry->p = p_to_store; // Store the stripped version
-    memcpy(&new_entry->original_dest, original_dest, sizeof(ip6_addr_t));
+    // Only metadata stays in memory, the packet is read back from disk when it is forwarded
+    if (!dtn_storage_entry_intern(storage, new_entry, original_dest, header_snapshot)) {
+        dtn_storage_entry_release(storage, new_entry);
+        return 0;
+    }
     new_entry->stored_time_ms = sys_now();
-    new_entry->next = NULL;
-    new_entry->filename[0] = '\0';
-    
-    if (!dtn_storage_save_packet_to_disk(storage, new_entry)) {
+    new_entry->packet_len = p->tot_len - strip_len;
+    new_entry->file_id = storage->next_file_id++;
+    new_entry->fingerprint = fingerprint;
+
+    Storage_Group* group = dtn_storage_write_packet_file(storage, new_entry, p, ip6_header, strip_len);
+    if (!group) {
         fprintf(stderr, "DTN Storage: Failed to save packet to disk\n");
-        pbuf_free(new_entry->p);
-        free(new_entry);
+        dtn_storage_entry_release(storage, new_entry);
         return 0;
     }
 
-    if (storage->packet_list_head == NULL) {
-        storage->packet_list_head = new_entry;
-    } else {
-        Stored_Packet_Entry* current_item = storage->packet_list_head;
-        while (current_item->next != NULL) {
-            current_item = current_item->next;
+    // Both writes belong to the same group, so the packet is only acknowledged once it is indexed
+    new_entry->index_slot = dtn_storage_index_alloc_slot(storage);
+    if (storage->index_fd >= 0 && !dtn_storage_index_write(storage, new_entry, header_snapshot, group)) {
+        fprintf(stderr, "DTN Storage: Failed to index packet, not storing it\n");
+        dtn_storage_discard_entry_on_disk(storage, new_entry);
+        dtn_storage_free_entry(storage, new_entry);
+        if (storage->sync_mode != STORAGE_SYNC_GROUP) {
+            dtn_storage_group_seal(group);
         }
-        current_item->next = new_entry;
+        return 0;
+    }
+    group->packets++;
+    storage->last_group = group;
+
+    dtn_storage_link_entry(storage, new_entry);
+
+    if (storage->sync_mode != STORAGE_SYNC_GROUP || group->packets >= storage->group_commit_packets) {
+        dtn_storage_group_seal(group);
     }
 
-    storage->stored_packets_count++;
     char addr_str_log[IP6ADDR_STRLEN_MAX];
     ip6addr_ntoa_r(original_dest, addr_str_log, sizeof(addr_str_log));
     printf("DTN Storage: Packet for %s stored successfully at time %u. Total stored: %zu\n",
@@ -383,133 +2005,104 @@ int dtn_storage_store_packet(Storage_Function* storage, struct pbuf* p, const ip
 }
 
 Stored_Packet_Entry* dtn_storage_retrieve_packet_for_dest(Storage_Function* storage, const ip6_addr_t* target_dest) {
-    if (!storage || !target_dest || storage->packet_list_head == NULL) {
+    if (!storage || !target_dest) {
         return NULL;
     }
 
-    Stored_Packet_Entry* current = storage->packet_list_head;
-    Stored_Packet_Entry* prev = NULL;
-    Stored_Packet_Entry* match = NULL;
-    Stored_Packet_Entry* prev_for_match = NULL;
-
-    current = storage->packet_list_head;
-    prev = NULL;
-    while(current != NULL) {
-        ip6_addr_t current_dest_nozone;
-        ip6_addr_t target_dest_nozone;
-
-        memcpy(&current_dest_nozone, &current->original_dest, sizeof(ip6_addr_t));
-        memcpy(&target_dest_nozone, target_dest, sizeof(ip6_addr_t));
-
-#if LWIP_IPV6_SCOPES
-        ip6_addr_set_zone(&current_dest_nozone, IP6_NO_ZONE);
-        ip6_addr_set_zone(&target_dest_nozone, IP6_NO_ZONE);
-#endif
-
-        if (ip6_addr_cmp(&current_dest_nozone, &target_dest_nozone)) {
-            match = current;
-            prev_for_match = prev;
-            break; 
-        }
-        prev = current;
-        current = current->next;
-    }
-
+    Stored_Packet_Entry* match = dtn_storage_first_for_dest(storage, target_dest);
     if (match) {
-        if (prev_for_match == NULL) {
-            storage->packet_list_head = match->next;
-        } else {
-            prev_for_match->next = match->next;
-        }
-        storage->stored_packets_count--;
+        dtn_storage_unlink_entry(storage, match);
         
         char addr_str[IP6ADDR_STRLEN_MAX];
-        ip6addr_ntoa_r(&match->original_dest, addr_str, sizeof(addr_str));
+        ip6addr_ntoa_r(dtn_storage_entry_dest(storage, match), addr_str, sizeof(addr_str));
         printf("DTN Storage: Retrieving packet for %s (stored at %u). Total stored now: %zu\n",
                addr_str, match->stored_time_ms, storage->stored_packets_count);
         
-        dtn_storage_remove_packet_from_disk(storage, match->filename);
+        dtn_storage_discard_entry_on_disk(storage, match);
         
-        match->next = NULL;
         return match;
     }
     return NULL;
 }
 
-void dtn_storage_free_retrieved_entry_struct(Stored_Packet_Entry* entry) {
-    if (entry) {
+void dtn_storage_free_retrieved_entry_struct(Storage_Function* storage, Stored_Packet_Entry* entry) {
+    if (storage && entry) {
         char addr_str[IP6ADDR_STRLEN_MAX];
-        ip6addr_ntoa_r(&entry->original_dest, addr_str, sizeof(addr_str));
+        ip6addr_ntoa_r(dtn_storage_entry_dest(storage, entry), addr_str, sizeof(addr_str));
         printf("DTN Storage: Freeing Stored_Packet_Entry structure for %s (pbuf management is caller's responsibility).\n", addr_str);
-        free(entry);
+        if (entry->io_pending > 0) {
+            // The entry, and a pbuf its write still holds on to, go once its I/O completes
+            entry->flags |= STORED_ENTRY_ORPHANED;
+        } else {
+            dtn_storage_entry_release(storage, entry);
+        }
     }
 }
 
+// Copies the first packet stored for a destination. NULL while that packet is still being read back
+// from disk, the read is started then and a later call finds it resident.
 Stored_Packet_Entry* dtn_storage_get_packet_copy_for_dest(Storage_Function* storage, const ip6_addr_t* target_dest) {
-    if (!storage || !target_dest || storage->packet_list_head == NULL) {
+    if (!storage || !target_dest) {
+        return NULL;
+    }
+
+    Stored_Packet_Entry* current = dtn_storage_first_for_dest(storage, target_dest);
+    if (current == NULL) {
         return NULL;
     }
 
-    Stored_Packet_Entry* current = storage->packet_list_head;
+    Stored_Packet_Entry* copy = dtn_storage_entry_alloc(storage);
+    if (!copy) {
+        printf("DTN Storage: Failed to allocate memory for packet copy\n");
+        return NULL;
+    }
     
-    while(current != NULL) {
-        ip6_addr_t current_dest_nozone;
-        ip6_addr_t target_dest_nozone;
-
-        memcpy(&current_dest_nozone, &current->original_dest, sizeof(ip6_addr_t));
-        memcpy(&target_dest_nozone, target_dest, sizeof(ip6_addr_t));
-
-#if LWIP_IPV6_SCOPES
-        ip6_addr_set_zone(&current_dest_nozone, IP6_NO_ZONE);
-        ip6_addr_set_zone(&target_dest_nozone, IP6_NO_ZONE);
-#endif
-
-        if (ip6_addr_cmp(&current_dest_nozone, &target_dest_nozone)) {
-            // Found a match, create a new entry
-            Stored_Packet_Entry* copy = (Stored_Packet_Entry*)malloc(sizeof(Stored_Packet_Entry));
-            if (!copy) {
-                printf("DTN Storage: Failed to allocate memory for packet copy\n");
-                return NULL;
-            }
-            
-            // Copy the packet itself
-            struct pbuf* p_copy = pbuf_alloc(PBUF_RAW, current->p->tot_len, PBUF_RAM);
-            if (!p_copy) {
-                printf("DTN Storage: Failed to allocate pbuf for packet copy\n");
-                free(copy);
-                return NULL;
-            }
-            
-            if (pbuf_copy(p_copy, current->p) != ERR_OK) {
-                printf("DTN Storage: Failed to copy packet data\n");
-                pbuf_free(p_copy);
-                free(copy);
-                return NULL;
-            }
-            
-            copy->p = p_copy;
-            memcpy(&copy->original_dest, &current->original_dest, sizeof(ip6_addr_t));
-            copy->stored_time_ms = current->stored_time_ms;
-            copy->next = NULL;
-            strncpy(copy->filename, current->filename, MAX_PATH_LENGTH-1);
-            copy->filename[MAX_PATH_LENGTH-1] = '\0';
-            
-            char addr_str[IP6ADDR_STRLEN_MAX];
-            ip6addr_ntoa_r(&copy->original_dest, addr_str, sizeof(addr_str));
-            printf("DTN Storage: Created copy of packet for %s (original stored at %u)\n",
-                   addr_str, copy->stored_time_ms);
-            
-            return copy;
-        }
-        
-        current = current->next;
+    struct pbuf* stored_p = dtn_storage_entry_pbuf(storage, current);
+    if (!stored_p) {
+        dtn_storage_entry_release(storage, copy);
+        return NULL;
+    }
+
+    // Copy the packet itself
+    struct pbuf* p_copy = pbuf_alloc(PBUF_RAW, stored_p->tot_len, PBUF_RAM);
+    if (!p_copy) {
+        printf("DTN Storage: Failed to allocate pbuf for packet copy\n");
+        dtn_storage_entry_release(storage, copy);
+        return NULL;
+    }
+    
+    if (pbuf_copy(p_copy, stored_p) != ERR_OK) {
+        printf("DTN Storage: Failed to copy packet data\n");
+        pbuf_free(p_copy);
+        dtn_storage_entry_release(storage, copy);
+        return NULL;
     }
+    if (IP6H_NEXTH((struct ip6_hdr*)p_copy->payload) == IP6_NEXTH_HOPBYHOP) {
+        dtn_strip_custodian_option(&p_copy);
+    }
+    
+    // The compact record only refers to interned addresses, the copy takes its own references on them
+    *copy = *current;
+    copy->p = p_copy;
+    copy->io_pending = 0;
+    copy->flags = STORED_ENTRY_INTERNED;
+    storage->addr_refs[copy->dest_index]++;
+    storage->addr_refs[copy->src_index]++;
+    copy->next = NULL;
+    copy->prev = NULL;
+    copy->fp_next = NULL;
+    dtn_timer_init(&copy->expiry);
+    
+    char addr_str[IP6ADDR_STRLEN_MAX];
+    ip6addr_ntoa_r(dtn_storage_entry_dest(storage, copy), addr_str, sizeof(addr_str));
+    printf("DTN Storage: Created copy of packet for %s (original stored at %u)\n",
+           addr_str, copy->stored_time_ms);
     
-    return NULL; 
+    return copy;
 }
 
 void dtn_storage_delete_packet_by_ip_header(Storage_Function* storage, struct ip6_hdr* orig_ip6hdr) {
-    if (!storage || !orig_ip6hdr || !storage->packet_list_head) {
+    if (!storage || !orig_ip6hdr || storage->stored_packets_count == 0) {
         return;
     }
     
@@ -535,41 +2128,29 @@ void dtn_storage_delete_packet_by_ip_header(Storage_Function* storage, struct ip
     printf("DTN Storage: Looking for stored packet matching src=%s, dest=%s\n", 
            orig_src_str, orig_dest_str);
     
-    Stored_Packet_Entry* current = storage->packet_list_head;
-    Stored_Packet_Entry* prev = NULL;
+    Stored_Packet_Entry* current = dtn_storage_first_for_dest(storage, &orig_dest);
     bool found = false;
     
     while (current != NULL) {
-        if (current->p && current->p->len >= IP6_HLEN) {
-            struct ip6_hdr* stored_ip6hdr = (struct ip6_hdr*)current->p->payload;
-
-            if (memcmp(&stored_ip6hdr->src,  &orig_ip6hdr->src,  16) == 0 &&
-                memcmp(&stored_ip6hdr->dest, &orig_ip6hdr->dest, 16) == 0) {
+        if (current->packet_len >= IP6_HLEN) {
+            if (memcmp(dtn_storage_entry_src(storage, current)->addr,  &orig_ip6hdr->src,  16) == 0 &&
+                memcmp(dtn_storage_entry_dest(storage, current)->addr, &orig_ip6hdr->dest, 16) == 0) {
  
                 found = true;
-     
-                if (prev == NULL) {
-                    storage->packet_list_head = current->next;
-                } else {
-                    prev->next = current->next;
-                }
+                dtn_storage_unlink_entry(storage, current);
                 
                 printf("DTN Storage: Deleting stored packet for %s (src=%s) as next hop confirmed reception\n", 
                        orig_dest_str, orig_src_str);
                 
-                dtn_storage_remove_packet_from_disk(storage, current->filename);
+                dtn_storage_discard_entry_on_disk(storage, current);
                 
-                pbuf_free(current->p);
-                free(current);
-                
-                storage->stored_packets_count--;
+                dtn_storage_free_entry(storage, current);
                 
                 break;
             }
         }
         
-        prev = current;
-        current = current->next;
+        current = dtn_storage_next_for_dest(storage, current);
     }
     
     if (!found) {
@@ -578,138 +2159,102 @@ void dtn_storage_delete_packet_by_ip_header(Storage_Function* storage, struct ip
     }
 }
 
-void dtn_storage_delete_packet_by_icmp_data(Storage_Function* storage, struct pbuf* icmp_packet) {
-    if (!storage || !icmp_packet || !storage->packet_list_head) {
-        return;
-    }
-    
-    // Parse ICMP packet structure:
-    // IPv6 Header (40 bytes) + ICMPv6 Header (8 bytes) + Payload + Original IPv6 Header + 8 bytes of original payload
-    
-    if (icmp_packet->len < IP6_HLEN + 8 + 9 + IP6_HLEN + 8) {
-        printf("DTN Storage: ICMP packet too small for proper parsing\n");
+// Deletes the stored packet a DTN ICMPv6 message quotes. quote holds the IPv6 header and the
+// first bytes behind it, info its parse. The stored copy has no hop-by-hop header, so the part of
+// the quote behind one is compared with the start of the stored payload.
+void dtn_storage_delete_packet_by_quote(Storage_Function* storage, const u8_t* quote, size_t quote_len,
+                                        const DTN_Packet_Info* info) {
+    if (!storage || !quote || !info || storage->stored_packets_count == 0) {
         return;
     }
     
-    u8_t* icmp_data = (u8_t*)icmp_packet->payload + IP6_HLEN + 8; // Skip outer IPv6 + ICMP headers
-    
-    // Skip DTN payload structure (9 bytes: 4+2+2+1)
-    icmp_data += 9; 
-    
-    // Now icmp_data points to the original IPv6 header
-    struct ip6_hdr* orig_ip6hdr = (struct ip6_hdr*)icmp_data;
-    u8_t* orig_first_8_bytes = icmp_data + IP6_HLEN; // First 8 bytes after IPv6 header
-    
-    ip6_addr_t orig_src, orig_dest;
-    IP6_ADDR(&orig_src, 
-             orig_ip6hdr->src.addr[0], orig_ip6hdr->src.addr[1], 
-             orig_ip6hdr->src.addr[2], orig_ip6hdr->src.addr[3]);
-    IP6_ADDR(&orig_dest, 
-             orig_ip6hdr->dest.addr[0], orig_ip6hdr->dest.addr[1], 
-             orig_ip6hdr->dest.addr[2], orig_ip6hdr->dest.addr[3]);
-    
     char orig_src_str[IP6ADDR_STRLEN_MAX] = {0};
     char orig_dest_str[IP6ADDR_STRLEN_MAX] = {0};
-    ip6addr_ntoa_r(&orig_src, orig_src_str, sizeof(orig_src_str));
-    ip6addr_ntoa_r(&orig_dest, orig_dest_str, sizeof(orig_dest_str));
+    ip6addr_ntoa_r(&info->src, orig_src_str, sizeof(orig_src_str));
+    ip6addr_ntoa_r(&info->dest, orig_dest_str, sizeof(orig_dest_str));
     
     printf("DTN Storage: Looking for stored packet matching src=%s, dest=%s with payload verification\n", 
            orig_src_str, orig_dest_str);
     
-    // Parse the original packet to skip hop-by-hop headers in the ICMP data
-    u8_t orig_nexth = orig_ip6hdr->_nexth;
-    u16_t orig_payload_offset = 0;
-    
-    if (orig_nexth == IP6_NEXTH_HOPBYHOP) {
-        // Skip hop-by-hop header to get to actual payload
-        u8_t hbh_hdr_len = orig_first_8_bytes[1]; 
-        orig_payload_offset = (hbh_hdr_len + 1) * 8; 
-        orig_nexth = orig_first_8_bytes[0]; 
-        
-        printf("DTN Storage: Skipping hop-by-hop header (%d bytes) in ICMP data\n", orig_payload_offset);
-    }
-    
-    // Get pointer to actual payload (after any headers)
-    u8_t* orig_payload_start = orig_first_8_bytes + orig_payload_offset;
-    u8_t actual_payload_bytes = 8 - orig_payload_offset;
+    const u8_t* orig_payload_start = quote + info->l4_offset;
+    size_t actual_payload_bytes = quote_len > info->l4_offset ? quote_len - info->l4_offset : 0;
     
-    if (actual_payload_bytes <= 0) {
-        printf("DTN Storage: Not enough payload data after headers, falling back to basic matching\n");
-        dtn_storage_delete_packet_by_ip_header(storage, orig_ip6hdr);
-        return;
-    }
-    
-    Stored_Packet_Entry* current = storage->packet_list_head;
-    Stored_Packet_Entry* prev = NULL;
+    Stored_Packet_Entry* current = dtn_storage_first_for_dest(storage, &info->dest);
     bool found = false;
     
     // Iterate through stored packets
     while (current != NULL) {
-        if (current->p && current->p->len >= IP6_HLEN) {
-            struct ip6_hdr* stored_ip6hdr = (struct ip6_hdr*)current->p->payload;
+        if (current->packet_len >= IP6_HLEN &&
+            ip6_addr_cmp_zoneless(dtn_storage_entry_src(storage, current), &info->src)) {
+            
+            // Stored packets have no hop-by-hop header, so protocols compare directly
+            bool payload_matches = current->nexth == info->nexth;
+            if (!payload_matches) {
+                printf("DTN Storage: Protocol mismatch: stored=%d, orig=%d\n", current->nexth, info->nexth);
+            }
+            
+            // Without payload bytes in the quote the addresses and protocol have to do
+            if (payload_matches && actual_payload_bytes > 0 &&
+                current->packet_len >= IP6_HLEN + actual_payload_bytes &&
+                memcmp(current->payload_head, orig_payload_start, actual_payload_bytes) != 0) {
+                printf("DTN Storage: Payload mismatch for src=%s, dest=%s\n", orig_src_str, orig_dest_str);
+                payload_matches = false;
+            }
             
-            // 1. Check src/dst addresses
-            if (memcmp(&stored_ip6hdr->src, &orig_ip6hdr->src, 16) == 0) {
+            if (payload_matches) {
+                found = true;
                 
-                // 2. Check next header protocol
-                u8_t stored_nexth = stored_ip6hdr->_nexth;
-                u16_t stored_payload_offset = IP6_HLEN;
+                // Remove from list
+                dtn_storage_unlink_entry(storage, current);
                 
-                // Stored packets shouldn't have hop-by-hop headers, but check anyway
-                if (stored_nexth == IP6_NEXTH_HOPBYHOP) {
-                    printf("DTN Storage: Warning - stored packet has hop-by-hop header (unexpected)\n");
-                    continue; 
-                }
+                printf("DTN Storage: Deleting stored packet for %s (src=%s) with payload verification\n", 
+                       orig_dest_str, orig_src_str);
                 
-                // 3. Compare actual payload bytes
-                bool payload_matches = true;
-                if (actual_payload_bytes > 0 && current->p->len >= stored_payload_offset + actual_payload_bytes) {
-                    u8_t* stored_payload = (u8_t*)current->p->payload + stored_payload_offset;
-                    
-                    if (memcmp(stored_payload, orig_payload_start, actual_payload_bytes) != 0) {
-                        printf("DTN Storage: Payload mismatch for src=%s, dest=%s\n", orig_src_str, orig_dest_str);
-                        payload_matches = false;
-                    }
-                }
+                // Remove from disk
+                dtn_storage_discard_entry_on_disk(storage, current);
                 
-                // 4. Check if protocols match (after stripping HBH from original)
-                if (stored_nexth != orig_nexth) {
-                    printf("DTN Storage: Protocol mismatch: stored=%d, orig=%d\n", stored_nexth, orig_nexth);
-                    payload_matches = false;
-                }
+                dtn_storage_free_entry(storage, current);
                 
-                if (payload_matches) {
-                    found = true;
-                    
-                    // Remove from list
-                    if (prev == NULL) {
-                        storage->packet_list_head = current->next;
-                    } else {
-                        prev->next = current->next;
-                    }
-                    
-                    printf("DTN Storage: Deleting stored packet for %s (src=%s) with payload verification\n", 
-                           orig_dest_str, orig_src_str);
-                    
-                    // Remove from disk
-                    dtn_storage_remove_packet_from_disk(storage, current->filename);
-                    
-                    pbuf_free(current->p);
-                    free(current);
-                    
-                    storage->stored_packets_count--;
-                    
-                    break;
-                }
+                break;
             }
         }
         
-        prev = current;
-        current = current->next;
+        current = dtn_storage_next_for_dest(storage, current);
     }
     
     if (!found) {
         printf("DTN Storage: No matching stored packet found for %s (src=%s) with payload verification\n", 
                orig_dest_str, orig_src_str);
     }
-}
\ No newline at end of file
+}
+
+// Deletes the stored packets named by an aggregate acknowledgement from acked_by, each one found through
+// the fingerprint table. The controller hears of each packet acknowledged. Returns the number deleted.
+size_t dtn_storage_delete_packets_by_fingerprint(Storage_Function* storage, const uint64_t* fingerprints, size_t count,
+                                                 const ip6_addr_t* acked_by) {
+    if (!storage || !fingerprints || count == 0 || storage->fp_count == 0) {
+        return 0;
+    }
+
+    DTN_Controller* controller = storage->parent_module ? storage->parent_module->controller : NULL;
+    size_t deleted = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (fingerprints[i] == 0) continue;
+        Stored_Packet_Entry* current = storage->fp_buckets[fingerprints[i] & (storage->fp_bucket_count - 1)];
+        while (current != NULL) {
+            Stored_Packet_Entry* next_entry = current->fp_next;
+            if (current->fingerprint == fingerprints[i]) {
+                const ip6_addr_t* dest = dtn_storage_entry_dest(storage, current);
+                dtn_storage_unlink_entry(storage, current);
+                dtn_storage_discard_entry_on_disk(storage, current);
+                if (controller && acked_by) {
+                    dtn_controller_custody_acked(controller, dest, acked_by);
+                }
+                dtn_storage_free_entry(storage, current);
+                deleted++;
+            }
+            current = next_entry;
+        }
+    }
+    return deleted;
+}
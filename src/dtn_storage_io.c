@@ -0,0 +1,537 @@
+// dtn_storage_io.c: Implementation of asynchronous disk I/O for DTN packet storage using io_uring with a thread-pool fallback
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE /* pull in preadv()/pwritev() on Linux */
+
+#include "dtn_storage_io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef enum {
+    STORAGE_IO_WRITEV,
+    STORAGE_IO_READV,
+    STORAGE_IO_FSYNC,
+    STORAGE_IO_UNLINK
+} Storage_IO_Op;
+
+typedef struct Storage_IO_Job {
+    Storage_IO_Op op;
+    int fd;
+    off_t offset;
+    struct iovec iov[STORAGE_IO_MAX_IOV];
+    int iovcnt;
+    bool datasync;
+    char* path;
+    void* owned_buffer;
+    int result;
+    Storage_IO_Callback cb;
+    void* arg;
+    struct Storage_IO_Job* next;
+} Storage_IO_Job;
+
+struct Storage_IO {
+    int event_fd;
+    unsigned inflight;
+    bool use_uring;
+
+    // io_uring backend
+    int ring_fd;
+    unsigned ring_entries;
+    unsigned ring_inflight;
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring;
+    size_t cq_ring_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    Storage_IO_Job* backlog_head;   // jobs waiting for room in the ring
+    Storage_IO_Job* backlog_tail;
+
+    // Thread-pool backend, the done list is also used for failed ring submissions
+    pthread_t threads[STORAGE_IO_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+    Storage_IO_Job* queue_head;
+    Storage_IO_Job* queue_tail;
+    Storage_IO_Job* done_head;
+    Storage_IO_Job* done_tail;
+};
+
+static void job_list_append(Storage_IO_Job** head, Storage_IO_Job** tail, Storage_IO_Job* job) {
+    job->next = NULL;
+    if (*tail) {
+        (*tail)->next = job;
+    } else {
+        *head = job;
+    }
+    *tail = job;
+}
+
+static void storage_io_signal(Storage_IO* io) {
+    uint64_t one = 1;
+    if (write(io->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("DTN Storage IO: Failed to signal completion");
+    }
+}
+
+static void storage_io_complete_later(Storage_IO* io, Storage_IO_Job* job) {
+    pthread_mutex_lock(&io->lock);
+    job_list_append(&io->done_head, &io->done_tail, job);
+    pthread_mutex_unlock(&io->lock);
+    storage_io_signal(io);
+}
+
+static void storage_io_execute(Storage_IO_Job* job) {
+    ssize_t n = 0;
+    switch (job->op) {
+        case STORAGE_IO_WRITEV:
+            n = pwritev(job->fd, job->iov, job->iovcnt, job->offset);
+            break;
+        case STORAGE_IO_READV:
+            n = preadv(job->fd, job->iov, job->iovcnt, job->offset);
+            break;
+        case STORAGE_IO_FSYNC:
+            n = job->datasync ? fdatasync(job->fd) : fsync(job->fd);
+            break;
+        case STORAGE_IO_UNLINK:
+            n = unlink(job->path);
+            break;
+    }
+    job->result = n < 0 ? -errno : (int)n;
+}
+
+static void* storage_io_worker(void* arg) {
+    Storage_IO* io = (Storage_IO*)arg;
+
+    while (1) {
+        pthread_mutex_lock(&io->lock);
+        while (!io->stopping && io->queue_head == NULL) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        Storage_IO_Job* job = io->queue_head;
+        if (job == NULL) {
+            pthread_mutex_unlock(&io->lock);
+            break;
+        }
+        io->queue_head = job->next;
+        if (io->queue_head == NULL) {
+            io->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&io->lock);
+
+        storage_io_execute(job);
+        storage_io_complete_later(io, job);
+    }
+    return NULL;
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void storage_io_uring_teardown(Storage_IO* io) {
+    if (io->sqes && io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_len);
+    if (io->cq_ring && io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_len);
+    if (io->sq_ring && io->sq_ring != MAP_FAILED) munmap(io->sq_ring, io->sq_ring_len);
+    if (io->ring_fd >= 0) close(io->ring_fd);
+    io->sqes = NULL;
+    io->cq_ring = NULL;
+    io->sq_ring = NULL;
+    io->ring_fd = -1;
+}
+
+static bool storage_io_uring_init(Storage_IO* io, unsigned queue_depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    io->ring_fd = sys_io_uring_setup(queue_depth, &params);
+    if (io->ring_fd < 0) {
+        return false;
+    }
+
+    io->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_len > io->sq_ring_len) io->sq_ring_len = io->cq_ring_len;
+        io->cq_ring_len = io->sq_ring_len;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       io->ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) {
+        storage_io_uring_teardown(io);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           io->ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) {
+            storage_io_uring_teardown(io);
+            return false;
+        }
+    }
+    io->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        storage_io_uring_teardown(io);
+        return false;
+    }
+
+    u_int8_t* sq = io->sq_ring;
+    u_int8_t* cq = io->cq_ring;
+    io->sq_head = (unsigned*)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params.sq_off.array);
+    io->cq_head = (unsigned*)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    io->ring_entries = params.sq_entries;
+
+    // Completions wake the event loop through the same eventfd as the thread pool
+    if (sys_io_uring_register(io->ring_fd, IORING_REGISTER_EVENTFD, &io->event_fd, 1) < 0) {
+        storage_io_uring_teardown(io);
+        return false;
+    }
+    return true;
+}
+
+static void storage_io_uring_prep(Storage_IO* io, Storage_IO_Job* job) {
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (u_int64_t)(uintptr_t)job;
+    switch (job->op) {
+        case STORAGE_IO_WRITEV:
+        case STORAGE_IO_READV:
+            sqe->opcode = job->op == STORAGE_IO_WRITEV ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = job->fd;
+            sqe->addr = (u_int64_t)(uintptr_t)job->iov;
+            sqe->len = job->iovcnt;
+            sqe->off = job->offset;
+            break;
+        case STORAGE_IO_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = job->fd;
+            sqe->fsync_flags = job->datasync ? IORING_FSYNC_DATASYNC : 0;
+            break;
+        case STORAGE_IO_UNLINK:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (u_int64_t)(uintptr_t)job->path;
+            break;
+    }
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Takes back the entries the kernel hasn't consumed and completes their jobs with error through the
+// done list, so their callbacks still run and dtn_storage_io_wait_idle doesn't wait on them forever
+static void storage_io_uring_fail_unsubmitted(Storage_IO* io, int error) {
+    unsigned head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *io->sq_tail;
+
+    pthread_mutex_lock(&io->lock);
+    for (unsigned i = head; i != tail; i++) {
+        Storage_IO_Job* job = (Storage_IO_Job*)(uintptr_t)io->sqes[i & *io->sq_mask].user_data;
+        job->result = -error;
+        job_list_append(&io->done_head, &io->done_tail, job);
+        io->ring_inflight--;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    // Without SQPOLL only io_uring_enter moves the head, so the tail can be pulled back
+    __atomic_store_n(io->sq_tail, head, __ATOMIC_RELEASE);
+    storage_io_signal(io);
+}
+
+// Moves backlogged jobs into the ring while it has room and submits whatever the kernel hasn't taken yet
+static void storage_io_uring_flush(Storage_IO* io) {
+    while (io->backlog_head && io->ring_inflight < io->ring_entries) {
+        Storage_IO_Job* job = io->backlog_head;
+        io->backlog_head = job->next;
+        if (io->backlog_head == NULL) {
+            io->backlog_tail = NULL;
+        }
+        storage_io_uring_prep(io, job);
+        io->ring_inflight++;
+    }
+
+    unsigned to_submit = *io->sq_tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0) return;
+
+    int ret;
+    do {
+        ret = sys_io_uring_enter(io->ring_fd, to_submit, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        int error = errno;
+        // EAGAIN/EBUSY clear up as completions are reaped, the entries go with the next flush
+        if ((error == EAGAIN || error == EBUSY) && io->ring_inflight > to_submit) return;
+        perror("DTN Storage IO: io_uring_enter failed");
+        storage_io_uring_fail_unsubmitted(io, error);
+    }
+}
+
+static int storage_io_submit(Storage_IO* io, Storage_IO_Job* job) {
+    io->inflight++;
+    if (io->use_uring) {
+        job_list_append(&io->backlog_head, &io->backlog_tail, job);
+        storage_io_uring_flush(io);
+    } else {
+        pthread_mutex_lock(&io->lock);
+        job_list_append(&io->queue_head, &io->queue_tail, job);
+        pthread_cond_signal(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+    }
+    return 0;
+}
+
+static Storage_IO_Job* storage_io_new_job(Storage_IO_Op op, int fd, Storage_IO_Callback cb, void* arg) {
+    Storage_IO_Job* job = calloc(1, sizeof(Storage_IO_Job));
+    if (!job) {
+        perror("DTN Storage IO: Failed to allocate job");
+        return NULL;
+    }
+    job->op = op;
+    job->fd = fd;
+    job->cb = cb;
+    job->arg = arg;
+    return job;
+}
+
+Storage_IO* dtn_storage_io_create(unsigned queue_depth) {
+    Storage_IO* io = calloc(1, sizeof(Storage_IO));
+    if (!io) {
+        perror("Failed to allocate memory for Storage_IO");
+        return NULL;
+    }
+    io->ring_fd = -1;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+
+    io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->event_fd < 0) {
+        perror("DTN Storage IO: Failed to create eventfd");
+        free(io);
+        return NULL;
+    }
+
+    io->use_uring = STORAGE_IO_USE_URING && storage_io_uring_init(io, queue_depth);
+    if (!io->use_uring) {
+        for (int i = 0; i < STORAGE_IO_THREADS; i++) {
+            if (pthread_create(&io->threads[i], NULL, storage_io_worker, io) != 0) {
+                perror("DTN Storage IO: Failed to start worker thread");
+                break;
+            }
+            io->thread_count++;
+        }
+        if (io->thread_count == 0) {
+            close(io->event_fd);
+            free(io);
+            return NULL;
+        }
+    }
+
+    if (io->use_uring) {
+        printf("DTN Storage IO: Using io_uring backend (queue depth %u)\n", io->ring_entries);
+    } else {
+        printf("DTN Storage IO: Using thread pool backend (%d workers)\n", io->thread_count);
+    }
+    return io;
+}
+
+void dtn_storage_io_destroy(Storage_IO* io) {
+    if (!io) return;
+
+    dtn_storage_io_wait_idle(io);
+
+    pthread_mutex_lock(&io->lock);
+    io->stopping = true;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+    for (int i = 0; i < io->thread_count; i++) {
+        pthread_join(io->threads[i], NULL);
+    }
+
+    storage_io_uring_teardown(io);
+    close(io->event_fd);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+    free(io);
+}
+
+const char* dtn_storage_io_backend_name(const Storage_IO* io) {
+    if (!io) return "none";
+    return io->use_uring ? "io_uring" : "thread pool";
+}
+
+int dtn_storage_io_fd(const Storage_IO* io) {
+    return io ? io->event_fd : -1;
+}
+
+int dtn_storage_io_writev(Storage_IO* io, int fd, const struct iovec* iov, int iovcnt, off_t offset,
+                          void* owned_buffer, Storage_IO_Callback cb, void* arg) {
+    if (!io || iovcnt <= 0 || iovcnt > STORAGE_IO_MAX_IOV) return -1;
+
+    Storage_IO_Job* job = storage_io_new_job(STORAGE_IO_WRITEV, fd, cb, arg);
+    if (!job) return -1;
+    memcpy(job->iov, iov, iovcnt * sizeof(struct iovec));
+    job->iovcnt = iovcnt;
+    job->offset = offset;
+    job->owned_buffer = owned_buffer;
+    return storage_io_submit(io, job);
+}
+
+int dtn_storage_io_readv(Storage_IO* io, int fd, const struct iovec* iov, int iovcnt, off_t offset,
+                         Storage_IO_Callback cb, void* arg) {
+    if (!io || iovcnt <= 0 || iovcnt > STORAGE_IO_MAX_IOV) return -1;
+
+    Storage_IO_Job* job = storage_io_new_job(STORAGE_IO_READV, fd, cb, arg);
+    if (!job) return -1;
+    memcpy(job->iov, iov, iovcnt * sizeof(struct iovec));
+    job->iovcnt = iovcnt;
+    job->offset = offset;
+    return storage_io_submit(io, job);
+}
+
+int dtn_storage_io_fsync(Storage_IO* io, int fd, bool datasync, Storage_IO_Callback cb, void* arg) {
+    if (!io) return -1;
+
+    Storage_IO_Job* job = storage_io_new_job(STORAGE_IO_FSYNC, fd, cb, arg);
+    if (!job) return -1;
+    job->datasync = datasync;
+    return storage_io_submit(io, job);
+}
+
+int dtn_storage_io_unlink(Storage_IO* io, const char* path, Storage_IO_Callback cb, void* arg) {
+    if (!io || !path) return -1;
+
+    Storage_IO_Job* job = storage_io_new_job(STORAGE_IO_UNLINK, -1, cb, arg);
+    if (!job) return -1;
+    job->path = strdup(path);
+    if (!job->path) {
+        free(job);
+        return -1;
+    }
+    return storage_io_submit(io, job);
+}
+
+int dtn_storage_io_poll(Storage_IO* io) {
+    if (!io) return 0;
+
+    uint64_t count;
+    if (read(io->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("DTN Storage IO: Failed to read completion eventfd");
+    }
+
+    Storage_IO_Job* done_head = NULL;
+    Storage_IO_Job* done_tail = NULL;
+
+    pthread_mutex_lock(&io->lock);
+    done_head = io->done_head;
+    done_tail = io->done_tail;
+    io->done_head = NULL;
+    io->done_tail = NULL;
+    pthread_mutex_unlock(&io->lock);
+
+    if (io->use_uring) {
+        unsigned head = *io->cq_head;
+        unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+            Storage_IO_Job* job = (Storage_IO_Job*)(uintptr_t)cqe->user_data;
+            job->result = cqe->res;
+            job_list_append(&done_head, &done_tail, job);
+            io->ring_inflight--;
+            head++;
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    int completed = 0;
+    Storage_IO_Job* job = done_head;
+    while (job != NULL) {
+        Storage_IO_Job* next = job->next;
+
+        // Kernels without IORING_OP_UNLINKAT reject it, finish those inline
+        if (job->op == STORAGE_IO_UNLINK && job->result == -EINVAL) {
+            storage_io_execute(job);
+        }
+
+        io->inflight--;
+        if (job->cb) {
+            job->cb(job->arg, job->result);
+        }
+        free(job->owned_buffer);
+        free(job->path);
+        free(job);
+        completed++;
+        job = next;
+    }
+
+    if (io->use_uring) {
+        storage_io_uring_flush(io);
+    }
+    return completed;
+}
+
+void dtn_storage_io_wait_idle(Storage_IO* io) {
+    if (!io) return;
+
+    while (io->inflight > 0) {
+        struct pollfd pfd = { .fd = io->event_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("DTN Storage IO: poll failed while waiting for completions");
+            return;
+        }
+        dtn_storage_io_poll(io);
+    }
+}
@@ -0,0 +1,158 @@
+// dtn_timer_wheel.c: Hierarchical timing wheel giving O(1) scheduling, cancellation and expiry of DTN packet timers
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "dtn_timer_wheel.h"
+#include <string.h>
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+
+static void dtn_timer_wheel_tick(void* arg);
+
+static void dtn_timer_link(DTN_Timer** head, DTN_Timer* timer) {
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void dtn_timer_unlink(DTN_Timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Files a timer under the coarsest level whose slots still separate it from the current tick
+static void dtn_timer_wheel_place(DTN_Timer_Wheel* wheel, DTN_Timer* timer) {
+    u32_t delta = timer->expires - wheel->current_tick;
+    int level = 0;
+    while (level < DTN_TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1UL << (DTN_TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    u32_t slot = (timer->expires >> (DTN_TIMER_WHEEL_SLOT_BITS * level)) & (DTN_TIMER_WHEEL_SLOTS - 1);
+    dtn_timer_link(&wheel->slots[level][slot], timer);
+}
+
+void dtn_timer_wheel_init(DTN_Timer_Wheel* wheel, DTN_Timer_Callback expire, void* arg) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->current_tick = 0;
+    wheel->last_tick_ms = sys_now();
+    wheel->count = 0;
+    wheel->running = false;
+    wheel->expire = expire;
+    wheel->arg = arg;
+}
+
+// Unschedules the tick, timers still on the wheel belong to the caller
+void dtn_timer_wheel_stop(DTN_Timer_Wheel* wheel) {
+    if (wheel->running) {
+        sys_untimeout(dtn_timer_wheel_tick, wheel);
+        wheel->running = false;
+    }
+}
+
+void dtn_timer_wheel_schedule(DTN_Timer_Wheel* wheel, DTN_Timer* timer, u32_t delay_ms) {
+    if (dtn_timer_pending(timer)) {
+        dtn_timer_wheel_cancel(wheel, timer);
+    }
+
+    // An idle wheel skips ahead, a busy one may lag behind now by the ticks it hasn't run yet
+    u32_t now = sys_now();
+    if (wheel->count == 0) {
+        u32_t idle_ticks = (now - wheel->last_tick_ms) / DTN_TIMER_WHEEL_TICK_MS;
+        wheel->current_tick += idle_ticks;
+        wheel->last_tick_ms += idle_ticks * DTN_TIMER_WHEEL_TICK_MS;
+    }
+
+    // A timer always waits at least one tick
+    unsigned long long ticks = ((unsigned long long)(now - wheel->last_tick_ms) + delay_ms +
+                                DTN_TIMER_WHEEL_TICK_MS - 1) / DTN_TIMER_WHEEL_TICK_MS;
+    if (ticks == 0) ticks = 1;
+    if (ticks > DTN_TIMER_WHEEL_MAX_TICKS) ticks = DTN_TIMER_WHEEL_MAX_TICKS;
+    timer->expires = wheel->current_tick + (u32_t)ticks;
+    dtn_timer_wheel_place(wheel, timer);
+    wheel->count++;
+
+    if (!wheel->running) {
+        wheel->running = true;
+        sys_timeout(DTN_TIMER_WHEEL_TICK_MS, dtn_timer_wheel_tick, wheel);
+    }
+}
+
+void dtn_timer_wheel_cancel(DTN_Timer_Wheel* wheel, DTN_Timer* timer) {
+    if (!dtn_timer_pending(timer)) return;
+    dtn_timer_unlink(timer);
+    wheel->count--;
+}
+
+// Moves the timers of one higher-level slot down now that they are within its reach
+static void dtn_timer_wheel_cascade(DTN_Timer_Wheel* wheel, int level) {
+    u32_t slot = (wheel->current_tick >> (DTN_TIMER_WHEEL_SLOT_BITS * level)) & (DTN_TIMER_WHEEL_SLOTS - 1);
+    DTN_Timer* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (timer != NULL) {
+        DTN_Timer* next = timer->next;
+        dtn_timer_wheel_place(wheel, timer);
+        timer = next;
+    }
+}
+
+void dtn_timer_wheel_advance(DTN_Timer_Wheel* wheel, u32_t now_ms) {
+    while ((u32_t)(now_ms - wheel->last_tick_ms) >= DTN_TIMER_WHEEL_TICK_MS) {
+        if (wheel->count == 0) {
+            u32_t idle_ticks = (now_ms - wheel->last_tick_ms) / DTN_TIMER_WHEEL_TICK_MS;
+            wheel->current_tick += idle_ticks;
+            wheel->last_tick_ms += idle_ticks * DTN_TIMER_WHEEL_TICK_MS;
+            break;
+        }
+        wheel->last_tick_ms += DTN_TIMER_WHEEL_TICK_MS;
+        wheel->current_tick++;
+
+        for (int level = 1; level < DTN_TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->current_tick & ((1UL << (DTN_TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            dtn_timer_wheel_cascade(wheel, level);
+        }
+
+        // Detached first, so callbacks may schedule or cancel any timer, these included
+        DTN_Timer* due = wheel->slots[0][wheel->current_tick & (DTN_TIMER_WHEEL_SLOTS - 1)];
+        wheel->slots[0][wheel->current_tick & (DTN_TIMER_WHEEL_SLOTS - 1)] = NULL;
+        if (due) {
+            due->pprev = &due;
+        }
+        while (due != NULL) {
+            DTN_Timer* timer = due;
+            dtn_timer_unlink(timer);
+            wheel->count--;
+            wheel->expire(wheel, timer, wheel->arg);
+        }
+    }
+}
+
+static void dtn_timer_wheel_tick(void* arg) {
+    DTN_Timer_Wheel* wheel = (DTN_Timer_Wheel*)arg;
+    wheel->running = false;
+    dtn_timer_wheel_advance(wheel, sys_now());
+    if (wheel->count > 0 && !wheel->running) {
+        wheel->running = true;
+        sys_timeout(DTN_TIMER_WHEEL_TICK_MS, dtn_timer_wheel_tick, wheel);
+    }
+}
@@ -0,0 +1,63 @@
+// egress_table.c: Multibit trie for longest-prefix-match egress interface selection
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "egress_table.h"
+#include <stdio.h>
+#include <string.h>
+
+void egress_table_init(Egress_Table* table) {
+    memset(table, 0, sizeof(*table));
+    table->node_count = 1;      // the root
+    table->default_value = EGRESS_TABLE_NO_MATCH;
+}
+
+// Adds prefix/prefix_len -> value, replacing an entry for the same prefix.
+// Returns 0 on success, -1 if the table is full.
+int egress_table_insert(Egress_Table* table, const ip6_addr_t* prefix, u8_t prefix_len, u8_t value) {
+    if (prefix_len > 128 || value >= 255) return -1;
+    if (prefix_len == 0) {
+        table->default_value = value;
+        return 0;
+    }
+
+    // Walk the whole bytes of the prefix, the last (possibly partial) byte is expanded into its node
+    const u8_t* bytes = (const u8_t*)prefix->addr;
+    int last = (prefix_len - 1) / 8;
+    u16_t node = 0;
+    for (int i = 0; i < last; i++) {
+        Egress_Table_Node* n = &table->nodes[node];
+        if (n->child[bytes[i]] == 0) {
+            if (table->node_count == EGRESS_TABLE_MAX_NODES) {
+                fprintf(stderr, "Egress Table: Out of trie nodes\n");
+                return -1;
+            }
+            n->child[bytes[i]] = table->node_count++;
+        }
+        node = n->child[bytes[i]];
+    }
+
+    int bits = prefix_len - last * 8;
+    u8_t mask = (u8_t)(0xFF << (8 - bits));
+    int first = bytes[last] & mask;
+    int count = 1 << (8 - bits);
+    Egress_Table_Node* n = &table->nodes[node];
+    for (int slot = first; slot < first + count; slot++) {
+        if (n->value[slot] == 0 || n->prefix_len[slot] <= prefix_len) {
+            n->value[slot] = value + 1;
+            n->prefix_len[slot] = prefix_len;
+        }
+    }
+    return 0;
+}
@@ -19,11 +19,12 @@
 #include <fcntl.h>     
 #include <unistd.h>     
 #include <sys/ioctl.h> 
+#include <sys/socket.h>
 #include <linux/if.h>  
 #include <linux/if_tun.h>
 #include <sys/stat.h>
 #include <errno.h>     
-#include <sys/select.h> 
+#include <sys/epoll.h>
 #include <sys/time.h>  
 #include <stdbool.h>    
 
@@ -44,6 +45,11 @@
 #include "dtn_icmpv6.h" 
 #include "raw_socket.h"
 #include "dtn_storage.h"
+#include "dtn_event_loop.h"
+#include "tun_queue.h"
+#include "dtn_custody.h"
+#include "dtn_packet.h"
+#include "packet_ring.h"
 
 #define TUN_IFNAME "tun0"
 #define PACKET_BUF_SIZE 2048
@@ -51,9 +57,16 @@
 #define HOST_LWIP_IPV6_ADDR "fd00::2"
 #define HOST_enp0s9_IPV6_ADDR "fd00:01::2"
 #define HOST_enp0s8_IPV6_ADDR "fd00:12::1"
-#define CONTACT_CHECK_INTERVAL_MS 1000
+#ifndef TUN_QUEUES
+#define TUN_QUEUES 1            // above 1 the device is multi-queue, the extra queues are read by worker threads
+#endif
+#ifndef TUN_INPUT_BUDGET
+#define TUN_INPUT_BUDGET 64     // packets read per wakeup before timers and contacts get their turn
+#endif
 
 DTN_Module* global_dtn_module = NULL;
+static DTN_Event_Loop event_loop;
+static Tun_Queues tun_queues;
 
 int tun_alloc(char *dev_name, int max_len);
 err_t tunif_output(struct netif *netif, struct pbuf *p);
@@ -66,7 +79,7 @@ int tun_alloc(char *dev_name, int max_len) {
     int fd = open("/dev/net/tun", O_RDWR);
     if (fd < 0) { perror("Opening /dev/net/tun"); return fd; }
     memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | (TUN_QUEUES > 1 ? IFF_MULTI_QUEUE : 0);
     if (dev_name && *dev_name) { strncpy(ifr.ifr_name, dev_name, IFNAMSIZ); ifr.ifr_name[IFNAMSIZ - 1] = '\0'; }
     if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) { perror("ioctl(TUNSETIFF)"); close(fd); return -1; }
     strncpy(dev_name, ifr.ifr_name, max_len); dev_name[max_len - 1] = '\0';
@@ -103,21 +116,30 @@ err_t tunif_input(struct netif *netif) {
          return ERR_IF;
      }
 
+     // Read until the device is empty or the budget is spent, then process the batch as a whole
      int tun_fd = *(int *)netif->state;
      char buf[PACKET_BUF_SIZE]; 
-     ssize_t len = read(tun_fd, buf, sizeof(buf));
+     struct pbuf *batch[TUN_INPUT_BUDGET];
+     int count = 0;
+     err_t result = ERR_OK;
 
-     if (len < 0) { if (errno == EAGAIN || errno == EWOULDBLOCK) { return ERR_OK; } perror("TUN read error"); return ERR_IF; }
-     if (len == 0) { printf("TUN read 0 bytes, tunnel closed by peer?\n"); return ERR_CONN; }
+     while (count < TUN_INPUT_BUDGET) {
+         ssize_t len = read(tun_fd, buf, sizeof(buf));
 
-     struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
-     if (!p) { fprintf(stderr, "Failed to allocate pbuf for incoming packet of size %zd\n", len); return ERR_MEM; }
+         if (len < 0) { if (errno == EAGAIN || errno == EWOULDBLOCK) { break; } perror("TUN read error"); result = ERR_IF; break; }
+         if (len == 0) { printf("TUN read 0 bytes, tunnel closed by peer?\n"); result = ERR_CONN; break; }
 
-     err_t copy_err = pbuf_take(p, buf, len);
-     if (copy_err != ERR_OK) { fprintf(stderr, "Failed to copy buffer to pbuf (%d)\n", copy_err); pbuf_free(p); return copy_err; }
+         struct pbuf *p = pbuf_alloc(DTN_CUSTODY_HEADROOM, len, PBUF_POOL);
+         if (!p) { fprintf(stderr, "Failed to allocate pbuf for incoming packet of size %zd\n", len); result = ERR_MEM; break; }
 
-     dtn_controller_process_incoming(global_dtn_module->controller, p, netif);
-     return ERR_OK;
+         err_t copy_err = pbuf_take(p, buf, len);
+         if (copy_err != ERR_OK) { fprintf(stderr, "Failed to copy buffer to pbuf (%d)\n", copy_err); pbuf_free(p); continue; }
+
+         batch[count++] = p;
+     }
+
+     dtn_controller_process_incoming_batch(global_dtn_module->controller, batch, count, netif);
+     return result;
 }
 
 err_t tunif_ip6_output(struct netif *netif, struct pbuf *p, const ip6_addr_t *ipaddr) {
@@ -136,6 +158,117 @@ err_t tunif_init(struct netif *netif) {
     return ERR_OK;
 }
 
+static void on_tun_readable(int fd, u32_t events, void *arg) {
+    LWIP_UNUSED_ARG(fd);
+    LWIP_UNUSED_ARG(events);
+    if (tunif_input((struct netif *)arg) == ERR_CONN) {
+        fprintf(stderr, "TUN connection closed. Exiting.\n");
+        dtn_event_loop_stop(&event_loop);
+    }
+}
+
+// Packets the queue workers have read, processed here since lwIP, routing and storage belong to this thread
+static void on_tun_queue_packets(int fd, u32_t events, void *arg) {
+    LWIP_UNUSED_ARG(fd);
+    LWIP_UNUSED_ARG(events);
+    struct netif *netif = (struct netif *)arg;
+    bool closed;
+    Tun_Packet *packet = tun_queue_take(&tun_queues, &closed);
+    struct pbuf *batch[TUN_INPUT_BUDGET];
+    int count = 0;
+
+    while (packet != NULL) {
+        Tun_Packet *next = packet->next;
+        // The worker read the packet into its handoff buffer, the pbuf is wrapped around it in place
+        struct pbuf *p = tun_queue_packet_pbuf(packet);
+        if (!p) {
+            fprintf(stderr, "Incoming packet of size %u does not fit a pbuf\n", packet->len);
+            tun_queue_release(packet);
+        } else {
+            batch[count++] = p;
+        }
+        packet = next;
+
+        if (count == TUN_INPUT_BUDGET || (packet == NULL && count > 0)) {
+            dtn_controller_process_incoming_batch(global_dtn_module->controller, batch, count, netif);
+            count = 0;
+        }
+    }
+
+    if (closed) {
+        fprintf(stderr, "TUN queue closed. Exiting.\n");
+        dtn_event_loop_stop(&event_loop);
+    }
+}
+
+// Packets taken off a receive ring during one wakeup
+typedef struct {
+    struct netif *netif;
+    struct pbuf *batch[TUN_INPUT_BUDGET];
+    int count;
+} Ring_Input_Batch;
+
+// The ring sees every IPv6 packet on the link, only those carrying the custodian option are DTN traffic
+static void on_ring_packet(const u8_t *data, size_t len, void *arg) {
+    Ring_Input_Batch *input = (Ring_Input_Batch *)arg;
+    DTN_Packet_Info info;
+    if (len > PACKET_BUF_SIZE || !dtn_packet_parse_buffer(data, len, &info) || info.custody_offset == 0) {
+        return;
+    }
+
+    struct pbuf *p = pbuf_alloc(DTN_CUSTODY_HEADROOM, (u16_t)len, PBUF_POOL);
+    if (!p) {
+        fprintf(stderr, "Failed to allocate pbuf for ring packet of size %zu\n", len);
+        return;
+    }
+    if (pbuf_take(p, data, (u16_t)len) != ERR_OK) {
+        pbuf_free(p);
+        return;
+    }
+
+    input->batch[input->count++] = p;
+    if (input->count == TUN_INPUT_BUDGET) {
+        dtn_controller_process_incoming_batch(global_dtn_module->controller, input->batch, input->count, input->netif);
+        input->count = 0;
+    }
+}
+
+static void on_ring_readable(int fd, u32_t events, void *arg) {
+    LWIP_UNUSED_ARG(fd);
+    LWIP_UNUSED_ARG(events);
+    Ring_Input_Batch input;
+    input.netif = netif_default;     // ring packets enter as if the host had routed them to the TUN device
+    input.count = 0;
+    packet_ring_receive((Packet_Ring *)arg, on_ring_packet, &input);
+    if (input.count > 0) {
+        dtn_controller_process_incoming_batch(global_dtn_module->controller, input.batch, input.count, input.netif);
+    }
+}
+
+// Keeps the ring's neighbor cache in step with the kernel, off the send path
+static void on_ring_neighbors(int fd, u32_t events, void *arg) {
+    LWIP_UNUSED_ARG(fd);
+    LWIP_UNUSED_ARG(events);
+    packet_ring_receive_neighbors((Packet_Ring *)arg);
+}
+
+static void on_storage_completion(int fd, u32_t events, void *arg) {
+    LWIP_UNUSED_ARG(fd);
+    LWIP_UNUSED_ARG(events);
+    dtn_storage_process_completions((Storage_Function *)arg);
+}
+
+// The raw sockets only send, they are watched for the errors the kernel reports asynchronously
+static void on_raw_socket_error(int fd, u32_t events, void *arg) {
+    LWIP_UNUSED_ARG(events);
+    LWIP_UNUSED_ARG(arg);
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0) {
+        fprintf(stderr, "Raw socket %d error: %s\n", fd, strerror(err));
+    }
+}
+
 int main() {
     lwip_init();
 
@@ -169,7 +302,7 @@ int main() {
     }
     printf("TUN device '%s' created successfully (fd: %d).\n", tun_name, tun_fd);
 
-    if (raw_socket_init("enp0s8", "enp0s9") < 0) {
+    if (raw_socket_init(RAW_SOCKET_EGRESS_FILE) < 0) {
         fprintf(stderr, "Failed to initialize raw sockets\n");
         netif_remove(&tun_netif);
         close(tun_fd);
@@ -338,32 +471,62 @@ int main() {
 
     printf("Entering main loop...\n");
 
-    while (1) {
-        fd_set readfds; 
-        FD_ZERO(&readfds);
-        FD_SET(tun_fd, &readfds);
+    if (dtn_event_loop_init(&event_loop) < 0 ||
+        dtn_event_loop_add(&event_loop, tun_fd, EPOLLIN, on_tun_readable, &tun_netif) < 0) {
+        fprintf(stderr, "Failed to set up the event loop\n");
+        dtn_event_loop_stop(&event_loop);
+    }
 
-        struct timeval tv; 
-        u32_t lwip_timeout_ms = sys_timeouts_sleeptime();
+    for (int i = 0; i < raw_socket_count(); i++) {
+        Packet_Ring *ring = raw_socket_ring(i);
+        if (dtn_event_loop_add(&event_loop, raw_socket_fd(i), 0, on_raw_socket_error, NULL) < 0 ||
+            (ring && dtn_event_loop_add(&event_loop, ring->rx_fd, EPOLLIN, on_ring_readable, ring) < 0) ||
+            (ring && dtn_event_loop_add(&event_loop, ring->neigh_fd, EPOLLIN, on_ring_neighbors, ring) < 0)) {
+            dtn_event_loop_stop(&event_loop);
+        }
+    }
 
-        u32_t app_timeout_ms = CONTACT_CHECK_INTERVAL_MS;
-        if (lwip_timeout_ms != SYS_TIMEOUTS_SLEEPTIME_INFINITE && lwip_timeout_ms < app_timeout_ms) {
-            app_timeout_ms = lwip_timeout_ms;
+    // The main loop reads the first queue itself, workers read the others
+    int worker_fds[TUN_QUEUES];
+    int worker_count = 0;
+    for (int i = 1; i < TUN_QUEUES; i++) {
+        char queue_name[IFNAMSIZ];
+        strncpy(queue_name, tun_name, sizeof(queue_name));
+        int queue_fd = tun_alloc(queue_name, sizeof(queue_name));
+        if (queue_fd < 0 || fcntl(queue_fd, F_SETFL, fcntl(queue_fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+            fprintf(stderr, "Failed to open TUN queue %d, continuing with %d queues\n", i, i);
+            if (queue_fd >= 0) close(queue_fd);
+            break;
+        }
+        worker_fds[worker_count++] = queue_fd;
+    }
+    if (worker_count > 0) {
+        if (tun_queue_start(&tun_queues, worker_fds, worker_count) < 0 ||
+            dtn_event_loop_add(&event_loop, tun_queues.notify_fd, EPOLLIN, on_tun_queue_packets, &tun_netif) < 0) {
+            dtn_event_loop_stop(&event_loop);
         }
+    }
 
-        tv.tv_sec = app_timeout_ms / 1000;
-        tv.tv_usec = (app_timeout_ms % 1000) * 1000;
+    int storage_fd = dtn_storage_completion_fd(global_dtn_module->storage);
+    if (storage_fd >= 0 &&
+        dtn_event_loop_add(&event_loop, storage_fd, EPOLLIN, on_storage_completion, global_dtn_module->storage) < 0) {
+        dtn_event_loop_stop(&event_loop);
+    }
 
-        int ret = select(tun_fd + 1, &readfds, NULL, NULL, &tv);
+    while (event_loop.running) {
+        // Sleep until the next lwIP timeout or contact change, unless a descriptor wakes us first
+        u32_t sleep_ms = sys_timeouts_sleeptime();
+        u32_t contact_ms = dtn_routing_next_contact_change_ms(global_dtn_module->routing);
+        if (contact_ms < sleep_ms) {
+            sleep_ms = contact_ms;
+        }
 
-        if (ret < 0) { if (errno == EINTR) { continue; } perror("select error"); break; }
+        if (dtn_event_loop_wait(&event_loop, sleep_ms) < 0) {
+            break;
+        }
 
         sys_check_timeouts();
 
-        if (FD_ISSET(tun_fd, &readfds)) {
-            if (tunif_input(&tun_netif) == ERR_CONN) { fprintf(stderr, "TUN connection closed. Exiting.\n"); break; }
-        }
-
         bool cont = false;
         if (global_dtn_module && global_dtn_module->routing) {
             cont = dtn_routing_update_contacts(global_dtn_module->routing);
@@ -372,6 +535,14 @@ int main() {
         if (global_dtn_module && global_dtn_module->controller && cont) {
              dtn_controller_attempt_forward_stored(global_dtn_module->controller, &tun_netif);
         }
+
+        // Destinations whose retry backoff ran out during sys_check_timeouts
+        if (global_dtn_module && global_dtn_module->controller) {
+            dtn_controller_forward_due(global_dtn_module->controller);
+        }
+
+        // Everything sent during this iteration leaves in one batch per interface
+        raw_socket_flush();
     }
 
     if (global_dtn_module && global_dtn_module->routing) {
@@ -380,9 +551,17 @@ int main() {
     printf("Shutting down...\n");
     netif_set_down(&tun_netif);
     netif_remove(&tun_netif);
+    dtn_event_loop_destroy(&event_loop);
     close(tun_fd); 
     dtn_module_cleanup(global_dtn_module); 
     raw_socket_cleanup();
+    // Last, storage and the raw sockets may still have held pbufs in the workers' buffers
+    if (worker_count > 0) {
+        tun_queue_stop(&tun_queues);
+        for (int i = 0; i < worker_count; i++) {
+            close(worker_fds[i]);
+        }
+    }
 
     printf("Shutdown complete.\n");
     return 0;
@@ -0,0 +1,343 @@
+// packet_ring.c: AF_PACKET link backend with mmap'd TPACKET_V3 rings for batched transmit and direct receive
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "packet_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+// Where a frame's data starts in a transmit slot
+#define PACKET_RING_TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+static int packet_ring_setup(int fd, int ring, unsigned int blocks, unsigned int block_timeout_ms, u8_t** map, size_t* map_len) {
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("Packet Ring: Failed to select TPACKET_V3");
+        return -1;
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = PACKET_RING_BLOCK_SIZE;
+    req.tp_block_nr = blocks;
+    req.tp_frame_size = PACKET_RING_FRAME_SIZE;
+    req.tp_frame_nr = (PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE) * blocks;
+    req.tp_retire_blk_tov = block_timeout_ms;
+    if (setsockopt(fd, SOL_PACKET, ring, &req, sizeof(req)) < 0) {
+        perror("Packet Ring: Failed to set up ring");
+        return -1;
+    }
+
+    *map_len = (size_t)PACKET_RING_BLOCK_SIZE * blocks;
+    *map = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+        perror("Packet Ring: Failed to map ring");
+        *map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int packet_ring_bind(int fd, int if_index, u16_t protocol) {
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = protocol;
+    sll.sll_ifindex = if_index;
+    if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+        perror("Packet Ring: Failed to bind to interface");
+        return -1;
+    }
+    return 0;
+}
+
+// Asks for the whole IPv6 neighbor table, the answer arrives on the event loop like any notification
+static int packet_ring_request_neighbors(Packet_Ring* ring) {
+    struct {
+        struct nlmsghdr nh;
+        struct ndmsg ndm;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+    req.nh.nlmsg_type = RTM_GETNEIGH;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.ndm.ndm_family = AF_INET6;
+    if (send(ring->neigh_fd, &req, req.nh.nlmsg_len, 0) < 0) {
+        perror("Packet Ring: Failed to query neighbor table");
+        return -1;
+    }
+    return 0;
+}
+
+// Subscribes to the kernel's neighbor changes and requests the current table
+static int packet_ring_watch_neighbors(Packet_Ring* ring) {
+    ring->neigh_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (ring->neigh_fd < 0) {
+        perror("Packet Ring: Failed to open netlink socket");
+        return -1;
+    }
+
+    struct sockaddr_nl snl;
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = RTMGRP_NEIGH;
+    if (bind(ring->neigh_fd, (struct sockaddr*)&snl, sizeof(snl)) < 0) {
+        perror("Packet Ring: Failed to subscribe to neighbor changes");
+        return -1;
+    }
+    return packet_ring_request_neighbors(ring);
+}
+
+// Applies one neighbor table message to the cache: usable entries are added or refreshed,
+// anything else drops the neighbor until it is resolved again
+static void packet_ring_update_neighbor(Packet_Ring* ring, const struct nlmsghdr* nh) {
+    const struct ndmsg* ndm = (const struct ndmsg*)NLMSG_DATA(nh);
+    if (ndm->ndm_family != AF_INET6 || ndm->ndm_ifindex != ring->if_index) return;
+
+    const u8_t* dst = NULL;
+    const u8_t* lladdr = NULL;
+    int attr_len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(struct ndmsg));
+    for (const struct rtattr* rta = (const struct rtattr*)((const u8_t*)ndm + NLMSG_ALIGN(sizeof(struct ndmsg)));
+         RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+        if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == 16) dst = RTA_DATA(rta);
+        if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == 6) lladdr = RTA_DATA(rta);
+    }
+    if (!dst) return;
+
+    Packet_Ring_Neighbor* neighbor = NULL;
+    Packet_Ring_Neighbor* spare = NULL;
+    for (int i = 0; i < PACKET_RING_NEIGH_CACHE; i++) {
+        Packet_Ring_Neighbor* cached = &ring->neighbors[i];
+        if (!cached->is_valid) {
+            if (!spare) spare = cached;
+        } else if (memcmp(cached->addr.addr, dst, 16) == 0) {
+            neighbor = cached;
+            break;
+        }
+    }
+
+    bool usable = nh->nlmsg_type == RTM_NEWNEIGH && lladdr &&
+                  (ndm->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT));
+    if (!usable) {
+        if (neighbor) neighbor->is_valid = false;
+        return;
+    }
+    if (!neighbor) {
+        // Without a free entry the cache is overwritten in turn
+        neighbor = spare;
+        if (!neighbor) {
+            neighbor = &ring->neighbors[ring->neighbors_next];
+            ring->neighbors_next = (ring->neighbors_next + 1) % PACKET_RING_NEIGH_CACHE;
+        }
+        memcpy(neighbor->addr.addr, dst, 16);
+        ip6_addr_clear_zone(&neighbor->addr);
+        neighbor->is_valid = true;
+    }
+    memcpy(neighbor->mac, lladdr, 6);
+}
+
+// Reads the pending neighbor table dump and change notifications, called when neigh_fd is readable
+void packet_ring_receive_neighbors(Packet_Ring* ring) {
+    char buf[8192];
+    while (1) {
+        ssize_t len = recv(ring->neigh_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // Notifications were lost, the whole table is read again
+                fprintf(stderr, "Packet Ring: Missed neighbor changes on %s, reloading\n", ring->if_name);
+                packet_ring_request_neighbors(ring);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Packet Ring: Failed to read neighbor changes");
+            }
+            return;
+        }
+        for (struct nlmsghdr* nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type == RTM_NEWNEIGH || nh->nlmsg_type == RTM_DELNEIGH) {
+                packet_ring_update_neighbor(ring, nh);
+            }
+        }
+    }
+}
+
+// Opens both rings of an interface. Returns 0 on success, -1 on failure (the ring is left closed).
+int packet_ring_open(Packet_Ring* ring, const char* if_name) {
+    memset(ring, 0, sizeof(*ring));
+    ring->rx_fd = -1;
+    ring->tx_fd = -1;
+    ring->neigh_fd = -1;
+    strncpy(ring->if_name, if_name, PACKET_RING_IF_NAME_LEN - 1);
+
+    ring->if_index = if_nametoindex(if_name);
+    if (ring->if_index == 0) {
+        perror("Packet Ring: Unknown interface");
+        return -1;
+    }
+
+    ring->rx_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IPV6));
+    ring->tx_fd = socket(AF_PACKET, SOCK_RAW, 0);     // transmit only, it gets no copies of received packets
+    if (ring->rx_fd < 0 || ring->tx_fd < 0) {
+        perror("Packet Ring: Failed to create AF_PACKET socket");
+        packet_ring_close(ring);
+        return -1;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+    if (ioctl(ring->tx_fd, SIOCGIFHWADDR, &ifr) < 0) {
+        perror("Packet Ring: Failed to get interface MAC address");
+        packet_ring_close(ring);
+        return -1;
+    }
+    memcpy(ring->mac, ifr.ifr_hwaddr.sa_data, sizeof(ring->mac));
+
+    if (packet_ring_setup(ring->rx_fd, PACKET_RX_RING, PACKET_RING_RX_BLOCKS, PACKET_RING_RX_BLOCK_TIMEOUT_MS,
+                          &ring->rx_map, &ring->rx_map_len) < 0 ||
+        packet_ring_setup(ring->tx_fd, PACKET_TX_RING, PACKET_RING_TX_BLOCKS, 0,
+                          &ring->tx_map, &ring->tx_map_len) < 0) {
+        packet_ring_close(ring);
+        return -1;
+    }
+    ring->tx_frames = (PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE) * PACKET_RING_TX_BLOCKS;
+
+#ifdef PACKET_IGNORE_OUTGOING
+    // Our own transmissions would otherwise come back on the receive ring, sll_pkttype is checked as well
+    int one = 1;
+    setsockopt(ring->rx_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+    if (packet_ring_bind(ring->rx_fd, ring->if_index, htons(ETH_P_IPV6)) < 0 ||
+        packet_ring_bind(ring->tx_fd, ring->if_index, htons(ETH_P_IPV6)) < 0 ||
+        packet_ring_watch_neighbors(ring) < 0) {
+        packet_ring_close(ring);
+        return -1;
+    }
+
+    printf("Packet Ring: %s (index %d) rx %zu KB, tx %u slots\n",
+           if_name, ring->if_index, ring->rx_map_len / 1024, ring->tx_frames);
+    return 0;
+}
+
+void packet_ring_close(Packet_Ring* ring) {
+    if (ring->rx_map) munmap(ring->rx_map, ring->rx_map_len);
+    if (ring->tx_map) munmap(ring->tx_map, ring->tx_map_len);
+    if (ring->rx_fd >= 0) close(ring->rx_fd);
+    if (ring->tx_fd >= 0) close(ring->tx_fd);
+    if (ring->neigh_fd >= 0) close(ring->neigh_fd);
+    ring->rx_map = NULL;
+    ring->tx_map = NULL;
+    ring->rx_fd = -1;
+    ring->tx_fd = -1;
+    ring->neigh_fd = -1;
+}
+
+// The neighbor's MAC address, NULL while the kernel hasn't reported it resolved. Only the cache is
+// consulted; a packet to an unresolved neighbor goes through the raw socket, which has the kernel
+// resolve it, and the notification that follows fills the cache.
+static const u8_t* packet_ring_neighbor(const Packet_Ring* ring, const ip6_addr_t* addr) {
+    for (int i = 0; i < PACKET_RING_NEIGH_CACHE; i++) {
+        const Packet_Ring_Neighbor* cached = &ring->neighbors[i];
+        if (cached->is_valid && memcmp(cached->addr.addr, addr->addr, sizeof(addr->addr)) == 0) {
+            return cached->mac;
+        }
+    }
+    return NULL;
+}
+
+// Puts the packet in the next transmit slot behind an Ethernet header, it goes out with the next flush.
+// Returns 0 if it was queued, -1 if the caller has to send it some other way.
+int packet_ring_send(Packet_Ring* ring, struct pbuf* p, const ip6_addr_t* next_hop) {
+    if (!ring->tx_map) return -1;
+
+    size_t len = PACKET_RING_ETH_HLEN + p->tot_len;
+    if (len > PACKET_RING_FRAME_SIZE - PACKET_RING_TX_DATA_OFFSET) return -1;
+
+    const u8_t* mac = packet_ring_neighbor(ring, next_hop);
+    if (!mac) return -1;
+
+    struct tpacket3_hdr* hdr = (struct tpacket3_hdr*)(ring->tx_map + (size_t)ring->tx_next * PACKET_RING_FRAME_SIZE);
+    if (hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+        packet_ring_flush(ring);
+        if (hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) return -1;
+    }
+    if (hdr->tp_status & TP_STATUS_WRONG_FORMAT) {
+        fprintf(stderr, "Packet Ring: %s rejected a frame\n", ring->if_name);
+    }
+
+    u8_t* frame = (u8_t*)hdr + PACKET_RING_TX_DATA_OFFSET;
+    memcpy(frame, mac, 6);
+    memcpy(frame + 6, ring->mac, 6);
+    frame[12] = ETH_P_IPV6 >> 8;
+    frame[13] = ETH_P_IPV6 & 0xFF;
+    pbuf_copy_partial(p, frame + PACKET_RING_ETH_HLEN, p->tot_len, 0);
+
+    hdr->tp_len = len;
+    hdr->tp_next_offset = 0;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    ring->tx_next = (ring->tx_next + 1) % ring->tx_frames;
+    ring->tx_queued++;
+    return 0;
+}
+
+// Has the kernel transmit every slot filled since the last flush, with one syscall
+void packet_ring_flush(Packet_Ring* ring) {
+    if (ring->tx_queued == 0) return;
+    if (send(ring->tx_fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        perror("Packet Ring: Failed to transmit ring");
+    }
+    ring->tx_queued = 0;
+}
+
+// Hands every received IPv6 packet to input, then returns the blocks to the kernel
+void packet_ring_receive(Packet_Ring* ring, Packet_Ring_Input input, void* arg) {
+    if (!ring->rx_map) return;
+
+    while (1) {
+        struct tpacket_block_desc* block =
+            (struct tpacket_block_desc*)(ring->rx_map + (size_t)ring->rx_block * PACKET_RING_BLOCK_SIZE);
+        if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) break;
+        __sync_synchronize();
+
+        struct tpacket3_hdr* hdr = (struct tpacket3_hdr*)((u8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+        for (u32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+            const struct sockaddr_ll* sll = (const struct sockaddr_ll*)((u8_t*)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            u32_t link_len = hdr->tp_net - hdr->tp_mac;
+            if (sll->sll_pkttype != PACKET_OUTGOING && hdr->tp_snaplen > link_len) {
+                input((const u8_t*)hdr + hdr->tp_net, hdr->tp_snaplen - link_len, arg);
+            }
+            hdr = (struct tpacket3_hdr*)((u8_t*)hdr + hdr->tp_next_offset);
+        }
+
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        ring->rx_block = (ring->rx_block + 1) % PACKET_RING_RX_BLOCKS;
+    }
+}
@@ -13,6 +13,7 @@
 // You should have received a copy of the GNU Affero General Public License
 // along with this program. If not, see <https://www.gnu.org/licenses/>.
 
+#define _GNU_SOURCE /* pull in sendmmsg() on Linux */
 #include "raw_socket.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,156 +26,350 @@
 #include <linux/if_packet.h>
 #include <netinet/ip6.h>
 #include <errno.h>
+#include <ctype.h>
 #include "lwip/pbuf.h"
 #include "lwip/ip6_addr.h"
+#include "egress_table.h"
+#include "dtn_routing.h"
+#if RAW_SOCKET_PACKET_RING
+#include "packet_ring.h"
+#endif
 
-// Interface indices
-static int if_index_1 = 0;  // enp0s8
-static int if_index_2 = 0;  // enp0s9
-static char if_name_1_global[IFNAMSIZ] = {0};
-static char if_name_2_global[IFNAMSIZ] = {0};
+// Packets queued for one socket, sent together by raw_socket_flush
+typedef struct {
+    struct mmsghdr msgs[RAW_SOCKET_BATCH_PACKETS];
+    struct iovec iov[RAW_SOCKET_BATCH_PACKETS][RAW_SOCKET_MAX_IOV];
+    struct sockaddr_in6 addrs[RAW_SOCKET_BATCH_PACKETS];
+    struct pbuf *pbufs[RAW_SOCKET_BATCH_PACKETS];     // referenced until sent
+    void *owners[RAW_SOCKET_BATCH_PACKETS];           // freed once sent
+    unsigned int count;
+    size_t bytes;
+} Raw_Socket_Batch;
 
-// Socket handles
-int raw_socket_enp0s8 = -1;
-int raw_socket_enp0s9 = -1;
+// Raw socket, send batch and optional packet ring of one egress interface
+typedef struct {
+    char name[IFNAMSIZ];
+    int index;
+    int sock;
+    Raw_Socket_Batch batch;
+#if RAW_SOCKET_PACKET_RING
+    Packet_Ring ring;
+#endif
+} Raw_Socket_Interface;
 
-int raw_socket_init(const char* if_name_1, const char* if_name_2) {
-    struct ifreq ifr;
-    
-    strncpy(if_name_1_global, if_name_1, IFNAMSIZ-1);
-    strncpy(if_name_2_global, if_name_2, IFNAMSIZ-1);
-    
-    raw_socket_enp0s8 = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
-    if (raw_socket_enp0s8 < 0) {
-        perror("Failed to create raw socket for first interface");
-        return -1;
+static Raw_Socket_Interface interfaces[RAW_SOCKET_MAX_INTERFACES];
+static int interface_count = 0;
+static Egress_Table egress_table;
+
+// Used without an egress file, the routes of the testbed nodes:
+// Node1 --> If destination is in fd00:1::/64, use enp0s9, otherwise use enp0s8
+// Node2 --> If destination is in fd00:23::/64, use enp0s9, otherwise use enp0s8
+static const char *const default_egress[] = {
+    "::/0 enp0s8",
+    "fd00:23::/64 enp0s9",
+    "fd00:33::/64 enp0s9",
+};
+
+// Opens the raw socket of an interface, once per name. Returns its slot, or -1 on failure.
+static int raw_socket_open_interface(const char *if_name) {
+    for (int i = 0; i < interface_count; i++) {
+        if (strcmp(interfaces[i].name, if_name) == 0) return i;
     }
-    
-    raw_socket_enp0s9 = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
-    if (raw_socket_enp0s9 < 0) {
-        perror("Failed to create raw socket for second interface");
-        close(raw_socket_enp0s8);
+    if (interface_count == RAW_SOCKET_MAX_INTERFACES) {
+        fprintf(stderr, "At most %d egress interfaces\n", RAW_SOCKET_MAX_INTERFACES);
         return -1;
     }
-    
-    memset(&ifr, 0, sizeof(ifr));
-    strncpy(ifr.ifr_name, if_name_1, IFNAMSIZ-1);
-    if (ioctl(raw_socket_enp0s8, SIOCGIFINDEX, &ifr) < 0) {
-        perror("Failed to get interface index for first interface");
-        close(raw_socket_enp0s8);
-        close(raw_socket_enp0s9);
+
+    Raw_Socket_Interface *iface = &interfaces[interface_count];
+    memset(iface, 0, sizeof(*iface));
+    strncpy(iface->name, if_name, IFNAMSIZ - 1);
+
+    iface->sock = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+    if (iface->sock < 0) {
+        fprintf(stderr, "Failed to create raw socket for %s: %s\n", if_name, strerror(errno));
         return -1;
     }
-    if_index_1 = ifr.ifr_ifindex;
-    
+
+    struct ifreq ifr;
     memset(&ifr, 0, sizeof(ifr));
-    strncpy(ifr.ifr_name, if_name_2, IFNAMSIZ-1);
-    if (ioctl(raw_socket_enp0s9, SIOCGIFINDEX, &ifr) < 0) {
-        perror("Failed to get interface index for second interface");
-        close(raw_socket_enp0s8);
-        close(raw_socket_enp0s9);
+    strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+    if (ioctl(iface->sock, SIOCGIFINDEX, &ifr) < 0) {
+        fprintf(stderr, "Failed to get interface index for %s: %s\n", if_name, strerror(errno));
+        close(iface->sock);
         return -1;
     }
-    if_index_2 = ifr.ifr_ifindex;
-    
+    iface->index = ifr.ifr_ifindex;
+
     int on = 1;
-    if (setsockopt(raw_socket_enp0s8, IPPROTO_IPV6, IPV6_HDRINCL, &on, sizeof(on)) < 0) {
-        perror("Failed to set IPV6_HDRINCL option on first socket");
-        close(raw_socket_enp0s8);
-        close(raw_socket_enp0s9);
+    if (setsockopt(iface->sock, IPPROTO_IPV6, IPV6_HDRINCL, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "Failed to set IPV6_HDRINCL option on %s socket: %s\n", if_name, strerror(errno));
+        close(iface->sock);
         return -1;
     }
-    
-    if (setsockopt(raw_socket_enp0s9, IPPROTO_IPV6, IPV6_HDRINCL, &on, sizeof(on)) < 0) {
-        perror("Failed to set IPV6_HDRINCL option on second socket");
-        close(raw_socket_enp0s8);
-        close(raw_socket_enp0s9);
+
+    // Each socket only ever sends through its own interface
+    if (setsockopt(iface->sock, SOL_SOCKET, SO_BINDTODEVICE, iface->name, strlen(iface->name)) < 0) {
+        fprintf(stderr, "Failed to bind socket to %s: %s\n", if_name, strerror(errno));
+        close(iface->sock);
         return -1;
     }
-    
-    printf("Raw sockets initialized:\n");
-    printf("  %s: socket %d, index %d\n", if_name_1, raw_socket_enp0s8, if_index_1);
-    printf("  %s: socket %d, index %d\n", if_name_2, raw_socket_enp0s9, if_index_2);
-    
-    return 0;
+
+#if RAW_SOCKET_PACKET_RING
+    // The raw socket stays the fallback, for neighbors the kernel hasn't resolved yet
+    if (packet_ring_open(&iface->ring, if_name) < 0) {
+        fprintf(stderr, "Packet ring unavailable on %s, sending through the raw socket only\n", if_name);
+    }
+#endif
+
+    printf("  %s: socket %d, index %d\n", iface->name, iface->sock, iface->index);
+    return interface_count++;
 }
 
-int raw_socket_send_ipv6(struct pbuf *p, const ip6_addr_t *dest_addr) {
-    struct sockaddr_in6 sin6;
-    int socket_to_use;
-    int if_index_to_use;
-    char *if_name_to_use;
-    int sent_bytes;
-    char buf[2048];
-    
-    if (p->tot_len > sizeof(buf)) {
-        fprintf(stderr, "Packet too large for raw socket buffer\n");
+// Parses "<prefix>/<length> <interface>" or "node <node id> <interface>" into the egress table
+static int raw_socket_add_egress(const char *line) {
+    char target[64], if_name[IFNAMSIZ];
+    ip6_addr_t prefix;
+    unsigned int prefix_len;
+
+    if (sscanf(line, "node %63s %15s", target, if_name) == 2) {
+        if (nodeid_to_ipv6(strtol(target, NULL, 10), &prefix) < 0) {
+            fprintf(stderr, "Egress table: Unknown node %s\n", target);
+            return -1;
+        }
+        prefix_len = 128;
+    } else if (sscanf(line, "%63s %15s", target, if_name) == 2) {
+        char *slash = strchr(target, '/');
+        prefix_len = 128;
+        if (slash) {
+            *slash = '\0';
+            prefix_len = strtoul(slash + 1, NULL, 10);
+        }
+        if (!ip6addr_aton(target, &prefix) || prefix_len > 128) {
+            fprintf(stderr, "Egress table: Invalid prefix in '%s'\n", line);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "Egress table: Invalid entry '%s'\n", line);
         return -1;
     }
-    
-    if (pbuf_copy_partial(p, buf, p->tot_len, 0) != p->tot_len) {
-        fprintf(stderr, "Failed to copy pbuf data\n");
+
+    int slot = raw_socket_open_interface(if_name);
+    if (slot < 0 || egress_table_insert(&egress_table, &prefix, (u8_t)prefix_len, (u8_t)slot) < 0) {
         return -1;
     }
+    return 0;
+}
 
-    // Node1 --> If destination is in fd00:1::/64, use enp0s9, otherwise use enp0s8
-    // Node2 --> If destination is in fd00:23::/64, use enp0s9, otherwise use enp0s8
-    int use_second_interface = 0;
-    if ((dest_addr->addr[0] == PP_HTONL(0xfd000023) || dest_addr->addr[0] == PP_HTONL(0xfd000033)) &&
-        dest_addr->addr[1] == 0 &&
-        dest_addr->addr[2] == 0) {
-        use_second_interface = 1;
-    }
-    
-    if (use_second_interface) {
-        socket_to_use = raw_socket_enp0s9;
-        if_index_to_use = if_index_2;
-        if_name_to_use = if_name_2_global;
+// Opens a raw socket per interface named in the egress file, or in the built-in table without one
+int raw_socket_init(const char *egress_file) {
+    egress_table_init(&egress_table);
+    interface_count = 0;
+    printf("Raw sockets initialized:\n");
+
+    FILE *f = egress_file ? fopen(egress_file, "r") : NULL;
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            char *p = line;
+            while (*p && isspace((unsigned char)*p)) p++;
+            if (*p == '\0' || *p == '#') continue;
+            if (raw_socket_add_egress(p) < 0) {
+                fclose(f);
+                raw_socket_cleanup();
+                return -1;
+            }
+        }
+        fclose(f);
     } else {
-        socket_to_use = raw_socket_enp0s8;
-        if_index_to_use = if_index_1;
-        if_name_to_use = if_name_1_global;
-    }
-    
-    memset(&sin6, 0, sizeof(sin6));
-    sin6.sin6_family = AF_INET6;
-    sin6.sin6_port = 0;
-    sin6.sin6_flowinfo = 0;
-    sin6.sin6_scope_id = if_index_to_use;
-    
-    memcpy(&sin6.sin6_addr, dest_addr, sizeof(struct in6_addr));
-    
-    if (setsockopt(socket_to_use, SOL_SOCKET, SO_BINDTODEVICE, 
-                  if_name_to_use, strlen(if_name_to_use)) < 0) {
-        perror("Failed to bind socket to interface");
+        for (size_t i = 0; i < sizeof(default_egress) / sizeof(default_egress[0]); i++) {
+            if (raw_socket_add_egress(default_egress[i]) < 0) {
+                raw_socket_cleanup();
+                return -1;
+            }
+        }
+    }
+
+    if (interface_count == 0) {
+        fprintf(stderr, "Egress table is empty\n");
         return -1;
     }
-    
-    sent_bytes = sendto(socket_to_use, buf, p->tot_len, 0, 
-                       (struct sockaddr *)&sin6, sizeof(sin6));
-                       
-    if (sent_bytes < 0) {
-        perror("Failed to send packet via raw socket"); //canvis al node 2
+    if (egress_table.default_value == EGRESS_TABLE_NO_MATCH) {
+        printf("No default egress route, destinations outside the table are dropped\n");
+    }
+    return 0;
+}
+
+static void raw_socket_flush_batch(int sock, Raw_Socket_Batch *batch) {
+    unsigned int done = 0;
+    while (done < batch->count) {
+        int sent = sendmmsg(sock, &batch->msgs[done], batch->count - done, 0);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to send packet via raw socket");
+            done++;     // skip the packet the kernel refused, the rest may still go
+            continue;
+        }
+        for (int i = 0; i < sent; i++) {
+            struct mmsghdr *msg = &batch->msgs[done + i];
+            size_t len = 0;
+            for (size_t j = 0; j < msg->msg_hdr.msg_iovlen; j++) len += msg->msg_hdr.msg_iov[j].iov_len;
+            if (msg->msg_len != len) {
+                fprintf(stderr, "Sent only %u bytes out of %zu\n", msg->msg_len, len);
+            }
+        }
+        done += sent;
+    }
+
+    for (unsigned int i = 0; i < batch->count; i++) {
+        if (batch->pbufs[i]) pbuf_free(batch->pbufs[i]);
+        free(batch->owners[i]);
+        batch->pbufs[i] = NULL;
+        batch->owners[i] = NULL;
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+// Sends every packet queued since the last flush, one sendmmsg per interface
+void raw_socket_flush(void) {
+    for (int i = 0; i < interface_count; i++) {
+        if (interfaces[i].batch.count > 0) raw_socket_flush_batch(interfaces[i].sock, &interfaces[i].batch);
+#if RAW_SOCKET_PACKET_RING
+        packet_ring_flush(&interfaces[i].ring);
+#endif
+    }
+}
+
+static Raw_Socket_Interface *raw_socket_egress(const ip6_addr_t *dest_addr) {
+    int slot = egress_table_lookup(&egress_table, dest_addr);
+    if (slot == EGRESS_TABLE_NO_MATCH) {
+        fprintf(stderr, "No egress interface for %s\n", ip6addr_ntoa(dest_addr));
+        return NULL;
+    }
+    return &interfaces[slot];
+}
+
+// Sets up the next message of the interface's batch, flushing it first if it is full
+static struct mmsghdr *raw_socket_next_msg(Raw_Socket_Interface *iface, const ip6_addr_t *dest_addr, size_t len) {
+    Raw_Socket_Batch *batch = &iface->batch;
+    if (batch->count == RAW_SOCKET_BATCH_PACKETS || batch->bytes + len > RAW_SOCKET_BATCH_BYTES) {
+        raw_socket_flush_batch(iface->sock, batch);
+    }
+
+    unsigned int i = batch->count;
+    struct sockaddr_in6 *sin6 = &batch->addrs[i];
+    memset(sin6, 0, sizeof(*sin6));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = 0;
+    sin6->sin6_flowinfo = 0;
+    sin6->sin6_scope_id = iface->index;
+    memcpy(&sin6->sin6_addr, dest_addr, sizeof(struct in6_addr));
+
+    struct mmsghdr *msg = &batch->msgs[i];
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_hdr.msg_name = sin6;
+    msg->msg_hdr.msg_namelen = sizeof(*sin6);
+    msg->msg_hdr.msg_iov = batch->iov[i];
+    batch->pbufs[i] = NULL;
+    batch->owners[i] = NULL;
+    return msg;
+}
+
+int raw_socket_send_ipv6_buffer(void *data, size_t len, const ip6_addr_t *dest_addr, void *owner) {
+    if (len > RAW_SOCKET_BATCH_BYTES) {
+        fprintf(stderr, "Packet too large for raw socket batch\n");
         return -1;
-    } else if ((size_t)sent_bytes != p->tot_len) {
-        fprintf(stderr, "Sent only %d bytes out of %d\n", sent_bytes, p->tot_len);
+    }
+
+    // On failure owner stays with the caller
+    Raw_Socket_Interface *iface = raw_socket_egress(dest_addr);
+    if (!iface) return -1;
+
+    Raw_Socket_Batch *batch = &iface->batch;
+    struct mmsghdr *msg = raw_socket_next_msg(iface, dest_addr, len);
+    msg->msg_hdr.msg_iov[0].iov_base = data;
+    msg->msg_hdr.msg_iov[0].iov_len = len;
+    msg->msg_hdr.msg_iovlen = 1;
+    batch->owners[batch->count] = owner;
+    batch->count++;
+    batch->bytes += len;
+    return 0;
+}
+
+int raw_socket_send_ipv6(struct pbuf *p, const ip6_addr_t *dest_addr) {
+    if (p->tot_len > RAW_SOCKET_BATCH_BYTES) {
+        fprintf(stderr, "Packet too large for raw socket batch\n");
         return -1;
     }
-    
-    char addr_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &sin6.sin6_addr, addr_str, sizeof(addr_str));
-    
+
+    Raw_Socket_Interface *iface = raw_socket_egress(dest_addr);
+    if (!iface) return -1;
+
+#if RAW_SOCKET_PACKET_RING
+    if (packet_ring_send(&iface->ring, p, dest_addr) == 0) return 0;
+#endif
+
+    size_t segments = 0;
+    for (struct pbuf *q = p; q != NULL && segments <= RAW_SOCKET_MAX_IOV; q = q->next) segments++;
+
+    // Long chains are flattened, others are sent straight from their payloads
+    if (segments > RAW_SOCKET_MAX_IOV) {
+        void *buf = malloc(p->tot_len);
+        if (!buf || pbuf_copy_partial(p, buf, p->tot_len, 0) != p->tot_len) {
+            fprintf(stderr, "Failed to copy pbuf data\n");
+            free(buf);
+            return -1;
+        }
+        if (raw_socket_send_ipv6_buffer(buf, p->tot_len, dest_addr, buf) < 0) {
+            free(buf);
+            return -1;
+        }
+        return 0;
+    }
+
+    Raw_Socket_Batch *batch = &iface->batch;
+    struct mmsghdr *msg = raw_socket_next_msg(iface, dest_addr, p->tot_len);
+    size_t iovlen = 0;
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (q->len == 0) continue;
+        msg->msg_hdr.msg_iov[iovlen].iov_base = q->payload;
+        msg->msg_hdr.msg_iov[iovlen].iov_len = q->len;
+        iovlen++;
+    }
+    msg->msg_hdr.msg_iovlen = iovlen;
+    pbuf_ref(p);
+    batch->pbufs[batch->count] = p;
+    batch->count++;
+    batch->bytes += p->tot_len;
     return 0;
 }
 
+int raw_socket_count(void) {
+    return interface_count;
+}
+
+int raw_socket_fd(int index) {
+    return index < interface_count ? interfaces[index].sock : -1;
+}
+
+Packet_Ring *raw_socket_ring(int index) {
+#if RAW_SOCKET_PACKET_RING
+    if (index < interface_count && interfaces[index].ring.rx_fd >= 0) return &interfaces[index].ring;
+#else
+    (void)index;
+#endif
+    return NULL;
+}
+
 void raw_socket_cleanup(void) {
-    if (raw_socket_enp0s8 >= 0) {
-        close(raw_socket_enp0s8);
-        raw_socket_enp0s8 = -1;
-    }
-    if (raw_socket_enp0s9 >= 0) {
-        close(raw_socket_enp0s9);
-        raw_socket_enp0s9 = -1;
+    raw_socket_flush();
+    for (int i = 0; i < interface_count; i++) {
+#if RAW_SOCKET_PACKET_RING
+        packet_ring_close(&interfaces[i].ring);
+#endif
+        close(interfaces[i].sock);
+        interfaces[i].sock = -1;
     }
+    interface_count = 0;
     printf("Raw sockets closed\n");
-}
\ No newline at end of file
+}
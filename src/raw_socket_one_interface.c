@@ -1,6 +1,7 @@
 // raw_socket.c (versió corregida amb una sola interfície)
 // (Assumeixo raw_socket.h declara prototips i externs necessaris)
 
+#define _GNU_SOURCE /* pull in sendmmsg() on Linux */
 #include "raw_socket.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +24,19 @@ static char if_name_1_global[IFNAMSIZ] = {0};
 // Socket handle
 int raw_socket_enp0s8 = -1;
 
+// Packets queued for the socket, sent together by raw_socket_flush
+typedef struct {
+    struct mmsghdr msgs[RAW_SOCKET_BATCH_PACKETS];
+    struct iovec iov[RAW_SOCKET_BATCH_PACKETS][RAW_SOCKET_MAX_IOV];
+    struct sockaddr_in6 addrs[RAW_SOCKET_BATCH_PACKETS];
+    struct pbuf *pbufs[RAW_SOCKET_BATCH_PACKETS];     // referenced until sent
+    void *owners[RAW_SOCKET_BATCH_PACKETS];           // freed once sent
+    unsigned int count;
+    size_t bytes;
+} Raw_Socket_Batch;
+
+static Raw_Socket_Batch batch_1;
+
 int raw_socket_init(const char* if_name_1) {
     struct ifreq ifr;
     //int tmp_sock = -1;
@@ -63,78 +77,148 @@ int raw_socket_init(const char* if_name_1) {
         return -1;
     }
 
+    // The socket only ever sends through this interface
+    if (setsockopt(raw_socket_enp0s8, SOL_SOCKET, SO_BINDTODEVICE, if_name_1_global, strlen(if_name_1_global)) < 0) {
+        perror("Failed to bind socket to interface");
+        close(raw_socket_enp0s8);
+        return -1;
+    }
+
     printf("Raw socket initialized:\n");
     printf("  %s: socket %d, index %d\n", if_name_1_global, raw_socket_enp0s8, if_index_1);
 
     return 0;
 }
 
-/* Funció d'enviament: converteix ip6_addr_t (lwIP) a struct in6_addr i envia */
-int raw_socket_send_ipv6(struct pbuf *p, const ip6_addr_t *dest_addr) {
-    struct sockaddr_in6 sin6;
-    int socket_to_use;
-    int if_index_to_use;
-    char *if_name_to_use;
-    int sent_bytes;
-    char buf[2048];
-
-    if (p->tot_len > (int)sizeof(buf)) {
-        fprintf(stderr, "Packet too large for raw socket buffer\n");
-        return -1;
+static void raw_socket_flush_batch(int sock, Raw_Socket_Batch *batch) {
+    unsigned int done = 0;
+    while (done < batch->count) {
+        int sent = sendmmsg(sock, &batch->msgs[done], batch->count - done, 0);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to send packet via raw socket");
+            done++;     // skip the packet the kernel refused, the rest may still go
+            continue;
+        }
+        for (int i = 0; i < sent; i++) {
+            struct mmsghdr *msg = &batch->msgs[done + i];
+            size_t len = 0;
+            for (size_t j = 0; j < msg->msg_hdr.msg_iovlen; j++) len += msg->msg_hdr.msg_iov[j].iov_len;
+            if (msg->msg_len != len) {
+                fprintf(stderr, "Sent only %u bytes out of %zu\n", msg->msg_len, len);
+            }
+        }
+        done += sent;
     }
 
-    if (pbuf_copy_partial(p, buf, p->tot_len, 0) != p->tot_len) {
-        fprintf(stderr, "Failed to copy pbuf data\n");
-        return -1;
+    for (unsigned int i = 0; i < batch->count; i++) {
+        if (batch->pbufs[i]) pbuf_free(batch->pbufs[i]);
+        free(batch->owners[i]);
+        batch->pbufs[i] = NULL;
+        batch->owners[i] = NULL;
     }
+    batch->count = 0;
+    batch->bytes = 0;
+}
 
-    // If destination is in fd00:23::/64, use enp0s8
-    int use_second_interface = 0;
-    if (dest_addr->addr[0] == PP_HTONL(0xfd000023) &&
-        dest_addr->addr[1] == 0 &&
-        dest_addr->addr[2] == 0) {
-        use_second_interface = 1;
-    }
-    
-    if (use_second_interface) {
-    } else {
-        socket_to_use = raw_socket_enp0s8;
-        if_index_to_use = if_index_1;
-        if_name_to_use = if_name_1_global;
-    }
+// Sends every packet queued since the last flush with one sendmmsg
+void raw_socket_flush(void) {
+    if (batch_1.count > 0) raw_socket_flush_batch(raw_socket_enp0s8, &batch_1);
+}
 
-    memset(&sin6, 0, sizeof(sin6));
-    sin6.sin6_family = AF_INET6;
-    sin6.sin6_port = 0;
-    sin6.sin6_flowinfo = 0;
-    sin6.sin6_scope_id = if_index_to_use;
+// Sets up the next message of the batch, flushing it first if it is full
+static struct mmsghdr *raw_socket_next_msg(const ip6_addr_t *dest_addr, size_t len, Raw_Socket_Batch **batch_out) {
+    Raw_Socket_Batch *batch = &batch_1;
+    int socket_to_use = raw_socket_enp0s8;
+    int if_index_to_use = if_index_1;
 
-    memcpy(&sin6.sin6_addr, dest_addr, sizeof(struct in6_addr));
+    if (batch->count == RAW_SOCKET_BATCH_PACKETS || batch->bytes + len > RAW_SOCKET_BATCH_BYTES) {
+        raw_socket_flush_batch(socket_to_use, batch);
+    }
 
-    if (setsockopt(socket_to_use, SOL_SOCKET, SO_BINDTODEVICE, 
-                  if_name_to_use, strlen(if_name_to_use)) < 0) {
-        perror("Failed to bind socket to interface");
+    unsigned int i = batch->count;
+    struct sockaddr_in6 *sin6 = &batch->addrs[i];
+    memset(sin6, 0, sizeof(*sin6));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = 0;
+    sin6->sin6_flowinfo = 0;
+    sin6->sin6_scope_id = if_index_to_use;
+    memcpy(&sin6->sin6_addr, dest_addr, sizeof(struct in6_addr));
+
+    struct mmsghdr *msg = &batch->msgs[i];
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_hdr.msg_name = sin6;
+    msg->msg_hdr.msg_namelen = sizeof(*sin6);
+    msg->msg_hdr.msg_iov = batch->iov[i];
+    batch->pbufs[i] = NULL;
+    batch->owners[i] = NULL;
+
+    *batch_out = batch;
+    return msg;
+}
+
+int raw_socket_send_ipv6_buffer(void *data, size_t len, const ip6_addr_t *dest_addr, void *owner) {
+    if (len > RAW_SOCKET_BATCH_BYTES) {
+        fprintf(stderr, "Packet too large for raw socket batch\n");
         return -1;
     }
 
-    sent_bytes = sendto(socket_to_use, buf, p->tot_len, 0,
-                        (struct sockaddr *)&sin6, sizeof(sin6));
+    Raw_Socket_Batch *batch;
+    struct mmsghdr *msg = raw_socket_next_msg(dest_addr, len, &batch);
 
-    if (sent_bytes < 0) {
-        perror("Failed to send packet via raw socket");
-        return -1;
-    } else if ((size_t)sent_bytes != p->tot_len) {
-        fprintf(stderr, "Sent only %d bytes out of %d\n", sent_bytes, p->tot_len);
+    msg->msg_hdr.msg_iov[0].iov_base = data;
+    msg->msg_hdr.msg_iov[0].iov_len = len;
+    msg->msg_hdr.msg_iovlen = 1;
+    batch->owners[batch->count] = owner;
+    batch->count++;
+    batch->bytes += len;
+    return 0;
+}
+
+/* Funció d'enviament: converteix ip6_addr_t (lwIP) a struct in6_addr i envia */
+int raw_socket_send_ipv6(struct pbuf *p, const ip6_addr_t *dest_addr) {
+    if (p->tot_len > RAW_SOCKET_BATCH_BYTES) {
+        fprintf(stderr, "Packet too large for raw socket batch\n");
         return -1;
     }
-    
-    char addr_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &sin6.sin6_addr, addr_str, sizeof(addr_str));
 
+    size_t segments = 0;
+    for (struct pbuf *q = p; q != NULL && segments <= RAW_SOCKET_MAX_IOV; q = q->next) segments++;
+
+    // Long chains are flattened, others are sent straight from their payloads
+    if (segments > RAW_SOCKET_MAX_IOV) {
+        void *buf = malloc(p->tot_len);
+        if (!buf || pbuf_copy_partial(p, buf, p->tot_len, 0) != p->tot_len) {
+            fprintf(stderr, "Failed to copy pbuf data\n");
+            free(buf);
+            return -1;
+        }
+        if (raw_socket_send_ipv6_buffer(buf, p->tot_len, dest_addr, buf) < 0) {
+            free(buf);
+            return -1;
+        }
+        return 0;
+    }
+
+    Raw_Socket_Batch *batch;
+    struct mmsghdr *msg = raw_socket_next_msg(dest_addr, p->tot_len, &batch);
+    size_t iovlen = 0;
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (q->len == 0) continue;
+        msg->msg_hdr.msg_iov[iovlen].iov_base = q->payload;
+        msg->msg_hdr.msg_iov[iovlen].iov_len = q->len;
+        iovlen++;
+    }
+    msg->msg_hdr.msg_iovlen = iovlen;
+    pbuf_ref(p);
+    batch->pbufs[batch->count] = p;
+    batch->count++;
+    batch->bytes += p->tot_len;
     return 0;
 }
 
 void raw_socket_cleanup(void) {
+    raw_socket_flush();
     if (raw_socket_enp0s8 >= 0) {
         close(raw_socket_enp0s8);
         raw_socket_enp0s8 = -1;
@@ -0,0 +1,255 @@
+// tun_queue.c: Worker threads that read the extra queues of a multi-queue TUN device and hand packets to the main loop
+// Copyright (C) 2025 Michael Karpov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "tun_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+// Takes up to count free buffers of a worker in one go, chained through next
+static Tun_Packet* tun_queue_take_buffers(Tun_Queue_Worker* worker, u32_t count) {
+    pthread_mutex_lock(&worker->queues->lock);
+    Tun_Packet* head = worker->free_buffers;
+    Tun_Packet* last = head;
+    for (u32_t i = 1; last != NULL && i < count; i++) {
+        last = last->next;
+    }
+    worker->free_buffers = last ? last->next : NULL;
+    if (last) last->next = NULL;
+    pthread_mutex_unlock(&worker->queues->lock);
+    return head;
+}
+
+// Appends a worker's batch and gives back the buffers it didn't fill, then wakes the main loop
+static void tun_queue_hand_over(Tun_Queue_Worker* worker, Tun_Packet* head, Tun_Packet* tail,
+                                Tun_Packet* spare, u32_t dropped, bool closed) {
+    Tun_Queues* queues = worker->queues;
+
+    pthread_mutex_lock(&queues->lock);
+    if (head != NULL) {
+        if (queues->tail) {
+            queues->tail->next = head;
+        } else {
+            queues->head = head;
+        }
+        queues->tail = tail;
+    }
+    while (spare != NULL) {
+        Tun_Packet* next = spare->next;
+        spare->next = worker->free_buffers;
+        worker->free_buffers = spare;
+        spare = next;
+    }
+    queues->dropped += dropped;
+    if (closed) queues->closed = true;
+    pthread_mutex_unlock(&queues->lock);
+
+    if (dropped > 0) {
+        fprintf(stderr, "TUN Queue: Main loop behind, dropped %u packets\n", dropped);
+    }
+    if (head == NULL && !closed) return;
+    uint64_t one = 1;
+    if (write(queues->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("TUN Queue: Failed to notify main loop");
+    }
+}
+
+static void* tun_queue_worker_main(void* arg) {
+    Tun_Queue_Worker* worker = (Tun_Queue_Worker*)arg;
+    Tun_Queues* queues = worker->queues;
+    u8_t scratch[TUN_QUEUE_PACKET_MAX];     // packets there is no buffer for are read here and dropped
+
+    while (1) {
+        struct pollfd fds[2];
+        fds[0].fd = worker->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = queues->stop_fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("TUN Queue: poll failed");
+            break;
+        }
+        if (fds[1].revents & POLLIN) break;
+
+        // Read until the queue is empty or the budget is spent, straight into the handoff buffers
+        Tun_Packet* spare = tun_queue_take_buffers(worker, TUN_QUEUE_READ_BUDGET);
+        Tun_Packet *head = NULL, *tail = NULL;
+        u32_t dropped = 0;
+        bool closed = false;
+        for (u32_t reads = 0; reads < TUN_QUEUE_READ_BUDGET; reads++) {
+            Tun_Packet* packet = spare;
+            u8_t* buf = packet ? packet->data + TUN_QUEUE_HEADROOM : scratch;
+            ssize_t len = read(worker->fd, buf, TUN_QUEUE_PACKET_MAX);
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("TUN Queue: read error");
+                }
+                break;
+            }
+            if (len == 0) {
+                closed = true;
+                break;
+            }
+            if (!packet) {
+                dropped++;
+                continue;
+            }
+
+            spare = packet->next;
+            packet->next = NULL;
+            packet->len = (u32_t)len;
+            if (tail) {
+                tail->next = packet;
+            } else {
+                head = packet;
+            }
+            tail = packet;
+        }
+
+        tun_queue_hand_over(worker, head, tail, spare, dropped, closed);
+        if (closed) break;
+    }
+    return NULL;
+}
+
+static void tun_queue_pbuf_free(struct pbuf* p) {
+    // The pbuf_custom is the first member of its buffer
+    tun_queue_release((Tun_Packet*)p);
+}
+
+// Wraps a handed over packet in a pbuf without copying it. The headroom in front takes the
+// custody option. Returns NULL if the packet doesn't fit a pbuf, the caller then releases it.
+struct pbuf* tun_queue_packet_pbuf(Tun_Packet* packet) {
+    if (packet->len > 0xFFFF) return NULL;
+    packet->pbuf.custom_free_function = tun_queue_pbuf_free;
+    return pbuf_alloced_custom(DTN_CUSTODY_HEADROOM, (u16_t)packet->len, PBUF_RAM, &packet->pbuf,
+                               packet->data, sizeof(packet->data));
+}
+
+// Gives a buffer back to the worker that filled it
+void tun_queue_release(Tun_Packet* packet) {
+    Tun_Queue_Worker* worker = packet->worker;
+    pthread_mutex_lock(&worker->queues->lock);
+    packet->next = worker->free_buffers;
+    worker->free_buffers = packet;
+    pthread_mutex_unlock(&worker->queues->lock);
+}
+
+// Starts one worker per queue fd (already opened with IFF_MULTI_QUEUE and non-blocking).
+// Returns 0 on success, -1 on failure.
+int tun_queue_start(Tun_Queues* queues, const int* fds, int count) {
+    memset(queues, 0, sizeof(*queues));
+    queues->notify_fd = -1;
+    queues->stop_fd = -1;
+    pthread_mutex_init(&queues->lock, NULL);
+    if (count > TUN_QUEUE_MAX_WORKERS) {
+        fprintf(stderr, "TUN Queue: At most %d worker queues\n", TUN_QUEUE_MAX_WORKERS);
+        return -1;
+    }
+
+    queues->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queues->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queues->notify_fd < 0 || queues->stop_fd < 0) {
+        perror("TUN Queue: Failed to create eventfd");
+        tun_queue_stop(queues);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Tun_Queue_Worker* worker = &queues->workers[i];
+        worker->queues = queues;
+        worker->fd = fds[i];
+        worker->buffers = malloc(TUN_QUEUE_BUFFERS * sizeof(Tun_Packet));
+        if (!worker->buffers) {
+            perror("TUN Queue: Failed to allocate handoff buffers");
+            tun_queue_stop(queues);
+            return -1;
+        }
+        for (int j = TUN_QUEUE_BUFFERS - 1; j >= 0; j--) {
+            worker->buffers[j].worker = worker;
+            worker->buffers[j].next = worker->free_buffers;
+            worker->free_buffers = &worker->buffers[j];
+        }
+        if (pthread_create(&worker->thread, NULL, tun_queue_worker_main, worker) != 0) {
+            perror("TUN Queue: Failed to start worker");
+            tun_queue_stop(queues);
+            return -1;
+        }
+        worker->started = true;
+        queues->count++;
+    }
+
+    printf("TUN Queue: %d worker queues started\n", queues->count);
+    return 0;
+}
+
+// Stops and joins the workers and drops the packets still waiting, the queue fds stay open.
+// The handoff buffers go too, so pbufs wrapping them must have been freed before.
+void tun_queue_stop(Tun_Queues* queues) {
+    if (queues->stop_fd >= 0) {
+        uint64_t one = 1;
+        if (write(queues->stop_fd, &one, sizeof(one)) < 0) {
+            perror("TUN Queue: Failed to signal workers");
+        }
+    }
+    for (int i = 0; i < TUN_QUEUE_MAX_WORKERS; i++) {
+        if (queues->workers[i].started) {
+            pthread_join(queues->workers[i].thread, NULL);
+            queues->workers[i].started = false;
+        }
+    }
+
+    bool closed;
+    tun_queue_take(queues, &closed);
+    for (int i = 0; i < TUN_QUEUE_MAX_WORKERS; i++) {
+        free(queues->workers[i].buffers);
+        queues->workers[i].buffers = NULL;
+        queues->workers[i].free_buffers = NULL;
+    }
+
+    if (queues->notify_fd >= 0) close(queues->notify_fd);
+    if (queues->stop_fd >= 0) close(queues->stop_fd);
+    queues->notify_fd = -1;
+    queues->stop_fd = -1;
+    queues->count = 0;
+}
+
+// Takes every packet handed over so far, oldest first. The caller wraps each one with
+// tun_queue_packet_pbuf() or gives it back with tun_queue_release().
+Tun_Packet* tun_queue_take(Tun_Queues* queues, bool* closed) {
+    if (queues->notify_fd < 0) {
+        *closed = false;
+        return NULL;
+    }
+
+    uint64_t notifications;
+    if (read(queues->notify_fd, &notifications, sizeof(notifications)) < 0 && errno != EAGAIN) {
+        perror("TUN Queue: Failed to read eventfd");
+    }
+
+    pthread_mutex_lock(&queues->lock);
+    Tun_Packet* head = queues->head;
+    queues->head = NULL;
+    queues->tail = NULL;
+    *closed = queues->closed;
+    pthread_mutex_unlock(&queues->lock);
+    return head;
+}